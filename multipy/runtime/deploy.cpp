@@ -4,15 +4,28 @@
 // This source code is licensed under the BSD-style license found in the
 // LICENSE file in the root directory of this source tree.
 
+#include <c10/util/Logging.h>
 #include <dlfcn.h>
 #include <libgen.h>
+#include <link.h>
 #include <multipy/runtime/Exception.h>
 #include <multipy/runtime/deploy.h>
+#include <multipy/runtime/loader.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <functional>
+#include <future>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <stdexcept>
+#include <thread>
+#include <utility>
 
 // these symbols are generated by cmake, using ld -r -b binary
 // libtorch_deployinterpreter.so which takes the contents of the so and embeds
@@ -51,10 +64,53 @@ const std::initializer_list<ExeSection> multipyTorchSections = {
 const std::initializer_list<InterpreterSymbol> multipyTorchSymbols = {};
 #endif
 
+static double secondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+// Runs fn(0), ..., fn(n - 1) on up to hardware_concurrency threads, one of
+// them the calling thread, and rethrows the first exception any call threw.
+static void parallelFor(size_t n, const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next{0};
+  std::mutex errorMutex;
+  std::exception_ptr error;
+  auto work = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(errorMutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+  };
+  size_t nThreads = std::min<size_t>(
+      n, std::max<size_t>(std::thread::hardware_concurrency(), 1));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nThreads; ++i) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
 InterpreterManager::InterpreterManager(
     size_t nInterp,
-    std::shared_ptr<Environment> env)
-    : resources_(nInterp) {
+    std::shared_ptr<Environment> env,
+    size_t nReady,
+    size_t maxInterp)
+    : resources_(std::max(nInterp, maxInterp)),
+      env_(env),
+      nInterp_(nInterp) {
   C10_LOG_API_USAGE_ONCE("torch.deploy.InterpreterManager");
 
   // disable GIL deadlock detection if it's not set already
@@ -62,26 +118,13 @@ InterpreterManager::InterpreterManager(
   // disable prims/torch.Library support
   setenv("PYTORCH_DISABLE_LIBRARY", "1", /*overwrite*/ 0);
 
-  for (const auto i : c10::irange(nInterp)) {
-#ifdef FBCODE_CAFFE2
-    instances_.emplace_back(this, env);
-#else
-    instances_.emplace_back(env);
-#endif
-    auto I = instances_.back().acquireSession();
-    // make torch.version.interp be the interpreter id
-    // can be used for balancing work across GPUs
-    I.global("torch", "version").attr("__setattr__")({"interp", int(i)});
-    instances_.back().pImpl_->setFindModule(
-        [this](const std::string& name) -> std::optional<std::string> {
-          auto it = registeredModuleSource_.find(name);
-          if (it != registeredModuleSource_.end()) {
-            return it->second;
-          } else {
-            return std::nullopt;
-          }
-        });
-  }
+  startupBegin_ = std::chrono::steady_clock::now();
+  allReady_ = allReadyPromise_.get_future().share();
+  // interpreters are published into the reserved storage as they become
+  // ready, so it must never be reallocated
+  instances_.reserve(resources_.capacity());
+  servingSince_.resize(resources_.capacity());
+  resources_.setResourceLimit(0);
 
   // Pre-registered modules.
   // Since torch::deploy::Obj.toIValue cannot infer empty list, we hack it to
@@ -96,6 +139,396 @@ InterpreterManager::InterpreterManager(
       "    if len(names) == 0:\n"
       "        return None\n"
       "    return names\n");
+
+  // Interpreters are independent copies of python, so they are created
+  // concurrently. The only step that has to run one at a time is serialized
+  // inside of the Interpreter constructor.
+  nReady = nReady == 0 ? nInterp : std::min(nReady, nInterp);
+  bool async = nReady < nInterp;
+  size_t nThreads = std::min<size_t>(
+      nInterp, std::max<size_t>(std::thread::hardware_concurrency(), 1));
+  nStartupWorkers_ = nThreads;
+  // without async startup the calling thread is one of the workers
+  for (size_t i = async ? 0 : 1; i < nThreads; ++i) {
+    startupThreads_.emplace_back([this, env]() { runStartupWorker(env); });
+  }
+  if (nThreads == 0) {
+    allReadyPromise_.set_value();
+  } else if (!async) {
+    runStartupWorker(env);
+  }
+
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock(startupMutex_);
+    startupCv_.wait(lock, [&]() {
+      return instances_.size() >= nReady || startupError_ ||
+          nStartupWorkers_ == 0;
+    });
+    error = startupError_;
+  }
+  if (error || !async) {
+    stopStartup();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void InterpreterManager::runStartupWorker(std::shared_ptr<Environment> env) {
+  for (size_t i = nextInterp_++; i < nInterp_ && !stopStartup_;
+       i = nextInterp_++) {
+    try {
+      auto interp = createInterpreter(env);
+      std::lock_guard<std::mutex> guard(startupMutex_);
+      publishInterpreter(std::move(interp));
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(startupMutex_);
+      if (!startupError_) {
+        startupError_ = std::current_exception();
+      }
+      stopStartup_ = true;
+    }
+    startupCv_.notify_all();
+  }
+
+  std::lock_guard<std::mutex> guard(startupMutex_);
+  if (--nStartupWorkers_ > 0) {
+    return;
+  }
+  startupSeconds_ = secondsSince(startupBegin_);
+  if (startupError_) {
+    allReadyPromise_.set_exception(startupError_);
+  } else if (instances_.size() < nInterp_) {
+    allReadyPromise_.set_exception(std::make_exception_ptr(
+        std::runtime_error("InterpreterManager was destroyed before all "
+                           "interpreters were created")));
+  } else {
+    allReadyPromise_.set_value();
+  }
+  startupCv_.notify_all();
+}
+
+Interpreter InterpreterManager::createInterpreter(
+    const std::shared_ptr<Environment>& env) {
+#ifdef FBCODE_CAFFE2
+  Interpreter interp(this, env);
+#else
+  Interpreter interp(env);
+#endif
+  interp.pImpl_->setFindModule(
+      [this](const std::string& name) -> std::optional<std::string> {
+        auto sources = moduleSources();
+        auto it = sources->find(name);
+        if (it != sources->end()) {
+          return it->second;
+        } else {
+          return std::nullopt;
+        }
+      });
+  return interp;
+}
+
+void InterpreterManager::registerModuleSource(
+    std::string name,
+    std::string src) {
+  std::lock_guard<std::mutex> guard(registeredModuleSourceMutex_);
+  auto sources = std::make_shared<ModuleSources>(*registeredModuleSource_);
+  (*sources)[std::move(name)] = std::move(src);
+  registeredModuleSource_ = std::move(sources);
+}
+
+std::shared_ptr<const InterpreterManager::ModuleSources>
+InterpreterManager::moduleSources() const {
+  std::lock_guard<std::mutex> guard(registeredModuleSourceMutex_);
+  return registeredModuleSource_;
+}
+
+void InterpreterManager::publishInterpreter(Interpreter interp) {
+  // interpreters are numbered in the order in which they become ready so
+  // that the load balancer can hand out any index below the ready count
+  size_t id = instances_.size();
+  {
+    auto I = interp.acquireSession();
+    // make torch.version.interp be the interpreter id
+    // can be used for balancing work across GPUs
+    I.global("torch", "version").attr("__setattr__")({"interp", int(id)});
+  }
+  instances_.emplace_back(std::move(interp));
+  servingSince_[id] = std::chrono::steady_clock::now();
+  nReady_.store(id + 1, std::memory_order_release);
+  resources_.setResourceLimit(id + 1);
+}
+
+void InterpreterManager::resize(size_t n) {
+  MULTIPY_CHECK(
+      n >= 1 && n <= resources_.capacity(),
+      "cannot resize the pool to " + std::to_string(n) +
+          " interpreters, it holds between 1 and " +
+          std::to_string(resources_.capacity()));
+  std::lock_guard<std::mutex> resizeGuard(resizeMutex_);
+  // the pool only changes size once startup is done with it
+  allReady_.wait();
+
+  size_t current = readyInstances().size();
+  if (n > current) {
+    parallelFor(n - current, [this](size_t /*i*/) {
+      auto interp = createInterpreter(env_);
+      std::lock_guard<std::mutex> guard(startupMutex_);
+      publishInterpreter(std::move(interp));
+    });
+  }
+
+  while (readyInstances().size() > n) {
+    size_t last = readyInstances().size() - 1;
+    // stop handing it out, then wait for its current users to finish
+    resources_.setResourceLimit(last);
+    nReady_.store(last, std::memory_order_release);
+    while (resources_.inUse(last)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::optional<Interpreter> retired;
+    {
+      std::unique_lock<std::shared_mutex> instancesGuard(instancesMutex_);
+      std::lock_guard<std::mutex> guard(startupMutex_);
+      retired.emplace(std::move(instances_.back()));
+      instances_.pop_back();
+    }
+  }
+}
+
+void InterpreterManager::setElasticPolicy(ElasticPoolPolicy policy) {
+  MULTIPY_CHECK(
+      policy.minInterp >= 1 && policy.minInterp <= policy.maxInterp &&
+          policy.maxInterp <= resources_.capacity(),
+      "elastic pool bounds must satisfy 1 <= minInterp <= maxInterp <= " +
+          std::to_string(resources_.capacity()));
+  clearElasticPolicy();
+  stopElastic_ = false;
+  elasticThread_ = std::thread([this, policy]() { runElasticPolicy(policy); });
+}
+
+void InterpreterManager::clearElasticPolicy() {
+  {
+    std::lock_guard<std::mutex> guard(elasticMutex_);
+    stopElastic_ = true;
+  }
+  elasticCv_.notify_all();
+  if (elasticThread_.joinable()) {
+    elasticThread_.join();
+  }
+}
+
+void InterpreterManager::runElasticPolicy(ElasticPoolPolicy policy) {
+  uint64_t lastContended = resources_.numContended();
+  auto lastBusy = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(elasticMutex_);
+  while (!elasticCv_.wait_for(
+      lock, policy.period, [this]() { return stopElastic_; })) {
+    lock.unlock();
+    auto now = std::chrono::steady_clock::now();
+    size_t size = readyInstances().size();
+    uint64_t contended = resources_.numContended();
+    // the pool is considered busy unless two interpreters are idle, so that
+    // shrinking it still leaves one spare interpreter
+    if (resources_.numInUse() + 2 > size) {
+      lastBusy = now;
+    }
+    size_t target = size;
+    if (contended - lastContended >= policy.growContended) {
+      target = size + 1;
+      lastBusy = now;
+    } else if (now - lastBusy >= policy.shrinkIdle) {
+      target = size - 1;
+      lastBusy = now;
+    }
+    target = std::min(std::max(target, policy.minInterp), policy.maxInterp);
+    lastContended = contended;
+    if (target != size) {
+      try {
+        resize(target);
+      } catch (const std::exception& e) {
+        LOG(WARNING) << "failed to resize the interpreter pool to " << target
+                     << ": " << e.what();
+      }
+    }
+    lock.lock();
+  }
+}
+
+void InterpreterManager::replaceInterpreter(size_t id) {
+  std::lock_guard<std::mutex> resizeGuard(resizeMutex_);
+  replaceInterpreterLocked(id);
+}
+
+void InterpreterManager::replaceInterpreterLocked(size_t id) {
+  allReady_.wait();
+  MULTIPY_CHECK(
+      id < readyInstances().size(),
+      "no interpreter with id " + std::to_string(id) + " to replace");
+
+  // build and warm up the replacement while the old interpreter still serves
+  auto replacement = createInterpreter(env_);
+  auto objects = liveReplicatedObjects();
+  {
+    auto I = replacement.acquireSession();
+    I.global("torch", "version").attr("__setattr__")({"interp", int(id)});
+    for (const auto& source : *moduleSources()) {
+      I.global("importlib", "import_module")({source.first});
+    }
+    for (const auto& obj : objects) {
+      I.fromMovable(ReplicatedObj(obj));
+    }
+  }
+  std::vector<std::pair<int64_t, std::weak_ptr<ReplicatedObjImpl>>> warmed;
+  for (const auto& obj : objects) {
+    warmed.emplace_back(obj->objectId_, obj);
+  }
+  objects.clear();
+
+  // stop handing out the old interpreter and wait for its users to finish
+  resources_.disable(id);
+  while (resources_.inUse(id)) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  std::optional<Interpreter> retired;
+  {
+    std::unique_lock<std::shared_mutex> guard(instancesMutex_);
+    retired.emplace(std::move(instances_[id]));
+    instances_[id] = std::move(replacement);
+    servingSince_[id] = std::chrono::steady_clock::now();
+  }
+  resources_.enable(id);
+
+  {
+    // objects which died while the replacement was warming up could not
+    // unload themselves from it
+    auto I = instances_[id].acquireSession();
+    auto deployObjects = I.global("multipy.utils._deploy", "_deploy_objects");
+    for (const auto& obj : warmed) {
+      if (obj.second.expired()) {
+        deployObjects.attr("pop")({at::IValue(obj.first), at::IValue()});
+      }
+    }
+  }
+  // the old interpreter is torn down only after its replacement serves
+}
+
+std::vector<std::shared_ptr<ReplicatedObjImpl>>
+InterpreterManager::liveReplicatedObjects() {
+  std::lock_guard<std::mutex> guard(replicatedObjectsMutex_);
+  std::vector<std::shared_ptr<ReplicatedObjImpl>> objects;
+  for (const auto& obj : replicatedObjects_) {
+    if (auto impl = obj.lock()) {
+      objects.push_back(std::move(impl));
+    }
+  }
+  return objects;
+}
+
+void InterpreterManager::setReplacementPolicy(ReplacementPolicy policy) {
+  clearReplacementPolicy();
+  stopReplacement_ = false;
+  replacementThread_ =
+      std::thread([this, policy]() { runReplacementPolicy(policy); });
+}
+
+void InterpreterManager::clearReplacementPolicy() {
+  {
+    std::lock_guard<std::mutex> guard(replacementMutex_);
+    stopReplacement_ = true;
+  }
+  replacementCv_.notify_all();
+  if (replacementThread_.joinable()) {
+    replacementThread_.join();
+  }
+}
+
+void InterpreterManager::runReplacementPolicy(ReplacementPolicy policy) {
+  std::unique_lock<std::mutex> lock(replacementMutex_);
+  while (!replacementCv_.wait_for(
+      lock, policy.period, [this]() { return stopReplacement_; })) {
+    lock.unlock();
+    std::lock_guard<std::mutex> resizeGuard(resizeMutex_);
+    for (size_t id = 0; id < readyInstances().size(); ++id) {
+      bool replace = policy.maxAge.count() > 0 &&
+          std::chrono::steady_clock::now() - servingSince_[id] >=
+              policy.maxAge;
+      try {
+        if (!replace && policy.maxAllocatedBlocks > 0) {
+          auto I = readyInstances()[id].acquireSession();
+          int64_t blocks = I.global("sys", "getallocatedblocks")(
+                                at::ArrayRef<at::IValue>{})
+                               .toIValue()
+                               .toInt();
+          replace = blocks > policy.maxAllocatedBlocks;
+        }
+        if (replace) {
+          replaceInterpreterLocked(id);
+        }
+      } catch (const std::exception& e) {
+        LOG(WARNING) << "failed to replace interpreter " << id << ": "
+                     << e.what();
+      }
+      {
+        std::lock_guard<std::mutex> guard(replacementMutex_);
+        if (stopReplacement_) {
+          break;
+        }
+      }
+    }
+    lock.lock();
+  }
+}
+
+void InterpreterManager::stopStartup() {
+  stopStartup_ = true;
+  for (auto& thread : startupThreads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  startupThreads_.clear();
+}
+
+void InterpreterManager::destroyInstances() {
+  {
+    // objects outliving the manager have nothing left to unload from
+    std::lock_guard<std::mutex> guard(replicatedObjectsMutex_);
+    for (auto& weak : replicatedObjects_) {
+      if (auto obj = weak.lock()) {
+        obj->manager_ = nullptr;
+      }
+    }
+    replicatedObjects_.clear();
+  }
+  resources_.setResourceLimit(0);
+  nReady_.store(0, std::memory_order_release);
+  // waits for whoever still walks allInstances(), e.g. an object unloading
+  // itself, and keeps them away from the interpreters from now on
+  std::unique_lock<std::shared_mutex> instancesGuard(instancesMutex_);
+
+  if (fastExit_) {
+    for (auto& interp : instances_) {
+      interp.abandon();
+    }
+    instances_.clear();
+    return;
+  }
+
+  // every interpreter finalizes its own copy of python, see ~Interpreter
+  parallelFor(instances_.size(), [this](size_t i) {
+    Interpreter retired(std::move(instances_[i]));
+  });
+  instances_.clear();
+}
+
+InterpreterManager::~InterpreterManager() {
+  // interpreters which are still being created refer to this manager
+  clearReplacementPolicy();
+  clearElasticPolicy();
+  stopStartup();
+  destroyInstances();
 }
 
 Package InterpreterManager::loadPackage(const std::string& uri) {
@@ -113,12 +546,13 @@ Obj InterpreterSession::fromMovable(const ReplicatedObj& obj) {
 
 InterpreterSession ReplicatedObj::acquireSession(
     const Interpreter* onThisInterpreter) const {
+  InterpreterManager* manager = pImpl_->manager_;
   MULTIPY_CHECK(
-      (pImpl_->manager_ || onThisInterpreter),
+      (manager || onThisInterpreter),
       "ReplicatedObjImpl needs an interpreter or needs to be associated with an InterpreterManager in order to use this functionality without onThisInterpreter. \
       This behavior may be deprecated in the future and holds no backwards compatibility guarentees.");
   InterpreterSession I = onThisInterpreter ? onThisInterpreter->acquireSession()
-                                           : pImpl_->manager_->acquireOne();
+                                           : manager->acquireOne();
   I.self = I.fromMovable(*this);
   return I;
 }
@@ -138,6 +572,9 @@ bool InterpreterSession::attachDeconstructorCallback(
 
 // NOLINTNEXTLINE(bugprone-exception-escape)
 InterpreterSession::~InterpreterSession() {
+  if (impl_) {
+    --heldOnThisThread_;
+  }
   if (deconstruction_callback_ != nullptr) {
     deconstruction_callback_();
   }
@@ -145,13 +582,12 @@ InterpreterSession::~InterpreterSession() {
 
 void ReplicatedObjImpl::unload(const Interpreter* onThisInterpreter) {
   if (!onThisInterpreter) {
+    InterpreterManager* manager = manager_;
     // NOLINTNEXTLINE(clang-analyzer-core.NullDereference)
     MULTIPY_CHECK(
-        manager_,
+        manager,
         "ReplicatedObjImpl must be created from an InterpreterManager in order to unload without an interpreter");
-    for (auto& interp : manager_->allInstances()) {
-      unload(&interp);
-    }
+    unloadAll(manager);
     return;
   }
 
@@ -159,9 +595,29 @@ void ReplicatedObjImpl::unload(const Interpreter* onThisInterpreter) {
   I.impl_->unload(objectId_);
 }
 
+void ReplicatedObjImpl::unloadAll(InterpreterManager* manager) {
+  // keeps interpreters from being swapped out or destroyed while we unload
+  // from them
+  std::shared_lock<std::shared_mutex> guard(manager->instancesMutex_);
+  auto instances = manager->allInstances();
+  if (InterpreterSession::heldOnThisThread_ > 0) {
+    // only this thread can take the GIL of the interpreter it is in
+    for (auto& interp : instances) {
+      unload(&interp);
+    }
+    return;
+  }
+  // every interpreter has a GIL of its own
+  parallelFor(instances.size(), [&](size_t i) { unload(&instances[i]); });
+}
+
 // NOLINTNEXTLINE(bugprone-exception-escape)
 ReplicatedObjImpl::~ReplicatedObjImpl() {
-  unload(nullptr);
+  // objects outliving their manager were detached from it when it was
+  // destroyed, whether or not it exited fast
+  if (InterpreterManager* manager = manager_) {
+    unloadAll(manager);
+  }
 }
 
 void ReplicatedObj::unload(const Interpreter* onThisInterpreter) {
@@ -193,8 +649,22 @@ ReplicatedObj InterpreterManager::createMovable(
       I->isOwner(obj),
       "Cannot create movable from an object that lives in different session");
   PickledObject pickled = I->pickleObj(obj);
-  return ReplicatedObj(std::make_shared<ReplicatedObjImpl>(
-      I->nextObjectId_++, std::move(pickled), this));
+  auto impl = std::make_shared<ReplicatedObjImpl>(
+      I->nextObjectId_++, std::move(pickled), this);
+  {
+    // remembered so that replacement interpreters can load it up front
+    std::lock_guard<std::mutex> guard(replicatedObjectsMutex_);
+    replicatedObjects_.erase(
+        std::remove_if(
+            replicatedObjects_.begin(),
+            replicatedObjects_.end(),
+            [](const std::weak_ptr<ReplicatedObjImpl>& obj) {
+              return obj.expired();
+            }),
+        replicatedObjects_.end());
+    replicatedObjects_.emplace_back(impl);
+  }
+  return ReplicatedObj(std::move(impl));
 }
 
 PickledObject InterpreterSession::pickleObj(Obj obj) {
@@ -204,6 +674,71 @@ PickledObject InterpreterSession::pickleObj(Obj obj) {
   return impl_->pickle(self, obj);
 }
 
+// Interpreters share the libraries of the host process (e.g. libtorch), so the
+// part of their startup which registers state in those libraries must not run
+// concurrently. The lock lives here because each interpreter is its own copy
+// of libtorch_deployinterpreter and has no globals in common with the others.
+static std::mutex& interpreterStartLock() {
+  static std::mutex lock;
+  return lock;
+}
+
+std::vector<InterpreterStartupStats> InterpreterManager::startupStats() const {
+  // keeps interpreters from being retired or swapped out while we copy
+  std::shared_lock<std::shared_mutex> guard(instancesMutex_);
+  auto instances = readyInstances();
+  std::vector<InterpreterStartupStats> stats;
+  stats.reserve(instances.size());
+  for (const auto& interp : instances) {
+    stats.push_back(interp.startupStats());
+  }
+  return stats;
+}
+
+void InterpreterManager::logStartupStats() const {
+  auto stats = startupStats();
+  double startupSeconds = 0;
+  {
+    std::lock_guard<std::mutex> guard(startupMutex_);
+    startupSeconds = startupSeconds_;
+  }
+  LOG(INFO) << "InterpreterManager started " << stats.size()
+            << " interpreters in " << startupSeconds << "s";
+  if (stats.empty()) {
+    return;
+  }
+  const std::pair<const char*, double InterpreterStartupStats::*> phases[] = {
+      {"extractPayload", &InterpreterStartupStats::extractPayload},
+      {"loadLibrary", &InterpreterStartupStats::loadLibrary},
+      {"initializePython", &InterpreterStartupStats::initializePython},
+      {"loadPlugins", &InterpreterStartupStats::loadPlugins},
+      {"postInitialization", &InterpreterStartupStats::postInitialization},
+      {"startLockWait", &InterpreterStartupStats::startLockWait},
+      {"startScript", &InterpreterStartupStats::startScript},
+      {"configureInterpreter", &InterpreterStartupStats::configureInterpreter},
+      {"total", &InterpreterStartupStats::total},
+  };
+  for (const auto& phase : phases) {
+    double sum = 0;
+    double max = 0;
+    for (const auto& s : stats) {
+      double seconds = s.*phase.second;
+      sum += seconds;
+      max = std::max(max, seconds);
+    }
+    LOG(INFO) << "  " << phase.first << ": mean " << sum / stats.size()
+              << "s, max " << max << "s";
+  }
+  LOG(INFO) << "  relocations: " << stats.front().relocations
+            << " per interpreter";
+  auto symbols = symbol_cache_stats();
+  uint64_t lookups = symbols.hits + symbols.misses;
+  LOG(INFO) << "  symbol cache: " << symbols.hits << " hits, "
+            << symbols.misses << " misses ("
+            << (lookups ? 100.0 * symbols.hits / lookups : 0.0)
+            << "% hit rate), saved about " << symbols.saved_seconds() << "s";
+}
+
 using dlopen_t = void* (*)(const char*, int);
 
 // ASAN overrides dlopen and errors when it sees the RTLD_DEEPBIND flags because
@@ -226,16 +761,48 @@ static dlopen_t find_real_dlopen() {
   return dlopen_;
 }
 
+static EmbeddedFile extractInterpreterFile(InterpreterStartupStats& stats) {
+  auto begin = std::chrono::steady_clock::now();
+  EmbeddedFile file(
+      "interpreter", pythonInterpreterSections, pythonInterpreterSymbols);
+  stats.extractPayload += secondsSince(begin);
+  return file;
+}
+
+// Counts the relocations the dynamic linker processed for `handle`.
+static size_t countRelocations(void* handle) {
+  struct link_map* map = nullptr;
+  if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || !map) {
+    return 0;
+  }
+  size_t relaSize = 0;
+  size_t pltRelSize = 0;
+  size_t relaEntSize = sizeof(Elf64_Rela);
+  for (const ElfW(Dyn)* dyn = map->l_ld; dyn->d_tag != DT_NULL; ++dyn) {
+    switch (dyn->d_tag) {
+      case DT_RELASZ:
+        relaSize = dyn->d_un.d_val;
+        break;
+      case DT_PLTRELSZ:
+        pltRelSize = dyn->d_un.d_val;
+        break;
+      case DT_RELAENT:
+        relaEntSize = dyn->d_un.d_val;
+        break;
+    }
+  }
+  return (relaSize + pltRelSize) / relaEntSize;
+}
+
 Interpreter::Interpreter(
     InterpreterManager* manager,
     std::shared_ptr<Environment> env)
     : handle_(nullptr),
       manager_(manager),
       env_(env),
-      interpreterFile_(
-          "interpreter",
-          pythonInterpreterSections,
-          pythonInterpreterSymbols) {
+      interpreterFile_(extractInterpreterFile(startupStats_)) {
+  auto begin = std::chrono::steady_clock::now();
+  double startupSeconds = startupStats_.extractPayload;
   int flags = RTLD_LOCAL | RTLD_LAZY;
   if (interpreterFile_.customLoader) {
     flags |= RTLD_DEEPBIND;
@@ -251,6 +818,8 @@ Interpreter::Interpreter(
   if (!handle_) {
     throw std::runtime_error(dlerror());
   }
+  startupStats_.loadLibrary = secondsSince(begin);
+  startupStats_.relocations = countRelocations(handle_);
 
   if (interpreterFile_.customLoader) {
     // when using the custom loader we need to link python symbols against
@@ -262,27 +831,52 @@ Interpreter::Interpreter(
     deploySetSelfPtr(handle_);
   }
 
-  std::vector<std::string> pluginPaths;
+  std::vector<PluginFile> plugins;
 #ifndef FBCODE_CAFFE2
+  auto extractBegin = std::chrono::steady_clock::now();
+  // plugins are only ever loaded by the custom loader, which can map them
+  // straight out of the executable
   torchPluginFile_.emplace(
-      "multipy_torch", multipyTorchSections, multipyTorchSymbols);
-  pluginPaths.emplace_back(torchPluginFile_->libraryName);
+      "multipy_torch",
+      multipyTorchSections,
+      multipyTorchSymbols,
+      /*inPlace=*/true);
+  plugins.push_back(PluginFile{
+      torchPluginFile_->libraryName,
+      torchPluginFile_->libraryOffset,
+      torchPluginFile_->librarySize});
+  startupStats_.extractPayload += secondsSince(extractBegin);
 #endif
 
   auto extraPythonPaths = env_->getExtraPythonPaths();
   void* newInterpreterImpl = dlsym(handle_, "newInterpreterImpl");
   AT_ASSERT(newInterpreterImpl);
   pImpl_ = std::unique_ptr<InterpreterImpl>(
-      ((InterpreterImpl *
-        (*)(const std::vector<std::string>&, const std::vector<std::string>&))
-           newInterpreterImpl)(extraPythonPaths, pluginPaths));
+      ((InterpreterImpl * (*)(const std::vector<std::string>&,
+                              const std::vector<PluginFile>&,
+                              std::mutex&,
+                              InterpreterStartupStats&)) newInterpreterImpl)(
+          extraPythonPaths, plugins, interpreterStartLock(), startupStats_));
+
+  auto configureBegin = std::chrono::steady_clock::now();
   env_->configureInterpreter(this);
+  startupStats_.configureInterpreter = secondsSince(configureBegin);
+  startupStats_.total = startupSeconds + secondsSince(begin);
 }
 
 Interpreter::~Interpreter() {
   if (handle_) {
-    // ensure python uninitialization runs before we dlclose the library
+    // ensure python uninitialization runs before we dlclose the library. It
+    // only frees what this copy of python owns, including its references into
+    // the libraries shared by the whole process, which the interpreters do
+    // concurrently all the time, so it overlaps with other teardowns.
     pImpl_.reset();
+    // Unloading the libraries runs their static destructors, which undo what
+    // the start script registered in the shared libraries, so like the start
+    // script they must not run concurrently. dlclose holds the lock of the
+    // dynamic loader anyway, and startup_benchmark shows how little of the
+    // teardown stays serialized.
+    std::lock_guard<std::mutex> guard(interpreterStartLock());
     if (interpreterFile_.customLoader) {
       auto deploy_flush_python_libs =
           (void (*)())dlsym(handle_, "deploy_flush_python_libs");
@@ -292,39 +886,90 @@ Interpreter::~Interpreter() {
   }
 }
 
+void Interpreter::abandon() {
+  // NOLINTNEXTLINE(bugprone-unused-return-value)
+  pImpl_.release();
+  handle_ = nullptr;
+}
+
 int LoadBalancer::acquire() {
   thread_local int last = 0;
-  size_t minusers = SIZE_MAX;
-  int minIdx = 0;
-  for (size_t i = 0; i < n_; ++i, ++last) {
-    if (last >= static_cast<int>(n_)) {
-      last = 0;
+  while (true) {
+    size_t minusers = SIZE_MAX;
+    int minIdx = 0;
+    int where = -1;
+    bool shared = false;
+    size_t n = n_.load(std::memory_order_seq_cst);
+    if (n == 0) {
+      // nothing to hand out, e.g. while the manager is being destroyed
+      std::this_thread::yield();
+      continue;
+    }
+    for (size_t i = 0; i < n; ++i, ++last) {
+      if (last >= static_cast<int>(n)) {
+        last = 0;
+      }
+      uint64_t prev = 0;
+      bool acquired = __atomic_compare_exchange_n(
+          &uses_[8 * last],
+          &prev,
+          1ULL,
+          false,
+          __ATOMIC_SEQ_CST,
+          __ATOMIC_SEQ_CST);
+      if (acquired) {
+        // fast path, we found an interpreter with no users
+        where = last;
+        break;
+      }
+      // slow path, we don't want to use this interpreter because it is being
+      // used by someone else.
+
+      if (prev < minusers) {
+        minusers = prev;
+        minIdx = last;
+      }
     }
-    uint64_t prev = 0;
-    bool acquired = __atomic_compare_exchange_n(
-        &uses_[8 * last],
-        &prev,
-        1ULL,
-        false,
-        __ATOMIC_SEQ_CST,
-        __ATOMIC_SEQ_CST);
-    if (acquired) {
-      // fast path, we found an interpreter with no users
-      return last;
+    if (where == -1) {
+      // we failed to find a completely free interpreter. heuristically use
+      // the one with the least number of user (note that this may have
+      // changed since then, so this is only a heuristic).
+      uint64_t prev =
+          __atomic_fetch_add(&uses_[8 * minIdx], 1ULL, __ATOMIC_SEQ_CST);
+      where = minIdx;
+      shared = true;
+      if ((prev & kDisabled) != 0) {
+        // every interpreter is disabled, wait for one to come back
+        free(where);
+        std::this_thread::yield();
+        continue;
+      }
     }
-    // slow path, we don't want to use this interpreter because it is being
-    // used by someone else.
+    // the limit may have been lowered while we were acquiring, in which case
+    // the interpreter is about to be retired and must not be used
+    if (static_cast<size_t>(where) >= n_.load(std::memory_order_seq_cst)) {
+      free(where);
+      continue;
+    }
+    if (shared) {
+      // only counted once the shared interpreter is known to be usable, so
+      // that waiting out a disabled or retired interpreter is not mistaken
+      // for demand
+      contended_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return where;
+  }
+}
 
-    if (prev < minusers) {
-      minusers = prev;
-      minIdx = last;
+size_t LoadBalancer::numInUse() const {
+  size_t n = n_.load(std::memory_order_seq_cst);
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (inUse(i)) {
+      ++count;
     }
   }
-  // we failed to find a completely free interpreter. heuristically use the
-  // one with the least number of user (note that this may have changed since
-  // then, so this is only a heuristic).
-  __atomic_fetch_add(&uses_[8 * minIdx], 1ULL, __ATOMIC_SEQ_CST);
-  return minIdx;
+  return count;
 }
 
 void LoadBalancer::free(int where) {
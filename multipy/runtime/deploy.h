@@ -11,10 +11,16 @@
 #include <multipy/runtime/noop_environment.h>
 #include <torch/csrc/api/include/torch/imethod.h>
 #include <torch/csrc/jit/serialization/import.h>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -23,6 +29,7 @@ namespace torch {
 namespace deploy {
 
 struct ReplicatedObj;
+struct ReplicatedObjImpl;
 struct InterpreterManager;
 struct LoadBalancer;
 
@@ -30,11 +37,15 @@ struct TORCH_API InterpreterSession {
   friend struct LoadBalancer;
 
   explicit InterpreterSession(InterpreterSessionImpl* impl) noexcept
-      : impl_(impl), manager_(nullptr) {}
+      : impl_(impl), manager_(nullptr) {
+    ++heldOnThisThread_;
+  }
   InterpreterSession(
       InterpreterSessionImpl* impl,
       InterpreterManager* manager) noexcept
-      : impl_(impl), manager_(manager) {}
+      : impl_(impl), manager_(manager) {
+    ++heldOnThisThread_;
+  }
 
   /// Returns true if `obj` belongs to this `InterpreterSession`
   bool isOwner(Obj obj) {
@@ -74,6 +85,8 @@ struct TORCH_API InterpreterSession {
   friend struct InterpreterManager;
   friend struct ReplicatedObjImpl;
   inline static size_t nextObjectId_ = 0;
+  // sessions hold the GIL of their interpreter, which other threads wait for
+  inline static thread_local size_t heldOnThisThread_ = 0;
   std::unique_ptr<InterpreterSessionImpl> impl_;
   InterpreterManager* manager_; /// if created from one
   std::function<void()> deconstruction_callback_ = nullptr;
@@ -89,6 +102,8 @@ class TORCH_API Interpreter {
   std::unique_ptr<InterpreterImpl> pImpl_;
   InterpreterManager* manager_; /// optional if managed by one
   std::shared_ptr<Environment> env_;
+  // declared before interpreterFile_, whose extraction it records
+  InterpreterStartupStats startupStats_;
 
   EmbeddedFile interpreterFile_;
   std::optional<EmbeddedFile> torchPluginFile_;
@@ -112,20 +127,46 @@ class TORCH_API Interpreter {
     }
   }
 
+  /// Returns how long each phase of creating this Interpreter took.
+  const InterpreterStartupStats& startupStats() const {
+    return startupStats_;
+  }
+
   ~Interpreter();
   Interpreter(Interpreter&& rhs) noexcept
       : handle_(rhs.handle_),
         pImpl_(std::move(rhs.pImpl_)),
         manager_(rhs.manager_),
+        env_(std::move(rhs.env_)),
+        startupStats_(rhs.startupStats_),
         interpreterFile_(std::move(rhs.interpreterFile_)),
         torchPluginFile_(std::move(rhs.torchPluginFile_)) {
     rhs.handle_ = nullptr;
   }
 
+  Interpreter& operator=(Interpreter&& rhs) noexcept {
+    if (this != &rhs) {
+      // tears down the interpreter this currently holds
+      Interpreter old(std::move(*this));
+      handle_ = rhs.handle_;
+      pImpl_ = std::move(rhs.pImpl_);
+      manager_ = rhs.manager_;
+      env_ = std::move(rhs.env_);
+      startupStats_ = rhs.startupStats_;
+      interpreterFile_ = std::move(rhs.interpreterFile_);
+      torchPluginFile_ = std::move(rhs.torchPluginFile_);
+      rhs.handle_ = nullptr;
+    }
+    return *this;
+  }
+
   Interpreter(const Interpreter&) = delete;
   Interpreter& operator=(const Interpreter&) = delete;
-  Interpreter& operator=(Interpreter&&) = delete;
   friend struct InterpreterManager;
+
+ private:
+  // gives up the interpreter without finalizing python or unloading it
+  void abandon();
 };
 
 struct Package;
@@ -137,14 +178,20 @@ struct TORCH_API LoadBalancer {
   explicit LoadBalancer(size_t n)
       : uses_(new uint64_t[8 * n]), allocated_(n), n_(n) {
     /// 8*... to avoid false sharing of atomics on the same cache line
-    memset(uses_.get(), 0, 8 * n_ * sizeof(uint64_t));
+    memset(uses_.get(), 0, 8 * n * sizeof(uint64_t));
+  }
+
+  /// Returns the largest number of interpreters this can handle.
+  size_t capacity() const {
+    return allocated_;
   }
 
   /// Changes the amount of subinterpreters which is handled by the load
-  /// balancer.
+  /// balancer. Safe to call while other threads acquire interpreters: once
+  /// this returns, no interpreter at or above `n` is handed out anymore.
   void setResourceLimit(size_t n) {
     MULTIPY_INTERNAL_ASSERT(n <= allocated_);
-    n_ = n;
+    n_.store(n, std::memory_order_seq_cst);
   }
 
   /// Allocates an subinterpreter, and return its ID which is used to free it.
@@ -154,12 +201,75 @@ struct TORCH_API LoadBalancer {
   /// `LoadBalancer::acquire()`
   void free(int where);
 
+  /// Returns whether the subinterpreter with ID `where` is acquired.
+  bool inUse(size_t where) const {
+    return numUsers(where) != 0;
+  }
+
+  /// Returns how many times the subinterpreter with ID `where` is acquired.
+  uint64_t numUsers(size_t where) const {
+    return __atomic_load_n(&uses_[8 * where], __ATOMIC_SEQ_CST) &
+        (kDisabled - 1);
+  }
+
+  /// Stops handing out the subinterpreter with ID `where` until `enable` is
+  /// called. Whoever already acquired it keeps it.
+  void disable(size_t where) {
+    __atomic_fetch_add(&uses_[8 * where], kDisabled, __ATOMIC_SEQ_CST);
+  }
+
+  /// Hands out the subinterpreter with ID `where` again after `disable`.
+  void enable(size_t where) {
+    __atomic_fetch_sub(&uses_[8 * where], kDisabled, __ATOMIC_SEQ_CST);
+  }
+
+  /// Returns how many of the handled subinterpreters are acquired.
+  size_t numInUse() const;
+
+  /// Returns how many times `acquire()` found no free subinterpreter and had
+  /// to share one.
+  uint64_t numContended() const {
+    return contended_.load(std::memory_order_relaxed);
+  }
+
  private:
+  // added to the use count of a disabled interpreter, which makes it look
+  // busier than any interpreter which is actually in use
+  static constexpr uint64_t kDisabled = 1ULL << 32;
+
   // NOLINTNEXTLINE(modernize-avoid-c-arrays,cppcoreguidelines-avoid-c-arrays)
   std::unique_ptr<uint64_t[]>
       uses_; /// the approximate count of the number of users of interpreter
   size_t allocated_;
-  size_t n_;
+  std::atomic<size_t> n_;
+  std::atomic<uint64_t> contended_{0};
+};
+
+/// Controls how an `InterpreterManager` sizes its pool at runtime, see
+/// `InterpreterManager::setElasticPolicy`.
+struct ElasticPoolPolicy {
+  size_t minInterp{1};
+  size_t maxInterp{1};
+  /// how often contention and usage are sampled
+  std::chrono::milliseconds period{1000};
+  /// grow by one interpreter when at least this many acquisitions in a
+  /// period found no free interpreter
+  uint64_t growContended{1};
+  /// retire one interpreter after at least two have been idle at every
+  /// sample for this long
+  std::chrono::milliseconds shrinkIdle{60000};
+};
+
+/// Controls when an `InterpreterManager` replaces its interpreters with fresh
+/// ones, see `InterpreterManager::setReplacementPolicy`.
+struct ReplacementPolicy {
+  /// replace an interpreter once it has served for this long, 0 to disable
+  std::chrono::milliseconds maxAge{0};
+  /// replace an interpreter once python reports more than this many
+  /// allocated memory blocks (`sys.getallocatedblocks()`), 0 to disable
+  int64_t maxAllocatedBlocks{0};
+  /// how often the interpreters are checked
+  std::chrono::milliseconds period{10000};
 };
 
 /// An `InterpreterManager` handles the interaction of multiple subinterpreters
@@ -168,9 +278,23 @@ struct TORCH_API InterpreterManager {
   /// constructor for `InterpreterManager` which takes the number of
   /// interpreters (usually correlates to number of cores on your cpu), and a
   /// pointer to an `Environment`. The default uses the local python env.
+  /// The interpreters are created concurrently on up to
+  /// `std::thread::hardware_concurrency()` threads.
+  ///
+  /// If `nReady` is non-zero, the constructor returns as soon as that many
+  /// interpreters are ready and the rest are created in the background.
+  /// Only ready interpreters are handed out or listed by `allInstances()`,
+  /// and `allReady()` reports when the whole pool is up.
+  ///
+  /// `maxInterp` is how large the pool can later grow with `resize()`, by
+  /// default it cannot grow beyond `nInterp`.
   explicit InterpreterManager(
       size_t nInterp = 2,
-      std::shared_ptr<Environment> env = std::make_shared<NoopEnvironment>());
+      std::shared_ptr<Environment> env = std::make_shared<NoopEnvironment>(),
+      size_t nReady = 0,
+      size_t maxInterp = 0);
+
+  ~InterpreterManager();
 
   /// Returns a free interpreter or an arbitrary interpreter if there are
   /// none free. To ensure data safety it's best to match the number of
@@ -187,16 +311,77 @@ struct TORCH_API InterpreterManager {
   /// use to make sure something gets run on all interpreters, such as loading
   /// or unloading a model eagerly
   at::ArrayRef<Interpreter> allInstances() {
-    return instances_;
+    return readyInstances();
+  }
+
+  /// Returns a future which is ready once every interpreter has been created,
+  /// or which holds the error that stopped their creation.
+  std::shared_future<void> allReady() const {
+    return allReady_;
+  }
+
+  /// Grows or shrinks the pool to `n` interpreters, up to the `maxInterp`
+  /// given to the constructor. New interpreters are created concurrently and
+  /// handed out as soon as each is ready. Interpreters are retired from the
+  /// end of the pool: they stop being handed out, and are destroyed once
+  /// their current sessions from `acquireOne()` are released. Sessions
+  /// acquired directly from `allInstances()` must not outlive a shrink.
+  void resize(size_t n);
+
+  /// Returns the number of interpreters the pool can grow to.
+  size_t maxInterpreters() const {
+    return resources_.capacity();
+  }
+
+  /// Starts resizing the pool automatically between `policy.minInterp` and
+  /// `policy.maxInterp` interpreters based on the contention observed by
+  /// `acquireOne()`. Replaces any previous policy.
+  void setElasticPolicy(ElasticPoolPolicy policy);
+
+  /// Stops resizing the pool automatically.
+  void clearElasticPolicy();
+
+  /// Replaces the interpreter with ID `id` without taking the pool down. The
+  /// replacement is created in the calling thread while the old interpreter
+  /// keeps serving, and gets the registered module sources imported and the
+  /// live `ReplicatedObj`s loaded. The old interpreter then stops being
+  /// handed out, and is swapped out and destroyed once its sessions from
+  /// `acquireOne()` are released. Sessions acquired directly from
+  /// `allInstances()` must not outlive the swap.
+  void replaceInterpreter(size_t id);
+
+  /// Starts replacing interpreters automatically, one at a time, whenever
+  /// one exceeds the limits of `policy`. Replaces any previous policy.
+  void setReplacementPolicy(ReplacementPolicy policy);
+
+  /// Stops replacing interpreters automatically.
+  void clearReplacementPolicy();
+
+  /// When `fastExit` is set, destroying this manager skips finalizing python
+  /// and unloading the interpreters, and the `ReplicatedObj`s outliving it do
+  /// not unload themselves either. Their memory is simply left to the OS, so
+  /// only use this when the process is about to exit anyway. Until then,
+  /// objects keep unloading themselves as usual. Otherwise the interpreters
+  /// are finalized one at a time and unloaded concurrently.
+  void setFastExit(bool fastExit) {
+    fastExit_ = fastExit;
   }
 
   /// debugging tool to control the size of the loadBalancer
   /// and change the number of interpreters on the fly
   void debugLimitInterpreters(size_t N) {
-    AT_ASSERT(N <= instances_.size());
+    AT_ASSERT(N <= allInstances().size());
     resources_.setResourceLimit(N);
   }
 
+  /// Returns how long each phase of creating every interpreter took, in the
+  /// same order as `allInstances()`.
+  std::vector<InterpreterStartupStats> startupStats() const;
+
+  /// Logs how long the constructor took, along with the mean and the maximum
+  /// of each phase in `startupStats()`.
+  void logStartupStats() const;
+
   /// loads a package from a file with name `uri`
   Package loadPackage(const std::string& uri);
 
@@ -210,14 +395,13 @@ struct TORCH_API InterpreterManager {
   /// to execute python code, or for small amounts of application logic that are
   /// best written in Python. For larger amounts of code, prefer creating and
   /// loading them as packages.
-  void registerModuleSource(std::string name, std::string src) {
-    registeredModuleSource_[std::move(name)] = std::move(src);
-  }
+  /// Safe to call while interpreters are being created, resized or replaced.
+  void registerModuleSource(std::string name, std::string src);
 
   /// Util function for debugging which outputs the number of registered
   /// modules.
   size_t countRegisteredModuleSources() {
-    return registeredModuleSource_.size();
+    return moduleSources()->size();
   }
 
   /// Converts `obj` from on `InterpreterSession` I into a  `ReplicatedObj`.
@@ -230,9 +414,75 @@ struct TORCH_API InterpreterManager {
   friend struct Package;
   friend struct InterpreterSession;
   friend struct InterpreterSessionImpl;
+  friend struct ReplicatedObjImpl;
+  at::ArrayRef<Interpreter> readyInstances() const {
+    // the storage is reserved up front, so data() never changes while
+    // interpreters are being added
+    return at::ArrayRef<Interpreter>(
+        instances_.data(), nReady_.load(std::memory_order_acquire));
+  }
+  // creates interpreters until all nInterp_ exist or startup is stopped
+  void runStartupWorker(std::shared_ptr<Environment> env);
+  // stops creating interpreters and waits for the startup threads to exit
+  void stopStartup();
+  // creates an interpreter which is not yet visible to users of the manager
+  Interpreter createInterpreter(const std::shared_ptr<Environment>& env);
+  // makes `interp` the next interpreter in the pool, startupMutex_ is held
+  void publishInterpreter(Interpreter interp);
+  void runElasticPolicy(ElasticPoolPolicy policy);
+  // replaceInterpreter with resizeMutex_ held
+  void replaceInterpreterLocked(size_t id);
+  void runReplacementPolicy(ReplacementPolicy policy);
+  // tears down all interpreters, used by the destructor
+  void destroyInstances();
+  std::vector<std::shared_ptr<ReplicatedObjImpl>> liveReplicatedObjects();
+  using ModuleSources = std::unordered_map<std::string, std::string>;
+  // the registered module sources at the time of the call, which later
+  // registrations do not change
+  std::shared_ptr<const ModuleSources> moduleSources() const;
+
   std::vector<Interpreter> instances_;
   LoadBalancer resources_;
-  std::unordered_map<std::string, std::string> registeredModuleSource_;
+  // replaced rather than modified by registerModuleSource, so that readers can
+  // keep using the snapshot they took without holding the lock
+  mutable std::mutex registeredModuleSourceMutex_;
+  std::shared_ptr<const ModuleSources> registeredModuleSource_{
+      std::make_shared<const ModuleSources>()};
+  std::shared_ptr<Environment> env_;
+
+  size_t nInterp_;
+  std::atomic<size_t> nReady_{0};
+  std::atomic<size_t> nextInterp_{0};
+  std::atomic<bool> stopStartup_{false};
+  mutable std::mutex startupMutex_;
+  std::condition_variable startupCv_;
+  size_t nStartupWorkers_{0};
+  std::exception_ptr startupError_;
+  std::chrono::steady_clock::time_point startupBegin_;
+  double startupSeconds_{0};
+  std::promise<void> allReadyPromise_;
+  std::shared_future<void> allReady_;
+  std::vector<std::thread> startupThreads_;
+
+  std::mutex resizeMutex_;
+  std::mutex elasticMutex_;
+  std::condition_variable elasticCv_;
+  bool stopElastic_{false};
+  std::thread elasticThread_;
+
+  // when each interpreter started serving, indexed by interpreter ID
+  std::vector<std::chrono::steady_clock::time_point> servingSince_;
+  std::mutex replacementMutex_;
+  std::condition_variable replacementCv_;
+  bool stopReplacement_{false};
+  std::thread replacementThread_;
+
+  // held exclusively while interpreters are moved out of instances_, and
+  // shared by whoever walks them without going through the load balancer
+  mutable std::shared_mutex instancesMutex_;
+  std::mutex replicatedObjectsMutex_;
+  std::vector<std::weak_ptr<ReplicatedObjImpl>> replicatedObjects_;
+  std::atomic<bool> fastExit_{false};
 };
 
 struct TORCH_API ReplicatedObjImpl {
@@ -245,9 +495,12 @@ struct TORCH_API ReplicatedObjImpl {
   // NOLINTNEXTLINE(bugprone-exception-escape)
   ~ReplicatedObjImpl();
   void unload(const Interpreter* onThisInterpreter);
+  // unloads from every interpreter of `manager`, which must be alive
+  void unloadAll(InterpreterManager* manager);
   int64_t objectId_;
   PickledObject data_;
-  InterpreterManager* manager_;
+  // cleared when the manager is destroyed, which may race with its readers
+  std::atomic<InterpreterManager*> manager_;
 };
 
 /// ReplicatedObj represents a python object that can be used on multiple
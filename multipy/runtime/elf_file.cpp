@@ -6,10 +6,13 @@
 
 #include <c10/util/irange.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <link.h>
 #include <multipy/runtime/Exception.h>
 #include <multipy/runtime/elf_file.h>
+#include <unistd.h>
 
+#include <cstring>
 #include <fstream>
 #include <optional>
 
@@ -51,6 +54,23 @@ std::optional<Section> ElfFile::findSection(const char* name) const {
   return found;
 }
 
+std::vector<std::string> ElfFile::dynamicStrings(Elf64_Sxword tag) const {
+  std::vector<std::string> strings;
+  auto dynamic = findSection(".dynamic");
+  auto strtab = findSection(".dynstr");
+  if (!dynamic || !strtab) {
+    return strings;
+  }
+  auto dyn = reinterpret_cast<const Elf64_Dyn*>(dynamic->start);
+  auto end = dyn + dynamic->len / sizeof(Elf64_Dyn);
+  for (; dyn < end && dyn->d_tag != DT_NULL; ++dyn) {
+    if (dyn->d_tag == tag && dyn->d_un.d_val < strtab->len) {
+      strings.emplace_back(strtab->start + dyn->d_un.d_val);
+    }
+  }
+  return strings;
+}
+
 void ElfFile::checkFormat() const {
   // check the magic numbers
   MULTIPY_CHECK(
@@ -70,6 +90,18 @@ inline bool exists(const char* name) {
   std::ifstream f(name);
   return f.good();
 }
+
+std::string toHex(const unsigned char* data, size_t size) {
+  static const char* digits = "0123456789abcdef";
+  std::string result;
+  result.reserve(2 * size);
+  for (size_t i = 0; i < size; ++i) {
+    result.push_back(digits[data[i] >> 4]);
+    result.push_back(digits[data[i] & 0xf]);
+  }
+  return result;
+}
+
 } // namespace
 
 std::optional<Section> searchForSection(const char* name) {
@@ -105,5 +137,72 @@ std::optional<Section> searchForSection(const char* name) {
   return ctx.section;
 }
 
+bool isElfFile(const char* filename) {
+  char magic[SELFMAG];
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool elf = read(fd, magic, SELFMAG) == SELFMAG &&
+      memcmp(magic, ELFMAG, SELFMAG) == 0;
+  close(fd);
+  return elf;
+}
+
+// The image is not necessarily aligned, so headers are copied out before
+// being read.
+std::string findBuildId(const char* data, size_t size) {
+  Elf64_Ehdr ehdr;
+  if (size < sizeof(ehdr)) {
+    return "";
+  }
+  memcpy(&ehdr, data, sizeof(ehdr));
+  if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr.e_phoff + ehdr.e_phnum * sizeof(Elf64_Phdr) > size) {
+    return "";
+  }
+  for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+    Elf64_Phdr phdr;
+    memcpy(&phdr, data + ehdr.e_phoff + i * sizeof(phdr), sizeof(phdr));
+    if (phdr.p_type != PT_NOTE || phdr.p_offset + phdr.p_filesz > size) {
+      continue;
+    }
+    const char* note = data + phdr.p_offset;
+    const char* end = note + phdr.p_filesz;
+    while (note + sizeof(Elf64_Nhdr) <= end) {
+      Elf64_Nhdr nhdr;
+      memcpy(&nhdr, note, sizeof(nhdr));
+      const char* name = note + sizeof(nhdr);
+      const char* desc = name + ((nhdr.n_namesz + 3) & ~3);
+      const char* next = desc + ((nhdr.n_descsz + 3) & ~3);
+      if (next > end) {
+        break;
+      }
+      if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0) {
+        return toHex((const unsigned char*)desc, nhdr.n_descsz);
+      }
+      note = next;
+    }
+  }
+  return "";
+}
+
+// 64-bit FNV-1a over 8-byte words
+std::string hashContents(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word = 0;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return toHex((const unsigned char*)&hash, sizeof(hash));
+}
+
 } // namespace deploy
 } // namespace torch
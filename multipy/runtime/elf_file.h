@@ -12,6 +12,7 @@
 
 #include <memory>
 #include <optional>
+#include <string>
 #include <vector>
 
 namespace torch {
@@ -51,6 +52,10 @@ class ElfFile {
   /// found, then a `std::nullopt` is returned.
   std::optional<Section> findSection(const char* name) const;
 
+  /// Returns the strings the entries of the dynamic section with `tag` refer
+  /// to in order, e.g. the libraries it needs for DT_NEEDED.
+  std::vector<std::string> dynamicStrings(Elf64_Sxword tag) const;
+
  private:
   Section toSection(Elf64_Shdr* shdr) {
     auto nameOff = shdr->sh_name;
@@ -82,5 +87,17 @@ class ElfFile {
 
 std::optional<Section> searchForSection(const char* name);
 
+/// Whether the file at `filename` starts with the ELF magic numbers, e.g. to
+/// tell shared libraries from the linker scripts named like them.
+bool isElfFile(const char* filename);
+
+/// Returns the GNU build-id of the ELF image in [data, data + size) as a hex
+/// string, or an empty string if it does not have one.
+std::string findBuildId(const char* data, size_t size);
+
+/// Returns a hash of [data, data + size) as a hex string, to key contents that
+/// have no build-id. It is fast rather than cryptographically strong.
+std::string hashContents(const char* data, size_t size);
+
 } // namespace deploy
 } // namespace torch
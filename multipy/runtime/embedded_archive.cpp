@@ -0,0 +1,121 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <multipy/runtime/embedded_archive.h>
+
+#include <fmt/format.h>
+#include <multipy/runtime/host_function.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace torch {
+namespace deploy {
+
+namespace {
+
+// The archives that are alive, by id. Ids are never reused, so a `sys.path`
+// entry outliving its archive finds nothing rather than another archive.
+struct ArchiveRegistry {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, const EmbeddedArchive*> archives;
+  uint64_t nextId = 1;
+};
+
+ArchiveRegistry& archiveRegistry() {
+  // leaked, so that archives destroyed at exit can still unregister
+  static auto* registry = new ArchiveRegistry();
+  return *registry;
+}
+
+} // namespace
+
+extern "C" {
+__attribute__((visibility("default"))) uint64_t
+deploy_register_embedded_archive(const EmbeddedArchive* archive) {
+  auto& registry = archiveRegistry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  auto id = registry.nextId++;
+  registry.archives[id] = archive;
+  return id;
+}
+
+__attribute__((visibility("default"))) void deploy_unregister_embedded_archive(
+    uint64_t id) {
+  auto& registry = archiveRegistry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  registry.archives.erase(id);
+}
+
+__attribute__((visibility("default"))) const EmbeddedArchive*
+deploy_find_embedded_archive(uint64_t id) {
+  auto& registry = archiveRegistry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  auto it = registry.archives.find(id);
+  return it == registry.archives.end() ? nullptr : it->second;
+}
+}
+
+// This file is also compiled into every interpreter, which look archives up
+// in the registry of the host, where they were created.
+
+EmbeddedArchive::EmbeddedArchive(std::string name) : name_(std::move(name)) {
+  static auto fn = host_function(
+      "deploy_register_embedded_archive", &deploy_register_embedded_archive);
+  id_ = fn(this);
+}
+
+EmbeddedArchive::~EmbeddedArchive() {
+  static auto fn = host_function(
+      "deploy_unregister_embedded_archive",
+      &deploy_unregister_embedded_archive);
+  fn(id_);
+}
+
+const EmbeddedArchive* EmbeddedArchive::fromPythonPath(
+    const std::string& path,
+    std::string* subdir) {
+  static bool hostRegistry = false;
+  static auto fn = host_function(
+      "deploy_find_embedded_archive",
+      &deploy_find_embedded_archive,
+      &hostRegistry);
+  if (path.compare(0, kPathPrefix.size(), kPathPrefix) != 0) {
+    return nullptr;
+  }
+  const char* digits = path.c_str() + kPathPrefix.size();
+  char* end = nullptr;
+  auto id = strtoull(digits, &end, 10);
+  if (end == digits || *end != ':') {
+    return nullptr;
+  }
+  auto slash = path.find('/', end - path.c_str());
+  *subdir = slash == std::string::npos ? "" : path.substr(slash + 1);
+  auto archive = fn(id);
+  if (!archive) {
+    // the importer asks for every file it might import, so say it only once
+    static std::mutex mutex;
+    static std::unordered_set<uint64_t> reported;
+    std::lock_guard<std::mutex> guard(mutex);
+    if (reported.insert(id).second) {
+      std::cerr << fmt::format(
+          "error, no embedded archive {} for {}, {}\n",
+          id,
+          path,
+          hostRegistry ? "it does not exist or was destroyed"
+                       : "the host does not export "
+                         "deploy_find_embedded_archive, so only the archives "
+                         "created in this copy of the runtime are found");
+    }
+  }
+  return archive;
+}
+
+} // namespace deploy
+} // namespace torch
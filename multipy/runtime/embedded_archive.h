@@ -0,0 +1,79 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace torch {
+namespace deploy {
+
+/// A read-only tree of files embedded in the binary that interpreters import
+/// Python modules from without it being extracted to disk first.
+///
+/// Archives are created by the host and must outlive the interpreters
+/// importing from them, e.g. by being owned by their Environment. Each archive
+/// registers itself with the host, and interpreters only get its id through
+/// `sys.path` as `pythonPath()`. They look it up in the registry of the host
+/// and call it through its vtable, so the implementations only live in the
+/// host. All methods may be called concurrently by different interpreters.
+class EmbeddedArchive {
+ public:
+  virtual ~EmbeddedArchive();
+
+  EmbeddedArchive(const EmbeddedArchive&) = delete;
+  EmbeddedArchive& operator=(const EmbeddedArchive&) = delete;
+
+  /// Returns the contents of the file at `path`, relative to the root of the
+  /// archive, or nullopt if there is no such file.
+  virtual std::optional<std::string> read(std::string_view path) const = 0;
+
+  /// Whether `path` is a directory in the archive.
+  virtual bool isDirectory(std::string_view path) const = 0;
+
+  /// Returns the names of the entries of the directory at `path`, or nothing
+  /// if there is no such directory.
+  virtual std::vector<std::string> list(std::string_view path) const = 0;
+
+  /// Returns a path on the filesystem with the contents of the file at `path`,
+  /// for native code that can only be loaded from a real file. Returns nullopt
+  /// if there is no such file or the archive cannot write files.
+  virtual std::optional<std::string> materialize(
+      std::string_view /*path*/) const {
+    return std::nullopt;
+  }
+
+  /// The `sys.path` entry the interpreters import this archive from.
+  std::string pythonPath() const {
+    return std::string(kPathPrefix) + std::to_string(id_) + ":" + name_;
+  }
+
+  /// Parses a `sys.path` entry created by `pythonPath()`, optionally followed
+  /// by `/` and a path inside the archive, which is stored in `subdir`.
+  /// Returns nullptr for any other entry, and for archives that no longer
+  /// exist.
+  static const EmbeddedArchive* fromPythonPath(
+      const std::string& path,
+      std::string* subdir);
+
+ protected:
+  /// `name` only shows up in the paths of the modules, e.g. in tracebacks,
+  /// and must not contain `/`.
+  explicit EmbeddedArchive(std::string name);
+
+ private:
+  static constexpr std::string_view kPathPrefix = "embedded_archive:";
+
+  std::string name_;
+  uint64_t id_;
+};
+
+} // namespace deploy
+} // namespace torch
@@ -5,26 +5,290 @@
 // LICENSE file in the root directory of this source tree.
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <multipy/runtime/Exception.h>
 #include <multipy/runtime/elf_file.h>
 #include <multipy/runtime/embedded_file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <torch/cuda.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 
 namespace torch {
 namespace deploy {
 
+namespace {
+
+// A payload that has been written to disk once and is shared by every
+// EmbeddedFile with the same contents. Per-interpreter files are cloned from
+// `fd` and created in `dir` so that they can share its extents.
+struct ExtractedPayload {
+  ExtractedPayload(int fd_, std::string dir_) : fd(fd_), dir(std::move(dir_)) {}
+  ExtractedPayload(const ExtractedPayload&) = delete;
+  ExtractedPayload& operator=(const ExtractedPayload&) = delete;
+  ~ExtractedPayload() {
+    close(fd);
+  }
+  int fd;
+  std::string dir;
+};
+
+std::mutex& payloadCacheMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+std::string& persistentCacheDir() {
+  static std::string dir;
+  return dir;
+}
+
+// keeps every payload extracted for the lifetime of the process. The clones
+// share its extents, so it costs no more than one copy of the payload
+std::unordered_map<std::string, std::shared_ptr<ExtractedPayload>>&
+extractedPayloads() {
+  static std::unordered_map<std::string, std::shared_ptr<ExtractedPayload>>
+      payloads;
+  return payloads;
+}
+
+// Must hold payloadCacheMutex. Without a build-id the whole payload is
+// hashed, so the key of each section is only computed once.
+std::string payloadKey(const std::string& name, const char* data, size_t size) {
+  static std::unordered_map<const char*, std::string> ids;
+  auto it = ids.find(data);
+  if (it == ids.end()) {
+    std::string id = findBuildId(data, size);
+    if (id.empty()) {
+      id = "h" + hashContents(data, size);
+    }
+    it = ids.emplace(data, std::move(id)).first;
+  }
+  return name + "_" + it->second + "_" + std::to_string(size);
+}
+
+// Whether files in `dir` can be reflinked, probed once per directory. Must
+// hold payloadCacheMutex.
+bool supportsReflink(const std::string& dir) {
+#ifdef FICLONE
+  static std::unordered_map<std::string, bool> probed;
+  auto it = probed.find(dir);
+  if (it != probed.end()) {
+    return it->second;
+  }
+  bool supported = false;
+  int src = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  int dst = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (src != -1 && dst != -1 && write(src, "x", 1) == 1) {
+    supported = ioctl(dst, FICLONE, src) == 0;
+  }
+  for (int fd : {src, dst}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  probed.emplace(dir, supported);
+  return supported;
+#else
+  return false;
+#endif
+}
+
+void writeAll(int fd, const char* data, size_t size, const std::string& path) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    MULTIPY_CHECK(
+        written > 0, "failed to write " + path + ": " + strerror(errno));
+    data += written;
+    size -= written;
+  }
+}
+
+// Returns the payload extracted to a file that can be reflinked, or nullptr if
+// the filesystem it would go to has no reflinks. Each interpreter then needs
+// a full copy anyway, and one more on disk would only be a waste.
+std::shared_ptr<ExtractedPayload>
+extractPayload(const std::string& name, const char* data, size_t size) {
+  // held for the whole extraction so that concurrently created interpreters
+  // wait for the first one to write the payload instead of writing their own
+  std::lock_guard<std::mutex> guard(payloadCacheMutex());
+  const std::string& cacheDir = persistentCacheDir();
+  if (!supportsReflink(cacheDir.empty() ? "/tmp" : cacheDir)) {
+    return nullptr;
+  }
+  std::string key = payloadKey(name, data, size);
+  auto& payloads = extractedPayloads();
+  auto it = payloads.find(key);
+  if (it != payloads.end()) {
+    return it->second;
+  }
+
+  std::shared_ptr<ExtractedPayload> payload;
+  if (!cacheDir.empty()) {
+    std::string path = cacheDir + "/multipy_" + key + ".so";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat s;
+    if (fd != -1 && fstat(fd, &s) == 0 && (size_t)s.st_size == size) {
+      // extracted by an earlier run of the same binary
+      payload = std::make_shared<ExtractedPayload>(fd, cacheDir);
+    } else {
+      if (fd != -1) {
+        close(fd);
+      }
+      std::string tmpPath = path + ".XXXXXX";
+      fd = mkstemp(tmpPath.data());
+      MULTIPY_CHECK(
+          fd != -1, "failed to create " + tmpPath + ": " + strerror(errno));
+      try {
+        writeAll(fd, data, size, tmpPath);
+      } catch (...) {
+        close(fd);
+        unlink(tmpPath.c_str());
+        throw;
+      }
+      // rename is atomic, so other processes extracting the same payload
+      // never see a partially written file
+      if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        close(fd);
+        unlink(tmpPath.c_str());
+        MULTIPY_CHECK(
+            false, "failed to rename " + tmpPath + ": " + strerror(err));
+      }
+      payload = std::make_shared<ExtractedPayload>(fd, cacheDir);
+    }
+  } else {
+    std::string tmpPath = "/tmp/multipy_" + name + "_payloadXXXXXX";
+    int fd = mkstemp(tmpPath.data());
+    MULTIPY_INTERNAL_ASSERT(fd != -1, "failed to create temporary file");
+    // the clones only need the descriptor, so the file is removed right away
+    // and never outlives the process
+    unlink(tmpPath.c_str());
+    try {
+      writeAll(fd, data, size, tmpPath);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    payload = std::make_shared<ExtractedPayload>(fd, "/tmp");
+  }
+  payloads.emplace(key, payload);
+  return payload;
+}
+
+void copyPayload(
+    const ExtractedPayload& payload,
+    int dst,
+    size_t size,
+    const std::string& name) {
+  loff_t inOffset = 0;
+  loff_t outOffset = 0;
+  size_t remaining = size;
+  while (remaining > 0) {
+    ssize_t copied = copy_file_range(
+        payload.fd, &inOffset, dst, &outOffset, remaining, 0);
+    if (copied <= 0) {
+      break;
+    }
+    remaining -= copied;
+  }
+
+  // copy_file_range does not work across some filesystems, fall back to
+  // sendfile for whatever is left
+  off_t offset = inOffset;
+  MULTIPY_CHECK(
+      lseek(dst, outOffset, SEEK_SET) == outOffset,
+      "failed to seek the copy of " + name + ": " + strerror(errno));
+  while (remaining > 0) {
+    ssize_t copied = sendfile(dst, payload.fd, &offset, remaining);
+    if (copied == -1 && errno == EINTR) {
+      continue;
+    }
+    MULTIPY_CHECK(
+        copied > 0,
+        "failed to write the copy of " + name + ": " + strerror(errno));
+    remaining -= copied;
+  }
+}
+
+int createMemfd(const std::string& name) {
+  int fd = memfd_create(("multipy_" + name).c_str(), MFD_CLOEXEC);
+  MULTIPY_CHECK(
+      fd != -1,
+      "failed to create a memfd for " + name + ": " + strerror(errno));
+  return fd;
+}
+
+// Returns a descriptor of a new, unnamed file with the contents of `payload`.
+// Hard links cannot be used here: dlopen identifies libraries by inode and
+// would return the handle of the interpreter that is already loaded.
+//
+// The file is created next to the payload so that a reflink can share its
+// extents, and nothing is copied at all. Should the clone fail after all, the
+// payload is copied to a memfd. Being unnamed, the files never outlive the
+// process, even if it crashes.
+int clonePayload(
+    const ExtractedPayload& payload,
+    size_t size,
+    const std::string& name) {
+#ifdef FICLONE
+  int clone = open(payload.dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0700);
+  if (clone != -1) {
+    if (ioctl(clone, FICLONE, payload.fd) == 0) {
+      return clone;
+    }
+    close(clone);
+  }
+#endif
+  int fd = createMemfd(name);
+  try {
+    copyPayload(payload, fd, size, name);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  return fd;
+}
+
+// Without reflinks every interpreter needs its own copy, written straight from
+// the mapped payload to memory rather than to disk.
+int copyToMemfd(const char* data, size_t size, const std::string& name) {
+  int fd = createMemfd(name);
+  try {
+    writeAll(fd, data, size, "the memfd for " + name);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  return fd;
+}
+
+} // namespace
+
+void EmbeddedFile::setPersistentCacheDir(std::string dir) {
+  std::lock_guard<std::mutex> guard(payloadCacheMutex());
+  persistentCacheDir() = std::move(dir);
+}
+
 EmbeddedFile::EmbeddedFile(
     std::string name,
     const std::initializer_list<ExeSection>& sections,
-    const std::initializer_list<InterpreterSymbol> symbols)
-    : libraryName("/tmp/multipy_" + name + "XXXXXX") {
-  int fd = mkstemp(libraryName.data());
-  MULTIPY_INTERNAL_ASSERT(fd != -1, "failed to create temporary file");
-  FILE* dst = fdopen(fd, "wb");
-  MULTIPY_INTERNAL_ASSERT(dst);
-
+    const std::initializer_list<InterpreterSymbol> symbols,
+    bool inPlace) {
   const char* payloadStart = nullptr;
   size_t size = 0;
   // payloadSection needs to be kept to ensure the source file is still mapped.
@@ -61,14 +325,55 @@ EmbeddedFile::EmbeddedFile(
     size = libEnd - libStart;
     payloadStart = libStart;
   }
-  size_t written = fwrite(payloadStart, 1, size, dst);
-  MULTIPY_INTERNAL_ASSERT(size == written, "expected written == size");
 
-  fclose(dst);
+  if (inPlace && payloadSection.has_value()) {
+    size_t offset = payloadSection->start - payloadSection->memfile->data();
+    if (offset % getpagesize() == 0) {
+      // mapped directly from the pages of the file containing the section,
+      // which are already in the page cache
+      libraryName = payloadSection->memfile->name();
+      libraryOffset = offset;
+      librarySize = size;
+      return;
+    }
+  }
+
+  auto payload = extractPayload(name, payloadStart, size);
+  libraryFd = payload ? clonePayload(*payload, size, name)
+                      : copyToMemfd(payloadStart, size, name);
+  libraryName = "/proc/self/fd/" + std::to_string(libraryFd);
+}
+
+EmbeddedFile::EmbeddedFile(EmbeddedFile&& rhs) noexcept
+    : libraryName(std::move(rhs.libraryName)),
+      customLoader(rhs.customLoader),
+      libraryOffset(rhs.libraryOffset),
+      librarySize(rhs.librarySize),
+      libraryFd(rhs.libraryFd) {
+  rhs.libraryName.clear();
+  rhs.libraryFd = -1;
+}
+
+EmbeddedFile& EmbeddedFile::operator=(EmbeddedFile&& rhs) noexcept {
+  if (this != &rhs) {
+    if (libraryFd != -1) {
+      close(libraryFd);
+    }
+    libraryName = std::move(rhs.libraryName);
+    customLoader = rhs.customLoader;
+    libraryOffset = rhs.libraryOffset;
+    librarySize = rhs.librarySize;
+    libraryFd = rhs.libraryFd;
+    rhs.libraryName.clear();
+    rhs.libraryFd = -1;
+  }
+  return *this;
 }
 
 EmbeddedFile::~EmbeddedFile() {
-  unlink(libraryName.c_str());
+  if (libraryFd != -1) {
+    close(libraryFd);
+  }
 }
 
 } // namespace deploy
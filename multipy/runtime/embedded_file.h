@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <cstddef>
+#include <initializer_list>
 #include <string>
 
 namespace torch {
@@ -28,18 +30,46 @@ struct InterpreterSymbol {
 
 /// EmbeddedFile makes it easier to load a custom interpreter embedded within
 /// the binary.
+///
+/// Every EmbeddedFile gets its own unnamed file, since dlopen needs a distinct
+/// file to load a library more than once. `libraryName` refers to it through
+/// /proc/self/fd for as long as the EmbeddedFile exists.
+///
+/// The payload is only deduplicated on filesystems with reflinks, like btrfs
+/// or XFS. There it is extracted once per process, keyed by its build-id (or
+/// a hash of its contents when it has none), and every file is a reflink of
+/// that copy. Elsewhere, e.g. on tmpfs or ext4, every EmbeddedFile gets a full
+/// copy of the payload in a memfd, written from the mapped section.
+///
+/// Libraries that are only loaded with the custom loader do not need a file
+/// of their own. With `inPlace` set, a payload found in a page aligned section
+/// is not extracted at all: `libraryName` then names the file containing the
+/// section and the library is its `librarySize` bytes at `libraryOffset`.
 struct EmbeddedFile {
   std::string libraryName;
   bool customLoader{false};
+  size_t libraryOffset{0};
+  size_t librarySize{0}; // 0 if the library was extracted to `libraryName`
+  int libraryFd{-1}; // the file `libraryName` refers to, if extracted
 
   EmbeddedFile(
       std::string name,
       const std::initializer_list<ExeSection>& sections,
-      const std::initializer_list<InterpreterSymbol> symbols);
+      const std::initializer_list<InterpreterSymbol> symbols,
+      bool inPlace = false);
 
   ~EmbeddedFile();
 
+  EmbeddedFile(EmbeddedFile&& rhs) noexcept;
+  EmbeddedFile& operator=(EmbeddedFile&& rhs) noexcept;
   EmbeddedFile& operator=(const EmbeddedFile&) = delete;
+
+  /// Keeps the extracted payloads in `dir` instead of an anonymous temporary
+  /// file, so they survive process restarts. A restart of the same binary
+  /// then reuses them without writing the payload again. Only used if `dir`
+  /// supports reflinks. Must be called before the first `EmbeddedFile` is
+  /// created to take effect for it.
+  static void setPersistentCacheDir(std::string dir);
 };
 
 } // namespace deploy
@@ -0,0 +1,167 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <multipy/runtime/embedded_zip.h>
+
+#include <zlib.h>
+
+#include <cstring>
+#include <map>
+#include <mutex>
+
+namespace torch {
+namespace deploy {
+
+namespace {
+
+constexpr uint32_t kEndOfCentralDirectory = 0x06054b50;
+constexpr uint32_t kCentralDirectoryHeader = 0x02014b50;
+constexpr uint32_t kLocalFileHeader = 0x04034b50;
+constexpr size_t kEndOfCentralDirectorySize = 22;
+constexpr size_t kCentralDirectoryHeaderSize = 46;
+constexpr size_t kLocalFileHeaderSize = 30;
+
+// zip is little endian, and so are all the platforms deploy runs on
+template <typename T>
+T load(const char* p) {
+  T value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+} // namespace
+
+EmbeddedZipArchive::EmbeddedZipArchive(Section section)
+    : EmbeddedArchive(section.name), section_(std::move(section)) {
+  const char* begin = section_.start;
+  const char* end = begin + section_.len;
+
+  // the end of central directory record is followed by a comment of at most
+  // 64k, so search backwards for it
+  const char* eocd = end - kEndOfCentralDirectorySize;
+  const char* lowest = section_.len > kEndOfCentralDirectorySize + 0xffff
+      ? end - kEndOfCentralDirectorySize - 0xffff
+      : begin;
+  while (eocd > lowest && load<uint32_t>(eocd) != kEndOfCentralDirectory) {
+    --eocd;
+  }
+  MULTIPY_CHECK(
+      eocd >= begin && load<uint32_t>(eocd) == kEndOfCentralDirectory,
+      "Zip archive in " + std::string(section_.name) + " is corrupted");
+  auto count = load<uint16_t>(eocd + 10);
+  auto directoryOffset = load<uint32_t>(eocd + 16);
+  MULTIPY_CHECK(
+      directoryOffset != 0xffffffff && count != 0xffff,
+      "Zip64 archive in " + std::string(section_.name) + " is not supported");
+
+  entries_.reserve(count);
+  const char* header = begin + directoryOffset;
+  for (uint16_t i = 0; i < count; ++i) {
+    MULTIPY_CHECK(
+        header + kCentralDirectoryHeaderSize <= eocd &&
+            load<uint32_t>(header) == kCentralDirectoryHeader,
+        "Zip archive in " + std::string(section_.name) + " is corrupted");
+    auto nameSize = load<uint16_t>(header + 28);
+    auto extraSize = load<uint16_t>(header + 30);
+    auto commentSize = load<uint16_t>(header + 32);
+    const char* local = begin + load<uint32_t>(header + 42);
+    MULTIPY_CHECK(
+        local + kLocalFileHeaderSize <= end &&
+            load<uint32_t>(local) == kLocalFileHeader,
+        "Zip archive in " + std::string(section_.name) + " is corrupted");
+
+    EmbeddedZipEntry entry;
+    entry.name =
+        std::string_view(header + kCentralDirectoryHeaderSize, nameSize);
+    entry.method = load<uint16_t>(header + 10);
+    entry.compressedSize = load<uint32_t>(header + 20);
+    entry.size = load<uint32_t>(header + 24);
+    // the local header has its own, possibly different, extra field
+    entry.data = local + kLocalFileHeaderSize + load<uint16_t>(local + 26) +
+        load<uint16_t>(local + 28);
+    MULTIPY_CHECK(
+        entry.data + entry.compressedSize <= end,
+        "Zip archive in " + std::string(section_.name) + " is corrupted");
+    if (entry.name.empty() || entry.name.back() != '/') {
+      entries_.push_back(entry);
+    }
+    header += kCentralDirectoryHeaderSize + nameSize + extraSize + commentSize;
+  }
+  std::sort(
+      entries_.begin(),
+      entries_.end(),
+      [](const EmbeddedZipEntry& a, const EmbeddedZipEntry& b) {
+        return a.name < b.name;
+      });
+}
+
+std::optional<std::string> EmbeddedZipArchive::read(
+    std::string_view path) const {
+  auto entry = find(path);
+  if (!entry) {
+    return std::nullopt;
+  }
+  if (entry->method == 0) {
+    return std::string(entry->data, entry->compressedSize);
+  }
+  MULTIPY_CHECK(
+      entry->method == Z_DEFLATED,
+      "Unsupported compression method in " + std::string(path));
+  std::string contents(entry->size, '\0');
+  z_stream stream{};
+  // raw deflate, zip members have no zlib header
+  MULTIPY_CHECK(inflateInit2(&stream, -MAX_WBITS) == Z_OK, "inflateInit2");
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(entry->data));
+  stream.avail_in = entry->compressedSize;
+  stream.next_out = reinterpret_cast<Bytef*>(&contents[0]);
+  stream.avail_out = contents.size();
+  auto r = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  MULTIPY_CHECK(
+      r == Z_STREAM_END && stream.avail_out == 0,
+      "Failed to decompress " + std::string(path));
+  return contents;
+}
+
+std::vector<std::string> EmbeddedZipArchive::list(
+    std::string_view path) const {
+  // the members of a directory are next to each other in the sorted index,
+  // as are those of each of its subdirectories
+  std::string prefix = path.empty() ? "" : std::string(path) + "/";
+  std::vector<std::string> names;
+  for (auto it = lowerBound(prefix); it != entries_.end() &&
+       it->name.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    auto name = it->name.substr(prefix.size());
+    name = name.substr(0, name.find('/'));
+    if (!name.empty() && (names.empty() || names.back() != name)) {
+      names.emplace_back(name);
+    }
+  }
+  return names;
+}
+
+const EmbeddedZipArchive& EmbeddedZipArchive::forSection(
+    const char* sectionName) {
+  static std::mutex mutex;
+  static std::map<std::string, const EmbeddedZipArchive*> archives;
+  std::lock_guard<std::mutex> guard(mutex);
+  auto& archive = archives[sectionName];
+  if (!archive) {
+    auto section = searchForSection(sectionName);
+    MULTIPY_CHECK(
+        section.has_value(),
+        "Missing the zipped python modules section " +
+            std::string(sectionName));
+    // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+    archive = new EmbeddedZipArchive(std::move(*section));
+  }
+  return *archive;
+}
+
+} // namespace deploy
+} // namespace torch
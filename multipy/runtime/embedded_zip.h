@@ -0,0 +1,78 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <multipy/runtime/elf_file.h>
+#include <multipy/runtime/embedded_archive.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace torch {
+namespace deploy {
+
+/// A member of an `EmbeddedZipArchive`.
+struct EmbeddedZipEntry {
+  std::string_view name;
+  uint16_t method; // 0 for stored, 8 for deflated
+  const char* data; // compressed contents, inside the mapped section
+  size_t compressedSize;
+  size_t size;
+};
+
+/// A zip archive of Python modules embedded in an ELF section and read
+/// directly from where the section is mapped.
+///
+/// The central directory is parsed once per process into an index that is
+/// never written to afterwards, so all interpreters share it without locking.
+class EmbeddedZipArchive : public EmbeddedArchive {
+ public:
+  /// Returns the archive in the section `sectionName` of the executable or one
+  /// of the loaded libraries, indexing it on first use.
+  static const EmbeddedZipArchive& forSection(const char* sectionName);
+
+  /// Indexes the zip archive in `section`, which must stay mapped while the
+  /// archive is used. Throws if it is corrupted or a Zip64 archive.
+  explicit EmbeddedZipArchive(Section section);
+
+  std::optional<std::string> read(std::string_view path) const override;
+  std::vector<std::string> list(std::string_view path) const override;
+
+  bool isDirectory(std::string_view path) const override {
+    std::string prefix = std::string(path) + "/";
+    auto it = lowerBound(prefix);
+    return it != entries_.end() &&
+        it->name.compare(0, prefix.size(), prefix) == 0;
+  }
+
+  /// Finds the member called `name`, or returns nullptr.
+  const EmbeddedZipEntry* find(std::string_view name) const {
+    auto it = lowerBound(name);
+    return it != entries_.end() && it->name == name ? &*it : nullptr;
+  }
+
+ private:
+  std::vector<EmbeddedZipEntry>::const_iterator lowerBound(
+      std::string_view name) const {
+    return std::lower_bound(
+        entries_.begin(),
+        entries_.end(),
+        name,
+        [](const EmbeddedZipEntry& entry, std::string_view name) {
+          return entry.name < name;
+        });
+  }
+
+  Section section_;
+  std::vector<EmbeddedZipEntry> entries_; // sorted by name
+};
+
+} // namespace deploy
+} // namespace torch
@@ -6,8 +6,9 @@
 
 #pragma once
 #include <multipy/runtime/Exception.h>
-#include <multipy/runtime/elf_file.h>
+#include <multipy/runtime/embedded_zip.h>
 #include <string>
+#include <vector>
 
 namespace torch {
 namespace deploy {
@@ -21,68 +22,37 @@ class Interpreter;
  */
 class Environment {
   std::vector<std::string> extraPythonPaths_;
-  // all zipped python libraries will be written
-  // under this directory
-  std::string extraPythonLibrariesDir_;
-  std::string getZippedArchive(
-      const char* zipped_torch_name,
-      const std::string& pythonAppDir) {
-    // load the zipped torch modules
-    auto zippedTorchSection = searchForSection(zipped_torch_name);
-    MULTIPY_CHECK(
-        zippedTorchSection.has_value(), "Missing the zipped torch section");
-    const char* zippedTorchStart = zippedTorchSection->start;
-    auto zippedTorchSize = zippedTorchSection->len;
 
-    std::string zipArchive = pythonAppDir;
-    auto zippedFile = fopen(zipArchive.c_str(), "wb");
-    MULTIPY_CHECK(
-        zippedFile != nullptr, "Fail to create file: ", strerror(errno));
-    fwrite(zippedTorchStart, 1, zippedTorchSize, zippedFile);
-    fclose(zippedFile);
-    return zipArchive;
-  }
-
-  void setupZippedPythonModules(const std::string& pythonAppDir) {
+  void setupZippedPythonModules() {
 #ifdef FBCODE_CAFFE2
-    extraPythonPaths_.push_back(getZippedArchive(
-        ".mpmath_python_modules",
-        std::string(pythonAppDir) + "/mpmath_python_modules.zip"));
-    extraPythonPaths_.push_back(getZippedArchive(
-        ".sympy_python_modules",
-        std::string(pythonAppDir) + "/sympy_python_modules.zip"));
-    extraPythonPaths_.push_back(getZippedArchive(
-        ".torch_python_modules",
-        std::string(pythonAppDir) + "/torch_python_modules.zip"));
-    extraPythonPaths_.push_back(getZippedArchive(
-        ".multipy_python_modules",
-        std::string(pythonAppDir) + "/multipy_python_modules.zip"));
-    extraPythonPaths_.push_back(getZippedArchive(
-        ".torchgen_python_modules",
-        std::string(pythonAppDir) + "/torchgen_python_modules.zip"));
-
+    // the zipped modules are imported straight from the mapped sections, so
+    // nothing is written to disk and all interpreters share one index
+    for (const char* sectionName :
+         {".mpmath_python_modules",
+          ".sympy_python_modules",
+          ".torch_python_modules",
+          ".multipy_python_modules",
+          ".torchgen_python_modules"}) {
+      extraPythonPaths_.push_back(
+          EmbeddedZipArchive::forSection(sectionName).pythonPath());
+    }
 #endif
-    extraPythonLibrariesDir_ = pythonAppDir;
   }
 
  public:
-  /// Environment constructor which creates a random temporary directory as
-  /// a directory for the zipped python modules.
+  /// Environment constructor which sets up the zipped python modules embedded
+  /// in the binary.
   explicit Environment() {
-    char tempDirName[] = "/tmp/torch_deploy_zipXXXXXX";
-    char* tempDirectory = mkdtemp(tempDirName);
-    setupZippedPythonModules(tempDirectory);
+    setupZippedPythonModules();
   }
   /// Environment constructor which takes a file name for the
-  /// directory for the python modules.
-  explicit Environment(const std::string& pythonAppDir) {
-    setupZippedPythonModules(pythonAppDir);
+  /// directory for the python modules. The zipped python modules are
+  /// imported from memory, so nothing is written to the directory.
+  explicit Environment(const std::string& /* pythonAppDir */) {
+    setupZippedPythonModules();
   }
 
-  virtual ~Environment() {
-    auto rmCmd = "rm -rf " + extraPythonLibrariesDir_;
-    (void)system(rmCmd.c_str());
-  }
+  virtual ~Environment() = default;
   virtual const std::vector<std::string>& getExtraPythonPaths() {
     return extraPythonPaths_;
   }
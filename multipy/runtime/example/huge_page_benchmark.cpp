@@ -0,0 +1,136 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Measures a call path through a library loaded with the custom loader, with
+// its code on regular pages and on transparent huge pages. Reports the time
+// and the iTLB misses per call path, and how much of the code the kernel
+// actually put on huge pages.
+//
+// usage: huge_page_benchmark [library] [n_calls]
+
+#include <multipy/runtime/loader.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using torch::deploy::CustomLibrary;
+using torch::deploy::SystemLibrary;
+
+namespace {
+
+// counts the iTLB misses of this thread, if the kernel lets us
+struct ITLBMisses {
+  ITLBMisses() {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_ITLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~ITLBMisses() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+  bool valid() const {
+    return fd_ != -1;
+  }
+  void start() {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  uint64_t stop() {
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+      return 0;
+    }
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+// AnonHugePages of the mapping containing `addr`, in kB
+size_t anon_huge_pages_kb(const void* addr) {
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  bool in_mapping = false;
+  auto target = reinterpret_cast<uintptr_t>(addr);
+  while (std::getline(smaps, line)) {
+    uintptr_t begin = 0;
+    uintptr_t end = 0;
+    if (sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR " ", &begin, &end) ==
+            2 &&
+        line.find(':') > line.find(' ')) {
+      in_mapping = begin <= target && target < end;
+    } else if (in_mapping && line.rfind("AnonHugePages:", 0) == 0) {
+      return strtoull(line.c_str() + strlen("AnonHugePages:"), nullptr, 10);
+    }
+  }
+  return 0;
+}
+
+} // namespace
+
+// NOLINTNEXTLINE(bugprone-exception-escape)
+int main(int argc, char* argv[]) {
+  const char* library = argc > 1 ? argv[1] : HUGE_PAGE_BENCHMARK_LIB;
+  size_t n_calls = argc > 2 ? atoll(argv[2]) : 20000;
+
+  std::cout << "huge_pages, ns_per_call_path, itlb_misses_per_call_path, "
+               "huge_page_kb\n";
+  for (bool huge_pages : {false, true}) {
+    const char* args[] = {"huge_page_benchmark"};
+    auto lib = CustomLibrary::create(library, 1, args);
+    lib->add_search_library(SystemLibrary::create());
+    lib->set_huge_page_text(huge_pages);
+    lib->load();
+    auto call_path =
+        (int (*)(int))lib->sym("huge_page_benchmark_call_path").value();
+
+    int x = call_path(0); // fault everything in first
+    ITLBMisses misses;
+    if (misses.valid()) {
+      misses.start();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n_calls; ++i) {
+      x = call_path(x);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    std::cout << huge_pages << ", " << ns / n_calls << ", ";
+    if (misses.valid()) {
+      std::cout << double(misses.stop()) / n_calls;
+    } else {
+      std::cout << "n/a";
+    }
+    std::cout << ", " << anon_huge_pages_kb((const void*)call_path) << "\n";
+    if (x == 42) {
+      std::cout << "\n"; // keeps the calls from being optimized away
+    }
+  }
+  return 0;
+}
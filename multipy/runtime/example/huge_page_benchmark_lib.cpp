@@ -0,0 +1,40 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Library loaded by huge_page_benchmark. Its call path goes through many
+// small functions that are each on a page of their own, so that it needs
+// many more iTLB entries than it has instructions, like the code of a large
+// library does.
+
+#include <array>
+#include <cstddef>
+#include <utility>
+
+namespace {
+
+constexpr size_t kSteps = 2048;
+
+template <size_t N>
+__attribute__((noinline, aligned(4096))) int step(int x) {
+  return x * 3 + static_cast<int>(N);
+}
+
+template <size_t... I>
+std::array<int (*)(int), sizeof...(I)> make_steps(std::index_sequence<I...>) {
+  return {&step<I>...};
+}
+
+const std::array<int (*)(int), kSteps> steps =
+    make_steps(std::make_index_sequence<kSteps>());
+
+} // namespace
+
+extern "C" __attribute__((noinline)) int huge_page_benchmark_call_path(int x) {
+  for (auto fn : steps) {
+    x = fn(x);
+  }
+  return x;
+}
@@ -0,0 +1,84 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Loads the embedded interpreter and the torch plugin with the custom loader
+// over and over, the way each new interpreter would, and prints what the
+// loader did for every load. Keeps all of them loaded, so later iterations
+// show the cost of adding one more interpreter to a pool.
+//
+// usage: loader_benchmark [n_iterations]
+
+#include <multipy/runtime/embedded_file.h>
+#include <multipy/runtime/loader.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using torch::deploy::CustomLibrary;
+using torch::deploy::EmbeddedFile;
+using torch::deploy::LoaderStats;
+using torch::deploy::SystemLibrary;
+
+static std::shared_ptr<CustomLibrary> load(
+    const EmbeddedFile& file,
+    const std::vector<std::shared_ptr<CustomLibrary>>& search_path) {
+  auto lib = CustomLibrary::create(
+      file.libraryName.c_str(), file.libraryOffset, file.librarySize);
+  for (const auto& dep : search_path) {
+    lib->add_search_library(dep);
+  }
+  lib->add_search_library(SystemLibrary::create());
+  lib->load();
+  return lib;
+}
+
+static void print(size_t iteration, const char* name, const LoaderStats& s) {
+  size_t relocations = 0;
+  for (const auto& entry : s.relocations) {
+    relocations += entry.second;
+  }
+  std::cout << iteration << ", " << name << ", " << s.mapped_size << ", "
+            << s.tls_size << ", " << relocations << ", "
+            << s.relocated_from_template << ", " << s.local_hits << ", "
+            << s.search_path_hits << ", " << s.weak_misses << ", "
+            << s.load_segments_seconds << ", " << s.dependencies_seconds
+            << ", " << s.relocate_seconds << ", " << s.protect_seconds << ", "
+            << s.initialize_seconds << "\n";
+}
+
+// NOLINTNEXTLINE(bugprone-exception-escape)
+int main(int argc, char* argv[]) {
+  size_t n_iterations = argc > 1 ? atoi(argv[1]) : 4;
+
+  EmbeddedFile interpreter(
+      "interpreter",
+      {{".torch_deploy_payload.interpreter_all", true}},
+      {{"_binary_libtorch_deployinterpreter_all_so_start",
+        "_binary_libtorch_deployinterpreter_all_so_end",
+        true}});
+  EmbeddedFile torch_plugin(
+      "multipy_torch",
+      {{".torch_deploy_payload.multipy_torch", false}},
+      {},
+      /*inPlace=*/true);
+
+  std::cout << "iteration, library, mapped_size, tls_size, relocations, "
+               "from_template, local_hits, search_path_hits, weak_misses, "
+               "load_segments_seconds, dependencies_seconds, "
+               "relocate_seconds, protect_seconds, initialize_seconds\n";
+  std::vector<std::shared_ptr<CustomLibrary>> loaded;
+  for (size_t i = 0; i < n_iterations; ++i) {
+    auto interpreter_lib = load(interpreter, {});
+    auto torch_lib = load(torch_plugin, {interpreter_lib});
+    print(i, "interpreter", interpreter_lib->stats());
+    print(i, "multipy_torch", torch_lib->stats());
+    loaded.push_back(interpreter_lib);
+    loaded.push_back(torch_lib);
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Measures how long it takes to construct and to destroy an
+// `InterpreterManager` for an increasing number of interpreters, to show how
+// cold start and teardown scale with the size of the pool. Teardown staying
+// flat while there are fewer interpreters than threads shows that the part of
+// it which is serialized, unloading the libraries, is negligible.
+//
+// usage: startup_benchmark [max_interpreters] [n_trials]
+
+#include <multipy/runtime/deploy.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// parses a count given on the command line, which has to be positive
+size_t parse_count(const char* arg) {
+  char* end = nullptr;
+  errno = 0;
+  long value = strtol(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value < 1) {
+    std::cerr << "invalid count: " << arg << "\n"
+              << "usage: startup_benchmark [max_interpreters] [n_trials]\n";
+    exit(1);
+  }
+  return value;
+}
+
+// NOLINTNEXTLINE(bugprone-exception-escape)
+int main(int argc, char* argv[]) {
+  size_t max_interp = argc > 1
+      ? parse_count(argv[1])
+      : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  size_t n_trials = argc > 2 ? parse_count(argv[2]) : 3;
+
+  std::cout << "n_interp, n_threads, best_seconds, median_seconds, "
+               "best_seconds_per_interp, best_teardown_seconds, "
+               "median_teardown_seconds\n";
+  // powers of two, followed by max_interp itself if it is not one
+  for (size_t n_interp = 1;; n_interp = std::min(n_interp * 2, max_interp)) {
+    std::vector<double> times;
+    std::vector<double> teardown_times;
+    for (size_t trial = 0; trial < n_trials; ++trial) {
+      auto begin = std::chrono::steady_clock::now();
+      auto manager =
+          std::make_unique<torch::deploy::InterpreterManager>(n_interp);
+      auto end = std::chrono::steady_clock::now();
+      times.push_back(std::chrono::duration<double>(end - begin).count());
+      begin = std::chrono::steady_clock::now();
+      manager.reset();
+      end = std::chrono::steady_clock::now();
+      teardown_times.push_back(
+          std::chrono::duration<double>(end - begin).count());
+    }
+    std::sort(times.begin(), times.end());
+    std::sort(teardown_times.begin(), teardown_times.end());
+    size_t n_threads = std::min<size_t>(
+        n_interp, std::max<size_t>(std::thread::hardware_concurrency(), 1));
+    std::cout << n_interp << ", " << n_threads << ", " << times.front() << ", "
+              << times[times.size() / 2] << ", " << times.front() / n_interp
+              << ", " << teardown_times.front() << ", "
+              << teardown_times[teardown_times.size() / 2] << "\n";
+    if (n_interp == max_interp) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Measures the cost of a thread local access from a library loaded with the
+// custom loader, compared to the same library loaded with dlopen and to the
+// per-library pthread key the custom loader used before.
+//
+// usage: tls_benchmark [library] [n_accesses] [n_threads]
+
+#include <multipy/runtime/loader.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using torch::deploy::CustomLibrary;
+using torch::deploy::SystemLibrary;
+using torch::deploy::TLSIndex;
+
+namespace {
+
+// what the custom loader did before for every access: look the block of the
+// library up through a pthread key, allocating it on first touch
+pthread_key_t old_key;
+
+__attribute__((noinline)) void* old_tls_get_addr(TLSIndex* idx) {
+  void* start = pthread_getspecific(old_key);
+  if (!start) {
+    start = calloc(1, 64);
+    pthread_setspecific(old_key, start);
+  }
+  return static_cast<char*>(start) + idx->offset;
+}
+
+__attribute__((noinline)) int old_increment() {
+  static TLSIndex idx{0, 0};
+  return ++*static_cast<int*>(old_tls_get_addr(&idx));
+}
+
+// nanoseconds per call of `fn` on each of `n_threads` threads
+double measure(size_t n_accesses, size_t n_threads, int (*fn)()) {
+  std::vector<double> times(n_threads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      fn(); // first touch is not part of the steady state
+      auto begin = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < n_accesses; ++i) {
+        fn();
+      }
+      auto end = std::chrono::steady_clock::now();
+      times[t] = std::chrono::duration<double, std::nano>(end - begin).count() /
+          n_accesses;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return *std::max_element(times.begin(), times.end());
+}
+
+} // namespace
+
+// NOLINTNEXTLINE(bugprone-exception-escape)
+int main(int argc, char* argv[]) {
+  const char* library = argc > 1 ? argv[1] : TLS_BENCHMARK_LIB;
+  size_t n_accesses = argc > 2 ? atoll(argv[2]) : 100000000;
+  size_t n_threads = argc > 3 ? atoi(argv[3]) : 1;
+
+  const char* args[] = {"tls_benchmark"};
+  auto custom = CustomLibrary::create(library, 1, args);
+  custom->add_search_library(SystemLibrary::create());
+  custom->load();
+  auto custom_increment =
+      (int (*)())custom->sym("tls_benchmark_increment").value();
+
+  void* handle = dlopen(library, RTLD_LOCAL | RTLD_NOW);
+  if (!handle) {
+    std::cerr << dlerror() << "\n";
+    return 1;
+  }
+  auto dlopen_increment = (int (*)())dlsym(handle, "tls_benchmark_increment");
+
+  pthread_key_create(&old_key, free);
+
+  std::cout << "loader, ns_per_access\n";
+  std::cout << "custom, " << measure(n_accesses, n_threads, custom_increment)
+            << "\n";
+  std::cout << "custom_pthread_key (before), "
+            << measure(n_accesses, n_threads, old_increment) << "\n";
+  std::cout << "dlopen, " << measure(n_accesses, n_threads, dlopen_increment)
+            << "\n";
+  return 0;
+}
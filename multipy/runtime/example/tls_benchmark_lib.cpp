@@ -0,0 +1,14 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Library loaded by tls_benchmark, each call makes one access to a
+// thread local variable through the general dynamic TLS model.
+
+thread_local int counter = 0;
+
+extern "C" __attribute__((noinline)) int tls_benchmark_increment() {
+  return ++counter;
+}
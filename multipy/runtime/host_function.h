@@ -0,0 +1,34 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <dlfcn.h>
+
+namespace torch {
+namespace deploy {
+
+// Some process-wide state, like the symbol cache of the loader and the
+// registry of embedded archives, lives in files that are compiled both into
+// the host and into every interpreter. The host exports its copies of the
+// functions owning that state, and the copies inside the interpreters call
+// those through this, so that there is only one. When the host does not
+// export `name` (e.g. it was loaded with RTLD_LOCAL, or without -rdynamic),
+// returns `fallback`, and sets `*found` to false if given.
+template <typename F>
+F host_function(const char* name, F fallback, bool* found = nullptr) {
+  // not RTLD_DEFAULT: the interpreters are loaded with RTLD_DEEPBIND and
+  // would find their own definitions first
+  void* host = dlopen(nullptr, RTLD_LAZY | RTLD_NOLOAD);
+  void* r = host ? dlsym(host, name) : nullptr;
+  if (found) {
+    *found = r != nullptr;
+  }
+  return r ? reinterpret_cast<F>(r) : fallback;
+}
+
+} // namespace deploy
+} // namespace torch
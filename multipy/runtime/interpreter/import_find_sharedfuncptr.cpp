@@ -21,9 +21,10 @@ std::vector<CustomLibraryPtr> search_files_;
 // NOLINTNEXTLINE
 static void* deploy_self = nullptr;
 
-void loadSearchFile(const char* pathname) {
+void loadSearchFile(const char* pathname, size_t offset, size_t size) {
   const char* args[] = {"deploy"};
-  search_files_.emplace_back(CustomLibrary::create(pathname, 1, args));
+  search_files_.emplace_back(
+      CustomLibrary::create(pathname, offset, size, 1, args));
   CustomLibrary& lib = *search_files_.back();
   lib.add_search_library(SystemLibrary::create(deploy_self));
   lib.add_search_library(SystemLibrary::create());
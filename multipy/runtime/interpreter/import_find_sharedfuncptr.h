@@ -4,4 +4,8 @@
 // This source code is licensed under the BSD-style license found in the
 // LICENSE file in the root directory of this source tree.
 
-void loadSearchFile(const char* pathname);
+#include <cstddef>
+
+// loads the library at `pathname` with the custom loader. If `size` is
+// non-zero only the `size` bytes starting at `offset` are the library.
+void loadSearchFile(const char* pathname, size_t offset = 0, size_t size = 0);
@@ -11,6 +11,7 @@
 #include <Python.h>
 #include <fmt/format.h>
 #include <multipy/runtime/Exception.h>
+#include <multipy/runtime/embedded_archive.h>
 #include <multipy/runtime/interpreter/builtin_registry.h>
 #include <multipy/runtime/interpreter/import_find_sharedfuncptr.h>
 #include <multipy/runtime/interpreter/plugin_registry.h>
@@ -23,10 +24,12 @@
 #include <torch/csrc/jit/frontend/tracer.h>
 #include <torch/csrc/utils/pybind.h>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <thread>
 
@@ -205,6 +208,224 @@ static py::object global_impl(const char* module, const char* name) {
   return py::module::import(module).attr(name);
 }
 
+#ifdef FBCODE_CAFFE2
+// Path hook for the `sys.path` entries of the archives of python modules
+// embedded in the binary (see EmbeddedArchive). Modules are read straight out
+// of the archive through `_read_embedded_archive`, from their source or, if
+// there is none, from bytecode compiled by this version of Python, like
+// zipimport does. Extension modules are loaded
+// from the file `_materialize_embedded_archive` writes them to. The resources
+// of packages are read the same way by importlib.resources.
+const char* embedded_archive_importer = R"PYTHON(
+import importlib.abc
+import importlib.machinery
+import importlib.util
+import io
+import marshal
+
+class EmbeddedArchivePath(getattr(importlib.abc, "Traversable", object)):
+    """A file or directory in an archive, for importlib.resources.files()."""
+
+    def __init__(self, path):
+        self._path = path
+
+    @property
+    def name(self):
+        return self._path.rpartition("/")[2]
+
+    def iterdir(self):
+        return (self.joinpath(n) for n in _list_embedded_archive(self._path))
+
+    def is_dir(self):
+        return _is_embedded_archive_dir(self._path)
+
+    def is_file(self):
+        parent, _, name = self._path.rpartition("/")
+        return not self.is_dir() and name in _list_embedded_archive(parent)
+
+    def joinpath(self, *descendants):
+        return EmbeddedArchivePath("/".join((self._path,) + descendants))
+
+    __truediv__ = joinpath
+
+    def read_bytes(self):
+        data = _read_embedded_archive(self._path)
+        if data is None:
+            raise FileNotFoundError(self._path)
+        return data
+
+    def read_text(self, encoding=None):
+        return self.read_bytes().decode(encoding or "utf-8")
+
+    def open(self, mode="r", *args, **kwargs):
+        if mode not in ("r", "rb"):
+            raise ValueError(f"{self._path} can only be opened for reading")
+        stream = io.BytesIO(self.read_bytes())
+        if mode == "rb":
+            return stream
+        return io.TextIOWrapper(stream, *args, **kwargs)
+
+    def __str__(self):
+        return self._path
+
+class EmbeddedArchiveResourceReader(importlib.abc.ResourceReader):
+    def __init__(self, path):
+        self._files = EmbeddedArchivePath(path)
+
+    def open_resource(self, resource):
+        return self._files.joinpath(resource).open("rb")
+
+    def resource_path(self, resource):
+        # only archives that can write files have paths for them, otherwise
+        # importlib.resources copies what open_resource returns to one
+        filename = _materialize_embedded_archive(f"{self._files}/{resource}")
+        if filename is None:
+            raise FileNotFoundError(resource)
+        return filename
+
+    def is_resource(self, name):
+        return self._files.joinpath(name).is_file()
+
+    def contents(self):
+        return _list_embedded_archive(str(self._files))
+
+    def files(self):
+        return self._files
+
+class EmbeddedArchiveLoader(importlib.abc.InspectLoader):
+    def __init__(self, filename, is_package, source):
+        self.filename = filename
+        self._is_package = is_package
+        # read when the module was found, and dropped once it is executed
+        self._source = source
+
+    def is_package(self, fullname):
+        return self._is_package
+
+    def get_source(self, fullname):
+        if self.filename.endswith(".pyc"):
+            return None
+        return importlib.util.decode_source(self._get_source())
+
+    def get_code(self, fullname):
+        source = self._get_source()
+        self._source = None
+        if self.filename.endswith(".pyc"):
+            # the flags and the timestamp or hash of the source follow the
+            # magic number, but there is no source to check them against
+            return marshal.loads(memoryview(source)[16:])
+        return compile(source, self.filename, "exec", dont_inherit=True)
+
+    def get_data(self, path):
+        data = _read_embedded_archive(path)
+        if data is None:
+            raise OSError(f"{path} not found")
+        return data
+
+    def _get_source(self):
+        if self._source is not None:
+            return self._source
+        return self.get_data(self.filename)
+
+    def get_resource_reader(self, fullname):
+        if not self._is_package:
+            return None
+        return EmbeddedArchiveResourceReader(self.filename.rpartition("/")[0])
+
+class EmbeddedArchiveFinder(importlib.abc.PathEntryFinder):
+    def __init__(self, path):
+        self.path = path
+
+    def find_spec(self, fullname, target=None):
+        # same order as the FileFinder for directories on the filesystem
+        name = f"{self.path}/{fullname.rpartition('.')[2]}"
+        spec = self._source_spec(fullname, f"{name}/__init__", name)
+        if spec is not None:
+            return spec
+        for suffix in importlib.machinery.EXTENSION_SUFFIXES:
+            filename = _materialize_embedded_archive(name + suffix)
+            if filename is not None:
+                loader = importlib.machinery.ExtensionFileLoader(
+                    fullname, filename
+                )
+                return importlib.util.spec_from_file_location(
+                    fullname, filename, loader=loader
+                )
+        spec = self._source_spec(fullname, name, None)
+        if spec is not None:
+            return spec
+        if _is_embedded_archive_dir(name):
+            spec = importlib.machinery.ModuleSpec(fullname, None, is_package=True)
+            spec.submodule_search_locations = [name]
+            return spec
+        return None
+
+    def _source_spec(self, fullname, path, package_path):
+        filename = path + ".py"
+        source = _read_embedded_archive(filename)
+        if source is None:
+            filename = path + ".pyc"
+            source = _read_embedded_archive(filename)
+            # skip bytecode compiled by another version of Python
+            if source is None or source[:4] != importlib.util.MAGIC_NUMBER:
+                return None
+        is_package = package_path is not None
+        loader = EmbeddedArchiveLoader(filename, is_package, source)
+        spec = importlib.machinery.ModuleSpec(
+            fullname, loader, origin=filename, is_package=is_package
+        )
+        spec.has_location = True
+        if is_package:
+            spec.submodule_search_locations = [package_path]
+        return spec
+
+def path_hook(path):
+    if not path.startswith("embedded_archive:"):
+        raise ImportError("not an embedded archive")
+    return EmbeddedArchiveFinder(path)
+)PYTHON";
+
+static void installEmbeddedArchiveImporter() {
+  using torch::deploy::EmbeddedArchive;
+  py::dict scope;
+  scope["__builtins__"] = py::module::import("builtins");
+  scope["_read_embedded_archive"] =
+      py::cpp_function([](const std::string& path) -> py::object {
+        std::string name;
+        auto archive = EmbeddedArchive::fromPythonPath(path, &name);
+        auto contents = archive ? archive->read(name) : std::nullopt;
+        return contents ? py::bytes(*contents) : py::none();
+      });
+  scope["_is_embedded_archive_dir"] =
+      py::cpp_function([](const std::string& path) {
+        std::string name;
+        auto archive = EmbeddedArchive::fromPythonPath(path, &name);
+        return archive && archive->isDirectory(name);
+      });
+  scope["_list_embedded_archive"] =
+      py::cpp_function([](const std::string& path) {
+        std::string name;
+        auto archive = EmbeddedArchive::fromPythonPath(path, &name);
+        py::list names;
+        if (archive) {
+          for (const auto& entry : archive->list(name)) {
+            names.append(py::str(entry));
+          }
+        }
+        return names;
+      });
+  scope["_materialize_embedded_archive"] =
+      py::cpp_function([](const std::string& path) -> py::object {
+        std::string name;
+        auto archive = EmbeddedArchive::fromPythonPath(path, &name);
+        auto filename = archive ? archive->materialize(name) : std::nullopt;
+        return filename ? py::str(*filename) : py::none();
+      });
+  py::exec(embedded_archive_importer, scope);
+  global_impl("sys", "path_hooks").attr("insert")(0, scope["path_hook"]);
+}
+#endif
+
 using at::IValue;
 using torch::deploy::Obj;
 using torch::deploy::PickledObject;
@@ -370,12 +591,21 @@ struct __attribute__((visibility("hidden"))) ConcreteInterpreterObj
   py::object pyObject_;
 };
 
+static double secondsSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
 extern "C" __attribute__((visibility("default"))) void
 ConcreteInterpreterImplConstructorCommon(
     const std::vector<std::string>& extra_python_paths,
-    const std::vector<std::string>& plugin_paths) {
+    const std::vector<torch::deploy::PluginFile>& plugins,
+    torch::deploy::InterpreterStartupStats& stats) {
   BuiltinRegistry::runPreInitialization();
 
+  auto begin = std::chrono::steady_clock::now();
+
 #if PY_VERSION_HEX >= 0x03080100
   // For Python 3.8+.
   PyPreConfig preconfig;
@@ -420,15 +650,18 @@ ConcreteInterpreterImplConstructorCommon(
   Py_InitializeEx(1);
   TORCH_INTERNAL_ASSERT(Py_IsInitialized);
 #endif
+  stats.initializePython = secondsSince(begin);
 
 #ifdef FBCODE_CAFFE2
+  installEmbeddedArchiveImporter();
   auto sys_path = global_impl("sys", "path");
   for (const auto& entry : extra_python_paths) {
     sys_path.attr("insert")(0, entry);
   }
 #endif
 
-  if (plugin_paths.size() > 0) {
+  begin = std::chrono::steady_clock::now();
+  if (plugins.size() > 0) {
     auto sys_path = global_impl("sys", "path").cast<std::vector<std::string>>();
     std::string libtorch_python_path;
     for (const auto& path : sys_path) {
@@ -438,13 +671,19 @@ ConcreteInterpreterImplConstructorCommon(
         break;
       }
     }
+    // one after another: every search file resolves its symbols against the
+    // ones loaded before it, e.g. the plugins against libtorch_python. The
+    // relocations of each are spread over the loader's helper threads.
     loadSearchFile(libtorch_python_path.c_str());
-    for (const auto& path : plugin_paths) {
-      loadSearchFile(path.c_str());
+    for (const auto& plugin : plugins) {
+      loadSearchFile(plugin.path.c_str(), plugin.offset, plugin.size);
     }
   }
+  stats.loadPlugins = secondsSince(begin);
 
+  begin = std::chrono::steady_clock::now();
   BuiltinRegistry::runPostInitialization();
+  stats.postInitialization = secondsSince(begin);
 }
 
 struct __attribute__((visibility("hidden"))) ConcreteInterpreterImpl
@@ -683,14 +922,28 @@ extern "C"
     __attribute__((visibility("default"))) torch::deploy::InterpreterImpl*
     newInterpreterImpl(
         const std::vector<std::string>& extra_python_paths,
-        const std::vector<std::string>& plugin_paths) {
-  ConcreteInterpreterImplConstructorCommon(extra_python_paths, plugin_paths);
-
-  int r = PyRun_SimpleString(start);
-  TORCH_INTERNAL_ASSERT(r == 0);
-
-  // disable python callstack for jit tracer
-  ::torch::jit::tracer::setPythonCallstack(&noPythonCallstack);
+        const std::vector<torch::deploy::PluginFile>& plugins,
+        std::mutex& start_lock,
+        torch::deploy::InterpreterStartupStats& stats) {
+  ConcreteInterpreterImplConstructorCommon(extra_python_paths, plugins, stats);
+
+  {
+    // Everything above only touches state owned by this copy of the
+    // interpreter and can run concurrently with other interpreters being
+    // created. Importing torch registers state in the libraries shared by the
+    // whole process, so the start script runs under a lock owned by the host.
+    auto begin = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard(start_lock);
+    stats.startLockWait = secondsSince(begin);
+
+    begin = std::chrono::steady_clock::now();
+    int r = PyRun_SimpleString(start);
+    TORCH_INTERNAL_ASSERT(r == 0);
+
+    // disable python callstack for jit tracer
+    ::torch::jit::tracer::setPythonCallstack(&noPythonCallstack);
+    stats.startScript = secondsSince(begin);
+  }
 
   py::object saveStorage =
       global_impl("multipy.utils._deploy", "_save_storages");
@@ -13,6 +13,7 @@
 #include <multipy/runtime/Exception.h>
 
 #include <optional>
+#include <string>
 
 namespace torch {
 namespace deploy {
@@ -20,6 +21,31 @@ namespace deploy {
 struct InterpreterSessionImpl;
 struct Obj;
 
+// A library that each interpreter loads with the custom loader. If `size` is
+// non-zero the library is not a file of its own but the `size` bytes of `path`
+// starting at `offset`.
+struct PluginFile {
+  std::string path;
+  size_t offset{0};
+  size_t size{0};
+};
+
+// How long each phase of starting an interpreter took, in seconds. The host
+// records the phases up to loading the interpreter library and the
+// interpreter fills in the ones that run python.
+struct InterpreterStartupStats {
+  double extractPayload{0}; // writing out the interpreter and plugin files
+  double loadLibrary{0}; // dlopen of the interpreter library
+  size_t relocations{0}; // processed while loading the interpreter library
+  double initializePython{0}; // Py_InitializeFromConfig
+  double loadPlugins{0}; // custom loading libtorch_python and the plugins
+  double postInitialization{0}; // BuiltinRegistry::runPostInitialization
+  double startLockWait{0}; // waiting for other interpreters to run `start`
+  double startScript{0}; // importing torch and multipy.utils
+  double configureInterpreter{0}; // Environment::configureInterpreter
+  double total{0};
+};
+
 // Representation a Pickled Object
 struct PickledObject {
   std::string data_;
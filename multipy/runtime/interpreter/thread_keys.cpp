@@ -0,0 +1,30 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// The interpreter library is linked with --wrap for the pthread key functions,
+// so that python and everything else baked into it use the keys of the loader
+// instead of taking real pthread keys for every interpreter.
+
+#include <multipy/runtime/loader.h>
+
+extern "C" {
+
+int __wrap_pthread_key_create(pthread_key_t* key, void (*destructor)(void*)) {
+  return torch::deploy::tls_key_create(key, destructor);
+}
+
+int __wrap_pthread_key_delete(pthread_key_t key) {
+  return torch::deploy::tls_key_delete(key);
+}
+
+void* __wrap_pthread_getspecific(pthread_key_t key) {
+  return torch::deploy::tls_getspecific(key);
+}
+
+int __wrap_pthread_setspecific(pthread_key_t key, const void* value) {
+  return torch::deploy::tls_setspecific(key, value);
+}
+}
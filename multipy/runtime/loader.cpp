@@ -41,30 +41,50 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <link.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
 #include <climits>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <optional>
-#include <sstream>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <c10/util/irange.h>
 
 #include <fmt/format.h>
+#include <multipy/runtime/host_function.h>
 #include <multipy/runtime/loader.h>
 #include <multipy/runtime/mem_file.h>
 
+// missing from the headers of kernels before 5.14
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
 /* The ELF version installed with CentOS 7 comes with a trailing 64. For distro
  * independent use these are mapped. */
 
@@ -77,6 +97,18 @@
 
 #endif
 
+/* Packed relative relocations (-z pack-relative-relocs) are newer than the
+ * elf.h of many distros. */
+#ifndef DT_RELR
+#define DT_RELRSZ 35
+#define DT_RELR 36
+#define DT_RELRENT 37
+#endif
+
+#ifndef R_AARCH64_IRELATIVE
+#define R_AARCH64_IRELATIVE 1032
+#endif
+
 namespace torch {
 namespace deploy {
 
@@ -159,6 +191,8 @@ Elf64_Addr get_page_size() {
   return sPageSize;
 }
 
+constexpr Elf64_Addr kHugePageSize = 2 * 1024 * 1024;
+
 Elf64_Addr get_page_mask() {
   return ~(get_page_size() - 1);
 }
@@ -168,7 +202,7 @@ Elf64_Addr get_page_start(Elf64_Addr addr) {
 }
 
 Elf64_Addr get_page_end(Elf64_Addr addr) {
-  return get_page_start(addr) + (get_page_size() - 1);
+  return get_page_start(addr + get_page_size() - 1);
 }
 
 Elf64_Addr get_page_offset(Elf64_Addr addr) {
@@ -225,24 +259,6 @@ size_t phdr_table_get_load_size(
    MAYBE_MAP_FLAG((x), PF_R, PROT_READ) | \
    MAYBE_MAP_FLAG((x), PF_W, PROT_WRITE))
 
-// holds a pre-computed hash for a string that is used in a GNU-style hash
-// tables and also keeps track of the string length.
-struct GnuHash {
-  GnuHash(const char* name) {
-    uint32_t h = 5381;
-    const uint8_t* name_bytes = reinterpret_cast<const uint8_t*>(name);
-#pragma unroll 8
-    while (*name_bytes != 0) {
-      h += (h << 5) +
-          *name_bytes++; // h*33 + c = h + h * 32 + c = h + h << 5 + c
-    }
-    hash = h;
-    name_len = reinterpret_cast<const char*>(name_bytes) - name;
-  }
-  uint32_t hash;
-  uint32_t name_len;
-};
-
 // this is a special builtin in the libc++ API used for telling C++ execption
 // frame unwinding about functions loaded from a pathway other than the libc
 // loader. it is passed a pointer to where the EH_FRAME section was loaded,
@@ -273,17 +289,234 @@ extern "C" void* __tls_get_addr(void*);
 // This object performs TLS emulation for modules not loaded by dlopen.
 // Normally modules have a module_id that is used as a key in libc for the
 // thread local data for that module. However, there is no public API for
-// assigning this module id. Instead, for modules that we load, we set module_id
-// to a pointer to a TLSSegment object, and replace __tls_get_addr with a
-// function that calls `addr`.
+// assigning this module id. Instead, modules that we load get an index of
+// their own, and we replace __tls_get_addr with a function that looks the
+// index up in an array of thread local blocks kept for each thread.
 
 // libc module_id's are sequential, so we use the top bit as a flag to see
-// if we have a local TLSegment object instead. This will break if
+// if we have a local module index instead. This will break if
 // someone creates 2^63 sequential objects, but it is hard to imagine
 // a system with enough RAM to do that.
 constexpr size_t TLS_LOCAL_FLAG = (1ULL << 63);
 
-static void* local__tls_get_addr(TLSIndex* idx);
+// the PT_TLS segment of a library we loaded
+struct TLSModule {
+  const void* initialization_image = nullptr;
+  size_t file_size = 0;
+  size_t mem_size = 0;
+  size_t align = 1;
+};
+
+// Indexed by module index. Indices are never reused, so a thread can never
+// find the block of an unloaded library under the index of a new one.
+static std::mutex tls_modules_mutex;
+static std::vector<TLSModule> tls_modules;
+
+static size_t register_tls_module() {
+  std::lock_guard<std::mutex> guard(tls_modules_mutex);
+  tls_modules.emplace_back();
+  return tls_modules.size() - 1;
+}
+
+static void set_tls_module(size_t index, const TLSModule& module) {
+  std::lock_guard<std::mutex> guard(tls_modules_mutex);
+  tls_modules[index] = module;
+}
+
+// The blocks of one thread. They are carved out of larger arenas, so a thread
+// touching the TLS of many modules does not malloc for each of them.
+struct TLSThreadState {
+  static constexpr size_t kArenaSize = 16384;
+
+  std::vector<char*> blocks; // indexed by module index, nullptr if untouched
+  std::vector<void*> key_values; // indexed by key of tls_key_create
+  std::vector<void*> allocations;
+  char* arena_next = nullptr;
+  size_t arena_left = 0;
+
+  char* allocate(size_t size, size_t align) {
+    size_t padding = (align - reinterpret_cast<uintptr_t>(arena_next) % align) %
+        align;
+    if (arena_next && padding + size <= arena_left) {
+      char* r = arena_next + padding;
+      arena_next += padding + size;
+      arena_left -= padding + size;
+      return r;
+    }
+    if (size + align > kArenaSize / 4) {
+      // large blocks get an allocation of their own
+      void* r = aligned_alloc(align, (size + align - 1) / align * align);
+      allocations.push_back(r);
+      return static_cast<char*>(r);
+    }
+    arena_next = static_cast<char*>(malloc(kArenaSize));
+    arena_left = kArenaSize;
+    allocations.push_back(arena_next);
+    return allocate(size, align);
+  }
+
+  ~TLSThreadState() {
+    for (void* allocation : allocations) {
+      free(allocation);
+    }
+  }
+};
+
+// Trivially destructible, so reading it is all the fast path has to do.
+struct TLSBlocks {
+  char** blocks;
+  size_t n_blocks;
+  void** key_values;
+  size_t n_key_values;
+  TLSThreadState* state;
+};
+thread_local TLSBlocks tls_blocks = {nullptr, 0, nullptr, 0, nullptr};
+
+// destructors of the keys created by tls_key_create, indexed by key
+static std::mutex tls_keys_mutex;
+static std::vector<void (*)(void*)> tls_key_destructors;
+
+static void destroy_tls_thread_state(void* s) {
+  auto* state = static_cast<TLSThreadState*>(s);
+  // like pthreads, keep calling the destructors of keys which have values
+  for (int round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS; ++round) {
+    bool called = false;
+    for (size_t key = 0; key < state->key_values.size(); ++key) {
+      void* value = state->key_values[key];
+      if (!value) {
+        continue;
+      }
+      void (*destructor)(void*) = nullptr;
+      {
+        std::lock_guard<std::mutex> guard(tls_keys_mutex);
+        destructor = tls_key_destructors[key];
+      }
+      if (destructor) {
+        state->key_values[key] = nullptr;
+        destructor(value);
+        called = true;
+      }
+    }
+    if (!called) {
+      break;
+    }
+  }
+  delete state;
+  tls_blocks = {nullptr, 0, nullptr, 0, nullptr};
+}
+
+// NOLINTNEXTLINE
+extern "C" void* __dso_handle;
+
+static TLSThreadState& tls_thread_state() {
+  if (!tls_blocks.state) {
+    tls_blocks.state = new TLSThreadState();
+    __cxxabiv1::__cxa_thread_atexit(
+        destroy_tls_thread_state, tls_blocks.state, &__dso_handle);
+  }
+  return *tls_blocks.state;
+}
+
+// first access of this thread to the TLS of `module`
+__attribute__((noinline)) static char* allocate_tls_block(size_t module) {
+  TLSModule info;
+  {
+    std::lock_guard<std::mutex> guard(tls_modules_mutex);
+    info = tls_modules.at(module);
+  }
+  TLSThreadState& state = tls_thread_state();
+  char* block = state.allocate(info.mem_size, info.align);
+  memcpy(block, info.initialization_image, info.file_size);
+  memset(block + info.file_size, 0, info.mem_size - info.file_size);
+  if (state.blocks.size() <= module) {
+    state.blocks.resize(module + 1, nullptr);
+  }
+  state.blocks[module] = block;
+  tls_blocks.blocks = state.blocks.data();
+  tls_blocks.n_blocks = state.blocks.size();
+  return block;
+}
+
+static void* local__tls_get_addr(TLSIndex* idx) {
+  if ((idx->module_id & TLS_LOCAL_FLAG) != 0) {
+    size_t module = idx->module_id & ~TLS_LOCAL_FLAG;
+    char* block =
+        module < tls_blocks.n_blocks ? tls_blocks.blocks[module] : nullptr;
+    if (__builtin_expect(block == nullptr, 0)) {
+      block = allocate_tls_block(module);
+    }
+    return block + idx->offset;
+  }
+  return __tls_get_addr(idx);
+}
+
+// Keys are never reused, so a thread cannot see the value it had for a
+// deleted key under a new one. Interpreters create only a handful of keys
+// each, and their loader goes away with them.
+int tls_key_create(pthread_key_t* key, void (*destructor)(void*)) {
+  std::lock_guard<std::mutex> guard(tls_keys_mutex);
+  if (tls_key_destructors.size() >= std::numeric_limits<pthread_key_t>::max()) {
+    return EAGAIN;
+  }
+  *key = tls_key_destructors.size();
+  tls_key_destructors.push_back(destructor);
+  return 0;
+}
+
+int tls_key_delete(pthread_key_t key) {
+  std::lock_guard<std::mutex> guard(tls_keys_mutex);
+  if (key >= tls_key_destructors.size()) {
+    return EINVAL;
+  }
+  tls_key_destructors[key] = nullptr;
+  return 0;
+}
+
+void* tls_getspecific(pthread_key_t key) {
+  return key < tls_blocks.n_key_values ? tls_blocks.key_values[key] : nullptr;
+}
+
+int tls_setspecific(pthread_key_t key, const void* value) {
+  if (key >= tls_blocks.n_key_values) {
+    {
+      std::lock_guard<std::mutex> guard(tls_keys_mutex);
+      if (key >= tls_key_destructors.size()) {
+        return EINVAL;
+      }
+    }
+    if (!value) {
+      return 0;
+    }
+    TLSThreadState& state = tls_thread_state();
+    state.key_values.resize(key + 1, nullptr);
+    tls_blocks.key_values = state.key_values.data();
+    tls_blocks.n_key_values = state.key_values.size();
+  }
+  tls_blocks.key_values[key] = const_cast<void*>(value);
+  return 0;
+}
+
+// the pthread key functions which are replaced by the ones above in the
+// libraries we load
+static std::optional<Elf64_Addr> replaced_pthread_function(const char* name) {
+  if (strncmp(name, "pthread_", 8) != 0) {
+    return std::nullopt;
+  }
+  name += 8;
+  if (strcmp(name, "key_create") == 0) {
+    return (Elf64_Addr)tls_key_create;
+  }
+  if (strcmp(name, "key_delete") == 0) {
+    return (Elf64_Addr)tls_key_delete;
+  }
+  if (strcmp(name, "getspecific") == 0) {
+    return (Elf64_Addr)tls_getspecific;
+  }
+  if (strcmp(name, "setspecific") == 0) {
+    return (Elf64_Addr)tls_setspecific;
+  }
+  return std::nullopt;
+}
 
 /* LLDB puts a breakpoint in this function, and reads __deploy_module_info to
  * get debug info from library.  */
@@ -308,6 +541,791 @@ extern "C" {
 DeployModuleInfo __deploy_module_info;
 }
 
+// Every interpreter is its own copy of this loader, yet they all resolve the
+// same symbols against the same system libraries. Results of dlsym are
+// therefore cached in the host process, which exports the cache to the copies.
+//
+// Entries are keyed by (handle, name, version). A handle can only be reused
+// after a library is unloaded, and a symbol that was not found may be provided
+// by a library loaded later. So found symbols are valid until any library is
+// unloaded, and missing ones only until any library is loaded.
+struct DlGeneration {
+  unsigned long long adds = 0;
+  unsigned long long subs = 0;
+};
+
+static DlGeneration current_dl_generation() {
+  DlGeneration generation;
+  dl_iterate_phdr(
+      [](struct dl_phdr_info* info, size_t size, void* data) {
+        if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                sizeof(info->dlpi_subs)) {
+          auto* generation = static_cast<DlGeneration*>(data);
+          generation->adds = info->dlpi_adds;
+          generation->subs = info->dlpi_subs;
+        }
+        return 1;
+      },
+      &generation);
+  return generation;
+}
+
+// set while a library is being relocated, so that its lookups do not each
+// have to query the generation
+thread_local const DlGeneration* relocation_generation = nullptr;
+
+struct RelocationGenerationGuard {
+  explicit RelocationGenerationGuard(const DlGeneration& generation) {
+    relocation_generation = &generation;
+  }
+  ~RelocationGenerationGuard() {
+    relocation_generation = nullptr;
+  }
+};
+
+struct SymbolCacheKey {
+  void* handle;
+  uint32_t hash;
+  std::string name; // followed by '\0' and the version if there is one
+
+  bool operator==(const SymbolCacheKey& rhs) const {
+    return handle == rhs.handle && hash == rhs.hash && name == rhs.name;
+  }
+};
+
+struct SymbolCacheKeyHash {
+  size_t operator()(const SymbolCacheKey& key) const {
+    return key.hash ^ (reinterpret_cast<size_t>(key.handle) >> 4);
+  }
+};
+
+struct SymbolCacheEntry {
+  Elf64_Addr addr; // 0 if the symbol was not found
+  DlGeneration generation;
+};
+
+struct SymbolCache {
+  // sharded by hash so that interpreters being loaded concurrently rarely
+  // contend for the same lock
+  static constexpr size_t kNumShards = 64;
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<SymbolCacheKey, SymbolCacheEntry, SymbolCacheKeyHash>
+        entries;
+  };
+  Shard shards[kNumShards];
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> lookup_ns{0};
+};
+
+static SymbolCache& symbol_cache() {
+  static SymbolCache* cache = new SymbolCache(); // leaked, used until exit
+  return *cache;
+}
+
+extern "C" {
+
+// Resolves `name` in `handle` like dlsym/dlvsym, returning 0 if it is not
+// found. Called through a pointer found by shared_cached_dlsym, so it is
+// always the host process which calls dlsym.
+__attribute__((visibility("default"))) Elf64_Addr deploy_cached_dlsym(
+    void* handle,
+    const char* name,
+    const char* version,
+    uint32_t hash,
+    unsigned long long adds,
+    unsigned long long subs) {
+  SymbolCache& cache = symbol_cache();
+  thread_local SymbolCacheKey key;
+  key.handle = handle;
+  key.hash = hash;
+  key.name = name;
+  if (version) {
+    key.name.push_back('\0');
+    key.name.append(version);
+  }
+  auto& shard =
+      cache.shards[SymbolCacheKeyHash()(key) % SymbolCache::kNumShards];
+  {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && it->second.generation.subs == subs &&
+        (it->second.addr || it->second.generation.adds == adds)) {
+      cache.hits.fetch_add(1, std::memory_order_relaxed);
+      return it->second.addr;
+    }
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  void* r = version ? dlvsym(handle, name, version) : dlsym(handle, name);
+  cache.lookup_ns.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - begin)
+          .count(),
+      std::memory_order_relaxed);
+  cache.misses.fetch_add(1, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.entries[key] =
+      SymbolCacheEntry{(Elf64_Addr)r, DlGeneration{adds, subs}};
+  return (Elf64_Addr)r;
+}
+
+__attribute__((visibility("default"))) void deploy_symbol_cache_stats(
+    SymbolCacheStats* stats) {
+  SymbolCache& cache = symbol_cache();
+  stats->hits = cache.hits.load(std::memory_order_relaxed);
+  stats->misses = cache.misses.load(std::memory_order_relaxed);
+  stats->lookup_seconds =
+      cache.lookup_ns.load(std::memory_order_relaxed) / 1e9;
+}
+}
+
+// The host process exports its own copies of the functions above. When this
+// loader is one of the copies inside an interpreter, host_function gets those
+// of the host so that all interpreters share one cache, otherwise ours.
+
+static std::optional<Elf64_Addr> cached_dlsym(
+    void* handle,
+    const char* name,
+    const char* version,
+    const GnuHash& hash) {
+  static auto fn = host_function("deploy_cached_dlsym", &deploy_cached_dlsym);
+  DlGeneration generation = relocation_generation ? *relocation_generation
+                                                  : current_dl_generation();
+  Elf64_Addr r = fn(
+      handle, name, version, hash.hash, generation.adds, generation.subs);
+  if (!r) {
+    return std::nullopt;
+  }
+  return r;
+}
+
+SymbolCacheStats symbol_cache_stats() {
+  static auto fn =
+      host_function("deploy_symbol_cache_stats", &deploy_symbol_cache_stats);
+  SymbolCacheStats stats{};
+  fn(&stats);
+  return stats;
+}
+
+// Whether libraries bind their PLT entries lazily unless told otherwise. Like
+// the caches above, the setting of the host applies to all interpreters.
+static std::atomic<bool>& lazy_binding_default() {
+  static std::atomic<bool> lazy{false};
+  return lazy;
+}
+
+extern "C" __attribute__((visibility("default"))) bool
+deploy_lazy_binding_default() {
+  return lazy_binding_default();
+}
+
+void set_default_lazy_binding(bool lazy) {
+  lazy_binding_default() = lazy;
+}
+
+// Whether libraries copy their code to memory that can be backed by
+// transparent huge pages, unless told otherwise. Also set by the host.
+static std::atomic<bool>& huge_page_text_default() {
+  static std::atomic<bool> huge_pages{false};
+  return huge_pages;
+}
+
+extern "C" __attribute__((visibility("default"))) bool
+deploy_huge_page_text_default() {
+  return huge_page_text_default();
+}
+
+void set_default_huge_page_text(bool huge_pages) {
+  huge_page_text_default() = huge_pages;
+}
+
+// The host also keeps the loaded libraries that replay page lists, so that
+// save_page_lists() reaches those of every interpreter.
+struct PrefetchSettings {
+  std::atomic<PrefetchPolicy> policy{PrefetchPolicy::None};
+  std::mutex page_list_dir_mutex;
+  std::string page_list_dir;
+  std::mutex libraries_mutex;
+  // library -> the function of its loader that saves its page list
+  std::unordered_map<void*, void (*)(void*)> libraries;
+};
+
+static PrefetchSettings& prefetch_settings() {
+  static auto* settings = new PrefetchSettings();
+  return *settings;
+}
+
+extern "C" {
+__attribute__((visibility("default"))) PrefetchPolicy
+deploy_prefetch_policy() {
+  return prefetch_settings().policy;
+}
+
+__attribute__((visibility("default"))) void deploy_page_list_dir(
+    std::string* dir) {
+  PrefetchSettings& settings = prefetch_settings();
+  std::lock_guard<std::mutex> guard(settings.page_list_dir_mutex);
+  *dir = settings.page_list_dir;
+}
+
+// stops tracking `library` if `save` is nullptr
+__attribute__((visibility("default"))) void deploy_track_page_list(
+    void* library,
+    void (*save)(void*)) {
+  PrefetchSettings& settings = prefetch_settings();
+  std::lock_guard<std::mutex> guard(settings.libraries_mutex);
+  if (save) {
+    settings.libraries[library] = save;
+  } else {
+    settings.libraries.erase(library);
+  }
+}
+
+__attribute__((visibility("default"))) void deploy_save_page_lists() {
+  PrefetchSettings& settings = prefetch_settings();
+  // held while saving, so that no library is unloaded in the meantime
+  std::lock_guard<std::mutex> guard(settings.libraries_mutex);
+  for (const auto& entry : settings.libraries) {
+    entry.second(entry.first);
+  }
+}
+}
+
+void set_default_prefetch_policy(PrefetchPolicy policy) {
+  prefetch_settings().policy = policy;
+}
+
+void set_page_list_dir(std::string dir) {
+  PrefetchSettings& settings = prefetch_settings();
+  std::lock_guard<std::mutex> guard(settings.page_list_dir_mutex);
+  settings.page_list_dir = std::move(dir);
+}
+
+void save_page_lists() {
+  static auto fn =
+      host_function("deploy_save_page_lists", &deploy_save_page_lists);
+  fn();
+}
+
+// Profilers cannot symbolize the libraries we load, since the dynamic linker
+// does not know about them. perf (and tools that follow its convention) looks
+// up such addresses in /tmp/perf-<pid>.map, which all interpreters append to
+// through the host. The format has no way to remove entries, so when a library
+// is unloaded and another one mapped at its addresses, profilers may still
+// attribute them to the functions of the first one.
+static std::atomic<bool>& perf_map_enabled() {
+  static std::atomic<bool> enabled{getenv("MULTIPY_PERF_MAP") != nullptr};
+  return enabled;
+}
+
+extern "C" {
+__attribute__((visibility("default"))) bool deploy_perf_map_enabled() {
+  return perf_map_enabled();
+}
+
+__attribute__((visibility("default"))) void deploy_write_perf_map(
+    const char* data,
+    size_t size) {
+  static std::mutex mutex;
+  static int fd = -1;
+  static bool failed = false;
+  std::lock_guard<std::mutex> guard(mutex);
+  if (fd == -1) {
+    if (failed) {
+      return;
+    }
+    // the name is predictable and /tmp is shared, so do not follow a symlink
+    // or append to a file someone else created there
+    std::string path = fmt::format("/tmp/perf-{}.map", getpid());
+    fd = open(
+        path.c_str(),
+        O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOFOLLOW,
+        0644);
+    if (fd == -1) {
+      std::cerr << fmt::format(
+          "warning, could not open {}: {}\n", path, strerror(errno));
+      failed = true;
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid()) {
+      std::cerr << fmt::format(
+          "warning, not writing to {}, which is not a file we own\n", path);
+      close(fd);
+      fd = -1;
+      failed = true;
+      return;
+    }
+  }
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+}
+
+void set_perf_map(bool enabled) {
+  perf_map_enabled() = enabled;
+}
+
+#ifdef __x86_64__
+// PLT entries of a lazily bound library start out jumping to PLT0, which
+// pushes GOT[1] (the library) on top of the index of the relocation that
+// was pushed by the entry and then jumps to GOT[2], which is this trampoline.
+// It saves the argument registers, binds the entry with
+// deploy_lazy_bind(library, index) and jumps to the function it was bound to.
+//
+// Binding runs string functions and hashing that may use AVX and vzeroupper,
+// so like glibc's _dl_runtime_resolve_xsave the trampoline saves the whole
+// vector state, including the upper halves of ymm/zmm arguments and the mask
+// registers, with xsave. The state components are those glibc saves (SSE,
+// AVX, MPX bounds, opmask, ZMM_Hi256, Hi16_ZMM), and the area is sized from
+// CPUID leaf 0xd by init_lazy_bind_save_area. Without xsave there are no
+// registers wider than xmm, and fxsave is enough.
+extern "C" void deploy_lazy_bind_trampoline();
+
+extern "C" {
+// the stack the trampoline needs below its 64 byte aligned frame: 64 bytes for
+// the integer registers followed by the fxsave or xsave area
+__attribute__((visibility("hidden"))) size_t deploy_lazy_bind_frame_size =
+    64 + 512;
+__attribute__((visibility("hidden"))) bool deploy_lazy_bind_xsave = false;
+}
+
+constexpr uint32_t kLazyBindXsaveMask = (1 << 1) | (1 << 2) | (1 << 3) |
+    (1 << 5) | (1 << 6) | (1 << 7);
+
+static bool init_lazy_bind_save_area() {
+  unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+  __cpuid(1, eax, ebx, ecx, edx);
+  if ((ecx & bit_OSXSAVE) == 0) {
+    return false;
+  }
+  uint32_t xcr0 = 0;
+  uint32_t xcr0_high = 0;
+  asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+  // the legacy region and the header, followed by the components at the
+  // offsets of the standard (not compacted) format
+  size_t size = 512 + 64;
+  for (uint32_t component = 2; component < 32; ++component) {
+    if ((kLazyBindXsaveMask & xcr0 & (1u << component)) == 0) {
+      continue;
+    }
+    __cpuid_count(0xd, component, eax, ebx, ecx, edx);
+    size = std::max<size_t>(size, ebx + eax);
+  }
+  deploy_lazy_bind_frame_size = (64 + size + 63) & ~size_t(63);
+  deploy_lazy_bind_xsave = true;
+  return true;
+}
+
+// 0xee is kLazyBindXsaveMask, the xsave area starts at 64(%rsp) and its header
+// at 576(%rsp), which has to be zero apart from what xsave writes
+asm(R"(
+  .text
+  .p2align 4
+  .hidden deploy_lazy_bind_trampoline
+  .type deploy_lazy_bind_trampoline, @function
+deploy_lazy_bind_trampoline:
+  .cfi_startproc
+  .cfi_adjust_cfa_offset 16
+  push %rbx
+  .cfi_adjust_cfa_offset 8
+  .cfi_rel_offset %rbx, 0
+  mov %rsp, %rbx
+  .cfi_def_cfa_register %rbx
+  and $-64, %rsp
+  sub deploy_lazy_bind_frame_size(%rip), %rsp
+  mov %rax, 0(%rsp)
+  mov %rcx, 8(%rsp)
+  mov %rdx, 16(%rsp)
+  mov %rsi, 24(%rsp)
+  mov %rdi, 32(%rsp)
+  mov %r8, 40(%rsp)
+  mov %r9, 48(%rsp)
+  cmpb $0, deploy_lazy_bind_xsave(%rip)
+  je 1f
+  xor %edx, %edx
+  mov %rdx, 576(%rsp)
+  mov %rdx, 584(%rsp)
+  mov %rdx, 592(%rsp)
+  mov %rdx, 600(%rsp)
+  mov %rdx, 608(%rsp)
+  mov %rdx, 616(%rsp)
+  mov %rdx, 624(%rsp)
+  mov %rdx, 632(%rsp)
+  mov $0xee, %eax
+  xsave 64(%rsp)
+  jmp 2f
+1:
+  fxsave 64(%rsp)
+2:
+  mov 8(%rbx), %rdi
+  mov 16(%rbx), %rsi
+  call deploy_lazy_bind
+  mov %rax, %r11
+  cmpb $0, deploy_lazy_bind_xsave(%rip)
+  je 3f
+  xor %edx, %edx
+  mov $0xee, %eax
+  xrstor 64(%rsp)
+  jmp 4f
+3:
+  fxrstor 64(%rsp)
+4:
+  mov 0(%rsp), %rax
+  mov 8(%rsp), %rcx
+  mov 16(%rsp), %rdx
+  mov 24(%rsp), %rsi
+  mov 32(%rsp), %rdi
+  mov 40(%rsp), %r8
+  mov 48(%rsp), %r9
+  mov %rbx, %rsp
+  .cfi_def_cfa_register %rsp
+  pop %rbx
+  .cfi_adjust_cfa_offset -8
+  .cfi_restore %rbx
+  add $16, %rsp
+  .cfi_adjust_cfa_offset -16
+  jmp *%r11
+  .cfi_endproc
+  .size deploy_lazy_bind_trampoline, .-deploy_lazy_bind_trampoline
+)");
+#endif
+
+// Relocations of large libraries are split across helper threads. Interpreters
+// are usually loaded concurrently, so the helpers come out of a budget shared
+// by the whole process instead of every load starting a thread per core.
+static std::atomic<size_t>& loader_threads_available() {
+  static std::atomic<size_t> available{
+      std::max<size_t>(std::thread::hardware_concurrency(), 1) - 1};
+  return available;
+}
+
+extern "C" {
+
+// returns how many of the `wanted` helper threads may be started
+__attribute__((visibility("default"))) size_t deploy_acquire_loader_threads(
+    size_t wanted) {
+  auto& available = loader_threads_available();
+  size_t current = available.load();
+  size_t granted = 0;
+  do {
+    granted = std::min(current, wanted);
+  } while (granted != 0 &&
+           !available.compare_exchange_weak(current, current - granted));
+  return granted;
+}
+
+__attribute__((visibility("default"))) void deploy_release_loader_threads(
+    size_t n) {
+  loader_threads_available().fetch_add(n);
+}
+}
+
+// The helper threads are started the first time they are needed and then
+// parked between loads, rather than started and joined for every library.
+// Only threads holding part of the budget above submit tasks, so the pool
+// never grows beyond it. The threads live in the host for the rest of the
+// process and run tasks of every interpreter.
+struct LoaderThreadPool {
+  void run(void (*fn)(void*), void* arg) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    tasks_.emplace_back(fn, arg);
+    if (tasks_.size() > idle_ && threads_ < max_threads_) {
+      // detached, the pool is never destroyed
+      std::thread([this]() { work(); }).detach();
+      ++threads_;
+    } else {
+      cv_.notify_one();
+    }
+  }
+
+ private:
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      ++idle_;
+      cv_.wait(lock, [this]() { return !tasks_.empty(); });
+      --idle_;
+      auto task = tasks_.front();
+      tasks_.pop_front();
+      lock.unlock();
+      task.first(task.second);
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::pair<void (*)(void*), void*>> tasks_;
+  size_t idle_ = 0;
+  size_t threads_ = 0;
+  // the whole budget, of which some is already taken once the pool starts
+  const size_t max_threads_ =
+      std::max<size_t>(std::thread::hardware_concurrency(), 1) - 1;
+};
+
+extern "C" {
+
+// runs `fn(arg)` on one of the helper threads of the host
+__attribute__((visibility("default"))) void deploy_run_on_loader_thread(
+    void (*fn)(void*),
+    void* arg) {
+  // NOLINTNEXTLINE(cppcoreguidelines-owning-memory)
+  static auto pool = new LoaderThreadPool();
+  pool->run(fn, arg);
+}
+}
+
+// the helpers of one run_with_helpers call, which waits for all of them
+struct HelperGroup {
+  const std::function<void()>* run;
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t running;
+
+  static void run_helper(void* arg) {
+    auto group = static_cast<HelperGroup*>(arg);
+    (*group->run)();
+    std::lock_guard<std::mutex> guard(group->mutex);
+    // notified with the lock held, the group is gone once it is released
+    if (--group->running == 0) {
+      group->done.notify_all();
+    }
+  }
+};
+
+// runs `fn` on the calling thread and up to `max_helpers` helper threads from
+// the shared budget, rethrowing the first exception any of them threw. `fn`
+// must not leave thread locals with destructors behind in an interpreter's
+// copy of the loader, the helpers outlive the interpreters.
+static void run_with_helpers(
+    size_t max_helpers,
+    const std::function<void()>& fn) {
+  static auto acquire = host_function(
+      "deploy_acquire_loader_threads", &deploy_acquire_loader_threads);
+  static auto release = host_function(
+      "deploy_release_loader_threads", &deploy_release_loader_threads);
+  static auto run_on_thread = host_function(
+      "deploy_run_on_loader_thread", &deploy_run_on_loader_thread);
+  size_t n_helpers = max_helpers ? acquire(max_helpers) : 0;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::function<void()> run = [&]() {
+    try {
+      fn();
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  };
+  HelperGroup group;
+  group.run = &run;
+  group.running = n_helpers;
+  for (size_t i = 0; i < n_helpers; ++i) {
+    run_on_thread(&HelperGroup::run_helper, &group);
+  }
+  run();
+  {
+    std::unique_lock<std::mutex> lock(group.mutex);
+    group.done.wait(lock, [&]() { return group.running == 0; });
+  }
+  release(n_helpers);
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// A library loaded again by another interpreter ends up with the same
+// relocated words as the first time, except for those pointing into images
+// that differ between the interpreters: the library itself, the copy of this
+// loader and the libraries on its search path. So the first load records each
+// relocated word relative to the image it was resolved against (or as is,
+// when that was none of them) and later loads of the same file replay that
+// list instead of resolving any symbols.
+struct LoadedImage {
+  Elf64_Addr base = 0; // load bias
+  Elf64_Addr begin = 0;
+  Elf64_Addr end = 0;
+  size_t tls_module_id = 0;
+  // build-id, or the layout of the segments if there is none
+  std::string signature;
+};
+
+enum class PatchKind : uint32_t {
+  Absolute, // value as is
+  Address, // value + base of the image
+  ModuleId, // TLS module id of the image
+};
+
+struct RelocationPatch {
+  Elf64_Addr offset; // of the relocated word, from the load bias
+  Elf64_Addr value;
+  PatchKind kind;
+  uint32_t image;
+};
+
+struct RelocationTemplate {
+  std::vector<std::string> image_signatures;
+  // absolute values may point into libraries that were unloaded since
+  unsigned long long subs = 0;
+  std::vector<RelocationPatch> patches;
+};
+
+// The templates are kept by the host, which also creates the shared_ptrs
+// owning them so that they outlive the interpreter that recorded them.
+struct RelocationTemplates {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<const RelocationTemplate>>
+      templates;
+};
+
+static RelocationTemplates& relocation_templates() {
+  static auto* templates = new RelocationTemplates();
+  return *templates;
+}
+
+extern "C" {
+__attribute__((visibility("default"))) void deploy_find_relocation_template(
+    const std::string* key,
+    std::shared_ptr<const RelocationTemplate>* result) {
+  RelocationTemplates& templates = relocation_templates();
+  std::lock_guard<std::mutex> guard(templates.mutex);
+  auto it = templates.templates.find(*key);
+  *result = it == templates.templates.end() ? nullptr : it->second;
+}
+
+// takes ownership of `relocation_template`
+__attribute__((visibility("default"))) void deploy_store_relocation_template(
+    const std::string* key,
+    RelocationTemplate* relocation_template) {
+  std::shared_ptr<const RelocationTemplate> owned(relocation_template);
+  RelocationTemplates& templates = relocation_templates();
+  std::lock_guard<std::mutex> guard(templates.mutex);
+  templates.templates[*key] = std::move(owned);
+}
+}
+
+static std::shared_ptr<const RelocationTemplate> find_relocation_template(
+    const std::string& key) {
+  static auto fn = host_function(
+      "deploy_find_relocation_template", &deploy_find_relocation_template);
+  std::shared_ptr<const RelocationTemplate> result;
+  fn(&key, &result);
+  return result;
+}
+
+static void store_relocation_template(
+    const std::string& key,
+    std::unique_ptr<RelocationTemplate> relocation_template) {
+  static auto fn = host_function(
+      "deploy_store_relocation_template", &deploy_store_relocation_template);
+  fn(&key, relocation_template.release());
+}
+
+static std::string image_signature(
+    const Elf64_Phdr* phdrs,
+    size_t n_phdrs,
+    Elf64_Addr base) {
+  std::string layout;
+  for (const auto i : c10::irange(n_phdrs)) {
+    const Elf64_Phdr& phdr = phdrs[i];
+    if (phdr.p_type == PT_LOAD || phdr.p_type == PT_DYNAMIC) {
+      layout += fmt::format(
+          "{}:{:x}:{:x}:{:x};",
+          phdr.p_type,
+          phdr.p_vaddr,
+          phdr.p_filesz,
+          phdr.p_memsz);
+    }
+    if (phdr.p_type != PT_NOTE) {
+      continue;
+    }
+    size_t align = phdr.p_align == 8 ? 8 : 4;
+    auto padded = [&](size_t n) { return (n + align - 1) & ~(align - 1); };
+    const char* note = reinterpret_cast<const char*>(base + phdr.p_vaddr);
+    const char* notes_end = note + phdr.p_filesz;
+    while (note + sizeof(Elf64_Nhdr) <= notes_end) {
+      auto nhdr = reinterpret_cast<const Elf64_Nhdr*>(note);
+      const char* note_name = note + sizeof(Elf64_Nhdr);
+      const char* desc = note_name + padded(nhdr->n_namesz);
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(note_name, "GNU", 4) == 0) {
+        return "build-id:" + std::string(desc, nhdr->n_descsz);
+      }
+      note = desc + padded(nhdr->n_descsz);
+    }
+  }
+  return layout;
+}
+
+static std::optional<LoadedImage> image_of(const struct link_map* map) {
+  struct Search {
+    const struct link_map* map;
+    std::optional<LoadedImage> image;
+  } search{map, std::nullopt};
+  dl_iterate_phdr(
+      [](struct dl_phdr_info* info, size_t, void* data) {
+        auto search = static_cast<Search*>(data);
+        const char* name = search->map->l_name ? search->map->l_name : "";
+        if (info->dlpi_addr != search->map->l_addr ||
+            strcmp(info->dlpi_name ? info->dlpi_name : "", name) != 0) {
+          return 0;
+        }
+        LoadedImage image;
+        image.base = info->dlpi_addr;
+        image.begin = std::numeric_limits<Elf64_Addr>::max();
+        for (const auto i : c10::irange(info->dlpi_phnum)) {
+          const Elf64_Phdr& phdr = info->dlpi_phdr[i];
+          if (phdr.p_type == PT_LOAD) {
+            Elf64_Addr start = info->dlpi_addr + phdr.p_vaddr;
+            image.begin = std::min(image.begin, start);
+            image.end = std::max(image.end, start + phdr.p_memsz);
+          }
+        }
+        image.tls_module_id = info->dlpi_tls_modid;
+        image.signature = image_signature(
+            info->dlpi_phdr, info->dlpi_phnum, info->dlpi_addr);
+        search->image = std::move(image);
+        return 1;
+      },
+      &search);
+  return search.image;
+}
+
+// the image of the loader copy this code is part of
+static const std::optional<LoadedImage>& loader_image() {
+  static const std::optional<LoadedImage> image =
+      []() -> std::optional<LoadedImage> {
+    Dl_info info;
+    struct link_map* map = nullptr;
+    if (!dladdr1(
+            reinterpret_cast<void*>(&image_of),
+            &info,
+            reinterpret_cast<void**>(&map),
+            RTLD_DL_LINKMAP) ||
+        !map) {
+      return std::nullopt;
+    }
+    return image_of(map);
+  }();
+  return image;
+}
+
 // RAII wrapper around dlopen
 struct __attribute__((visibility("hidden"))) SystemLibraryImpl
     : public SystemLibrary {
@@ -316,15 +1334,31 @@ struct __attribute__((visibility("hidden"))) SystemLibraryImpl
 
   std::optional<Elf64_Addr> sym(const char* name, const char* version = nullptr)
       const override {
-    void* r = version ? dlvsym(handle_, name, version) : dlsym(handle_, name);
-    if (!r) {
-      return std::nullopt;
-    }
-    return (Elf64_Addr)r;
+    return cached_dlsym(handle_, name, version, GnuHash(name));
+  }
+
+  std::optional<Elf64_Addr> hashed_sym(
+      const char* name,
+      const char* version,
+      const GnuHash& hash) const override {
+    return cached_dlsym(handle_, name, version, hash);
   }
 
   std::optional<TLSIndex> tls_sym(const char* name) const override;
 
+  std::optional<LoadedImage> image() const {
+    if (handle_ == RTLD_DEFAULT) {
+      LoadedImage image;
+      image.signature = "default";
+      return image;
+    }
+    struct link_map* map = nullptr;
+    if (dlinfo(handle_, RTLD_DI_LINKMAP, &map) != 0 || !map) {
+      return std::nullopt;
+    }
+    return image_of(map);
+  }
+
   ~SystemLibraryImpl() override {
     if (own_handle_) {
       dlclose(handle_);
@@ -406,6 +1440,23 @@ std::pair<const char*, std::vector<const char*>> load_needed_from_elf_file(
   return std::make_pair(runpath, std::move(needed));
 }
 
+// Calls the resolver of an ifunc, which returns the implementation to use,
+// with the same arguments as glibc does.
+static Elf64_Addr call_ifunc_resolver(Elf64_Addr resolver) {
+#ifdef __aarch64__
+  struct {
+    unsigned long size;
+    unsigned long hwcap;
+    unsigned long hwcap2;
+  } arg = {sizeof(arg), getauxval(AT_HWCAP), getauxval(AT_HWCAP2)};
+  constexpr uint64_t kIfuncArgHwcap = 1ULL << 62;
+  return reinterpret_cast<Elf64_Addr (*)(uint64_t, const void*)>(resolver)(
+      arg.hwcap | kIfuncArgHwcap, &arg);
+#else
+  return reinterpret_cast<Elf64_Addr (*)()>(resolver)();
+#endif
+}
+
 // common mechanism for reading the elf symbol table,
 // and other information in the PT_DYNAMIC segment.
 struct ElfDynamicInfo {
@@ -419,6 +1470,10 @@ struct ElfDynamicInfo {
   size_t n_plt_rela_ = 0;
   Elf64_Rela* rela_ = nullptr;
   size_t n_rela_ = 0;
+  const Elf64_Addr* relr_ = nullptr;
+  size_t n_relr_ = 0;
+  Elf64_Addr* plt_got_ = nullptr;
+  bool bind_now_ = false;
   Elf64_Versym* versym_ = nullptr;
   Elf64_Verneed* verneed_ = nullptr;
   size_t n_verneed_ = 0;
@@ -479,6 +1534,25 @@ struct ElfDynamicInfo {
         case DT_RELASZ:
           n_rela_ = value / sizeof(Elf64_Rela);
           break;
+        case DT_RELR:
+          relr_ = (const Elf64_Addr*)addr;
+          break;
+        case DT_RELRSZ:
+          n_relr_ = value / sizeof(Elf64_Addr);
+          break;
+        case DT_PLTGOT:
+          plt_got_ = (Elf64_Addr*)addr;
+          break;
+
+        case DT_BIND_NOW:
+          bind_now_ = true;
+          break;
+        case DT_FLAGS:
+          bind_now_ |= (value & DF_BIND_NOW) != 0;
+          break;
+        case DT_FLAGS_1:
+          bind_now_ |= (value & DF_1_NOW) != 0;
+          break;
 
         case DT_VERSYM:
           versym_ = (Elf64_Versym*)addr;
@@ -562,9 +1636,12 @@ struct ElfDynamicInfo {
     }
   }
 
+  // Symbols which are ifuncs are resolved by calling their resolver, unless
+  // `is_ifunc` is given, in which case it is set and the resolver returned.
   std::optional<Elf64_Addr> sym(
       const char* name,
-      GnuHash* precomputed_hash = nullptr) const {
+      const GnuHash* precomputed_hash = nullptr,
+      bool* is_ifunc = nullptr) const {
     if (!gnu_bucket_) {
       return std::nullopt; // no hashtable was loaded
     }
@@ -598,6 +1675,14 @@ struct ElfDynamicInfo {
             memcmp(strtab_ + sym->st_name, name, name_len + 1) == 0) {
           // found the matching entry, is it defined?
           if (sym->st_shndx != 0) {
+            if (ELF64_ST_TYPE(sym->st_info) == STT_GNU_IFUNC) {
+              Elf64_Addr resolver = sym->st_value + load_bias_;
+              if (is_ifunc) {
+                *is_ifunc = true;
+                return resolver;
+              }
+              return call_ifunc_resolver(resolver);
+            }
             return sym->st_value +
                 ((ELF64_ST_TYPE(sym->st_info) == STT_TLS) ? 0 : load_bias_);
           }
@@ -711,6 +1796,136 @@ std::optional<TLSIndex> SystemLibraryImpl::tls_sym(const char* name) const {
 // So we need to pre-find all the libraries and call dlopen on them directly to
 // get the same behavior. We can find the dependencies by reading the libraries
 // dynamic section for recursive DT_NEEED entries.
+// Every interpreter resolves the DT_NEEDED entries of the extensions it
+// loads the same way, so like the symbols above the results are cached in
+// the host. Files are parsed again only if they changed. A file found in the
+// search path is used again as long as it did not change, and libraries that
+// were not found are looked for again next time, since they may have been
+// installed since. A library installed in a directory earlier in the search
+// path than the file found before is not noticed though. The directories a
+// DT_RUNPATH expands to are assumed to stay valid for the lifetime of the
+// process.
+struct NeededFile {
+  std::string path; // empty if it was not found in the search path
+  std::string runpath;
+  std::vector<std::string> needed;
+  // (device, inode, mtime) of the file when it was read, empty if it could
+  // not be stat'ed
+  std::string file_key;
+};
+
+struct DependencyCache {
+  std::mutex mutex;
+  // (library, DT_RUNPATH) -> the directories it adds to the search path
+  std::unordered_map<std::string, std::vector<std::string>> runpaths;
+  // (DT_NEEDED entry, search path) -> the file it resolves to
+  std::unordered_map<std::string, NeededFile> libraries;
+  // (device, inode, mtime) -> DT_RUNPATH and DT_NEEDED of the file
+  std::unordered_map<std::string, NeededFile> files;
+  // lookups in `libraries`
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+};
+
+extern "C" __attribute__((visibility("default"))) void*
+deploy_dependency_cache() {
+  static auto* cache = new DependencyCache();
+  return cache;
+}
+
+static DependencyCache& dependency_cache() {
+  static auto* cache = static_cast<DependencyCache*>(
+      host_function("deploy_dependency_cache", &deploy_dependency_cache)());
+  return *cache;
+}
+
+template <typename T>
+static std::optional<T> find_dependency(
+    std::unordered_map<std::string, T> DependencyCache::*map,
+    const std::string& key) {
+  DependencyCache& cache = dependency_cache();
+  std::lock_guard<std::mutex> guard(cache.mutex);
+  auto it = (cache.*map).find(key);
+  if (it == (cache.*map).end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+template <typename T>
+static void store_dependency(
+    std::unordered_map<std::string, T> DependencyCache::*map,
+    const std::string& key,
+    const T& value) {
+  DependencyCache& cache = dependency_cache();
+  std::lock_guard<std::mutex> guard(cache.mutex);
+  (cache.*map)[key] = value;
+}
+
+extern "C" __attribute__((visibility("default"))) void
+deploy_dependency_cache_stats(DependencyCacheStats* stats) {
+  DependencyCache& cache = dependency_cache();
+  stats->hits = cache.hits.load(std::memory_order_relaxed);
+  stats->misses = cache.misses.load(std::memory_order_relaxed);
+}
+
+DependencyCacheStats dependency_cache_stats() {
+  static auto fn = host_function(
+      "deploy_dependency_cache_stats", &deploy_dependency_cache_stats);
+  DependencyCacheStats stats{};
+  fn(&stats);
+  return stats;
+}
+
+// identifies the contents of the file at `path`, empty if it does not exist
+static std::string file_key_of(const std::string& path) {
+  struct stat s {};
+  if (stat(path.c_str(), &s) != 0) {
+    return std::string();
+  }
+  return fmt::format(
+      "{}:{}:{}.{}", s.st_dev, s.st_ino, s.st_mtim.tv_sec, s.st_mtim.tv_nsec);
+}
+
+// finds the file of a DT_NEEDED entry in the search path and reads what it
+// needs in turn
+static NeededFile find_needed_file(
+    const char* name,
+    const std::vector<std::string>& search_path) {
+  NeededFile file;
+  if (strchr(name, '/') != nullptr) {
+    file.path = name;
+  } else {
+    for (size_t i = search_path.size(); i > 0; --i) {
+      std::string path = search_path[i - 1] + "/" + name;
+      if (access(path.c_str(), F_OK) == 0) {
+        file.path = std::move(path);
+        break;
+      }
+    }
+  }
+  if (file.path.empty()) {
+    return file;
+  }
+
+  file.file_key = file_key_of(file.path);
+  if (!file.file_key.empty()) {
+    auto parsed = find_dependency(&DependencyCache::files, file.file_key);
+    if (parsed) {
+      parsed->path = file.path;
+      return *parsed;
+    }
+  }
+  MemFile image(file.path.c_str());
+  auto search = load_needed_from_elf_file(file.path.c_str(), image.data());
+  file.runpath = search.first;
+  file.needed.assign(search.second.begin(), search.second.end());
+  if (!file.file_key.empty()) {
+    store_dependency(&DependencyCache::files, file.file_key, file);
+  }
+  return file;
+}
+
 void resolve_needed_libraries(
     std::vector<std::shared_ptr<SymbolProvider>>& libraries,
     const std::string& origin_relative,
@@ -719,12 +1934,20 @@ void resolve_needed_libraries(
     const std::vector<const char*>& needed) {
   size_t search_path_start_size = search_path.size();
 
-  std::string origin = resolve_origin(origin_relative);
-  std::vector<std::string> paths = split_path(runpath_template, ':');
-  // backwards because we want paths to be search in order but we search
-  // search_path backward
-  for (size_t i = paths.size(); i > 0; --i) {
-    search_path.emplace_back(resolve_path(origin, paths[i - 1]));
+  if (!runpath_template.empty()) {
+    std::string runpath_key = origin_relative + '\0' + runpath_template;
+    auto paths = find_dependency(&DependencyCache::runpaths, runpath_key);
+    if (!paths) {
+      std::string origin = resolve_origin(origin_relative);
+      paths.emplace();
+      for (const auto& path : split_path(runpath_template, ':')) {
+        paths->emplace_back(resolve_path(origin, path));
+      }
+      store_dependency(&DependencyCache::runpaths, runpath_key, *paths);
+    }
+    // backwards because we want paths to be search in order but we search
+    // search_path backward
+    search_path.insert(search_path.end(), paths->rbegin(), paths->rend());
   }
 
   for (const char* name : needed) {
@@ -747,19 +1970,24 @@ void resolve_needed_libraries(
       continue;
     }
 
-    std::string library_path;
-    // (2) it is an absolute path
-    if (strchr(name, '/') != nullptr) {
-      library_path = name;
+    // (2) and (3), looked up once per search path
+    std::string library_key = name;
+    for (const auto& path : search_path) {
+      library_key += '\0';
+      library_key += path;
+    }
+    auto file = find_dependency(&DependencyCache::libraries, library_key);
+    if (file && file_key_of(file->path) != file->file_key) {
+      file.reset(); // it changed or is gone since
+    }
+    DependencyCache& cache = dependency_cache();
+    if (file) {
+      cache.hits.fetch_add(1, std::memory_order_relaxed);
     } else {
-      // (3) find it in the search path
-      for (size_t i = search_path.size(); i > 0; --i) {
-        std::stringstream ss;
-        ss << search_path[i - 1] << "/" << name;
-        if (access(ss.str().c_str(), F_OK) == 0) {
-          library_path = ss.str();
-          break;
-        }
+      cache.misses.fetch_add(1, std::memory_order_relaxed);
+      file = find_needed_file(name, search_path);
+      if (!file->file_key.empty()) {
+        store_dependency(&DependencyCache::libraries, library_key, *file);
       }
     }
 
@@ -767,17 +1995,17 @@ void resolve_needed_libraries(
         sublibraries; // these need to say loaded until we open library_path
                       // otherwise we might dlclose a sublibrary
 
-    if (library_path != "") {
-      // std::cout << "LOOKING FOR SUBLIBRARIES FOR FILE AT PATH " <<
-      // library_path << "\n"; we found the actual file, recursively load its
-      // deps before opening it so we resolve their paths correctly
-      MemFile image(library_path.c_str());
-      auto search =
-          load_needed_from_elf_file(library_path.c_str(), image.data());
+    std::string library_path = name;
+    if (!file->path.empty()) {
+      // we found the actual file, recursively load its deps before opening
+      // it so we resolve their paths correctly
+      library_path = file->path;
+      std::vector<const char*> file_needed;
+      for (const auto& entry : file->needed) {
+        file_needed.push_back(entry.c_str());
+      }
       resolve_needed_libraries(
-          sublibraries, library_path, search_path, search.first, search.second);
-    } else {
-      library_path = name;
+          sublibraries, library_path, search_path, file->runpath, file_needed);
     }
 
     // either we didn't find the file, or we have already loaded its deps
@@ -798,19 +2026,30 @@ void resolve_needed_libraries(
       search_path.begin() + search_path_start_size, search_path.end());
 }
 
-// NOLINTNEXTLINE
-extern "C" void* __dso_handle;
-
 struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     : public std::enable_shared_from_this<CustomLibraryImpl>,
       public CustomLibrary {
-  CustomLibraryImpl(const char* filename, int argc, const char** argv)
-      : contents_(filename),
+  CustomLibraryImpl(
+      const char* filename,
+      size_t offset,
+      size_t size,
+      int argc,
+      const char** argv)
+      : contents_(filename, offset, size),
         mapped_library_(nullptr),
         name_(filename),
         argc_(argc),
         argv_(argv) {
-    pthread_key_create(&tls_key_, nullptr);
+    static auto lazy_default = host_function(
+        "deploy_lazy_binding_default", &deploy_lazy_binding_default);
+    lazy_binding_ = lazy_default();
+    static auto huge_page_text_default = host_function(
+        "deploy_huge_page_text_default", &deploy_huge_page_text_default);
+    huge_page_text_ = huge_page_text_default();
+    static auto prefetch_policy =
+        host_function("deploy_prefetch_policy", &deploy_prefetch_policy);
+    prefetch_policy_ = prefetch_policy();
+    tls_module_ = register_tls_module();
     data_ = contents_.data();
     header_ = (Elf64_Ehdr*)data_;
     program_headers_ = (Elf64_Phdr*)(data_ + header_->e_phoff);
@@ -820,6 +2059,18 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     symbol_search_path_.emplace_back(std::move(lib));
   }
 
+  void set_lazy_binding(bool lazy) override {
+    lazy_binding_ = lazy;
+  }
+
+  void set_huge_page_text(bool huge_pages) override {
+    huge_page_text_ = huge_pages;
+  }
+
+  void set_prefetch_policy(PrefetchPolicy policy) override {
+    prefetch_policy_ = policy;
+  }
+
   void check_library_format() {
     DEPLOY_CHECK(
         0 == memcmp(header_->e_ident, ELFMAG, SELFMAG),
@@ -848,13 +2099,80 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     Elf64_Addr max_vaddr = 0;
     mapped_size_ = phdr_table_get_load_size(
         program_headers_, n_program_headers_, &min_vaddr, &max_vaddr);
-    mapped_library_ = mmap(
-        nullptr, mapped_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!huge_page_text_) {
+      mapped_library_ = mmap(
+          nullptr, mapped_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+      // place the first executable segment on a huge page boundary, so that
+      // as much of the code as possible can be put on huge pages
+      Elf64_Addr text_offset = 0;
+      for (const auto i : c10::irange(n_program_headers_)) {
+        const Elf64_Phdr& phdr = program_headers_[i];
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) != 0) {
+          text_offset = get_page_start(phdr.p_vaddr) - min_vaddr;
+          break;
+        }
+      }
+      size_t reserved_size = mapped_size_ + kHugePageSize;
+      char* reserved = static_cast<char*>(mmap(
+          nullptr,
+          reserved_size,
+          PROT_NONE,
+          MAP_PRIVATE | MAP_ANONYMOUS,
+          -1,
+          0));
+      DEPLOY_CHECK(
+          reserved != MAP_FAILED,
+          "{}: could not reserve address space: {}",
+          name_,
+          strerror(errno));
+      Elf64_Addr text = reinterpret_cast<Elf64_Addr>(reserved) + text_offset;
+      char* start =
+          reserved + (kHugePageSize - text % kHugePageSize) % kHugePageSize;
+      char* end = start + mapped_size_;
+      if (start != reserved) {
+        munmap(reserved, start - reserved);
+      }
+      if (end != reserved + reserved_size) {
+        munmap(end, reserved + reserved_size - end);
+      }
+      mapped_library_ = start;
+    }
     load_bias_ =
         (const char*)mapped_library_ - reinterpret_cast<const char*>(min_vaddr);
   }
 
+  // copies the `length` bytes of the file at `file_offset` to anonymous memory
+  // at `addr` that the kernel may back with transparent huge pages, where a
+  // mapping of the file would only get regular pages
+  void* copy_to_huge_pages(
+      Elf64_Addr addr,
+      Elf64_Addr length,
+      Elf64_Addr file_offset) {
+    void* mem = mmap64(
+        reinterpret_cast<void*>(addr),
+        length,
+        PROT_READ | PROT_WRITE,
+        MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0);
+    if (mem == MAP_FAILED) {
+      return mem;
+    }
+    // best effort, the pages just stay small if THP is disabled
+    madvise(mem, length, MADV_HUGEPAGE);
+    memcpy(mem, data_ + file_offset, length);
+#ifdef MADV_COLLAPSE
+    // in case huge pages could not be allocated when the copy faulted them in
+    madvise(mem, length, MADV_COLLAPSE);
+#endif
+    return mem;
+  }
+
   void load_segments() {
+    if (prefetch_policy_ == PrefetchPolicy::WillNeed) {
+      contents_.prefetch();
+    }
     // from bionic
     for (const auto i : c10::irange(n_program_headers_)) {
       const Elf64_Phdr* phdr = &program_headers_[i];
@@ -877,9 +2195,14 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
                               eh_frame_hdr_->eh_frame_ptr);
           break;
         case PT_TLS:
-          tls_file_size_ = phdr->p_filesz;
-          tls_mem_size_ = phdr->p_memsz;
-          tls_initalization_image_ = (void*)seg_start;
+          stats_.tls_size = phdr->p_memsz;
+          set_tls_module(
+              tls_module_,
+              TLSModule{
+                  (const void*)seg_start,
+                  phdr->p_filesz,
+                  phdr->p_memsz,
+                  std::max<size_t>(phdr->p_align, 1)});
           break;
       };
 
@@ -920,14 +2243,19 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
       if (file_length != 0) {
         int prot = PFLAGS_TO_PROT(phdr->p_flags);
 
-        void* seg_addr = mmap64(
-            reinterpret_cast<void*>(seg_page_start),
-            file_length,
-            prot | PROT_WRITE, // initially everything is writable to do
-                               // relocations
-            MAP_FIXED | MAP_PRIVATE,
-            contents_.fd(),
-            file_page_start);
+        void* seg_addr = huge_page_text_ && (phdr->p_flags & PF_X) != 0
+            ? copy_to_huge_pages(seg_page_start, file_length, file_page_start)
+            : mmap64(
+                  reinterpret_cast<void*>(seg_page_start),
+                  file_length,
+                  prot | PROT_WRITE, // initially everything is writable to do
+                                     // relocations
+                  MAP_FIXED | MAP_PRIVATE |
+                      (prefetch_policy_ == PrefetchPolicy::Populate
+                           ? MAP_POPULATE
+                           : 0),
+                  contents_.fd(),
+                  contents_.offset() + file_page_start);
         fixup_prot_.emplace_back([=]() {
           mprotect(reinterpret_cast<void*>(seg_page_start), file_length, prot);
         });
@@ -978,8 +2306,7 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     }
   }
   size_t module_id() const {
-    size_t this_as_number = (size_t)this;
-    return this_as_number | TLS_LOCAL_FLAG;
+    return tls_module_ | TLS_LOCAL_FLAG;
   }
 
   void read_dynamic_section() {
@@ -994,7 +2321,15 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
         dyninfo_.needed_);
   }
 
-  std::optional<Elf64_Addr> lookup_symbol(Elf64_Xword r_info) {
+  // When `is_ifunc` is given, ifuncs of this library are not resolved but
+  // their resolver is returned and `is_ifunc` set, since the library might
+  // not be ready to run its resolvers yet. When `image` is given, it is set
+  // to the index in template_images() of the image defining the symbol, if
+  // that is known for sure.
+  std::optional<Elf64_Addr> lookup_symbol(
+      Elf64_Xword r_info,
+      bool* is_ifunc = nullptr,
+      int32_t* image = nullptr) {
     const uint32_t r_type = ELF64_R_TYPE(r_info);
     const uint32_t r_sym = ELF64_R_SYM(r_info);
 
@@ -1011,6 +2346,9 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
         return (Elf64_Addr)__cxxabiv1::__cxa_thread_atexit;
       }
     }
+    if (auto r = replaced_pthread_function(sym_name)) {
+      return r;
+    }
 
     // Get the version string if required by the symbol.
     // https://refspecs.linuxfoundation.org/LSB_3.0.0/LSB-PDA/LSB-PDA.junk/symversion.html
@@ -1037,13 +2375,25 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     }
 
     // search in this binary first -- equivalent to RTLD_DEEPBIND behavior
-    auto r = sym(sym_name, version);
+    GnuHash hash(sym_name);
+    auto r = dyninfo_.sym(sym_name, &hash, is_ifunc);
     if (r) {
+      local_hits_.fetch_add(1, std::memory_order_relaxed);
+      if (image) {
+        *image = 0;
+      }
       return r;
     }
-    for (const auto& sys_lib : symbol_search_path_) {
-      auto r = sys_lib->sym(sym_name, version);
+    for (const auto i : c10::irange(symbol_search_path_.size())) {
+      const auto& sys_lib = symbol_search_path_[i];
+      auto r = sys_lib->hashed_sym(sym_name, version, hash);
       if (r) {
+        search_path_hits_.fetch_add(1, std::memory_order_relaxed);
+        // unlike dlsym, which also searches the dependencies of a system
+        // library, our libraries only return their own symbols
+        if (image && dynamic_cast<const CustomLibraryImpl*>(sys_lib.get())) {
+          *image = static_cast<int32_t>(i + 2);
+        }
         return r;
       }
     }
@@ -1058,6 +2408,7 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
           version,
           versym);
     }
+    weak_misses_.fetch_add(1, std::memory_order_relaxed);
     return std::nullopt;
   }
 
@@ -1075,11 +2426,13 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     for (const auto& sys_lib : symbol_search_path_) {
       auto r = sys_lib->tls_sym(sym_name);
       if (r) {
+        search_path_hits_.fetch_add(1, std::memory_order_relaxed);
         return r;
       }
     }
     auto r = tls_sym(sym_name);
     if (r) {
+      local_hits_.fetch_add(1, std::memory_order_relaxed);
       return r;
     }
 
@@ -1089,10 +2442,22 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
           name_.c_str(),
           sym_name);
     }
+    weak_misses_.fetch_add(1, std::memory_order_relaxed);
     return std::nullopt;
   }
 
-  void relocate_one(const Elf64_Rela& reloc) {
+  // the position of `reloc` in dyninfo_.rela_ followed by dyninfo_.plt_rela_
+  size_t relocation_index(const Elf64_Rela& reloc) const {
+    const Elf64_Rela* rela = dyninfo_.rela_;
+    if (&reloc >= rela && &reloc < rela + dyninfo_.n_rela_) {
+      return &reloc - rela;
+    }
+    return dyninfo_.n_rela_ + (&reloc - dyninfo_.plt_rela_);
+  }
+
+  // Relocations which need to call an ifunc resolver are left for later when
+  // `defer_ifuncs` is set, resolvers may depend on any other relocation.
+  void relocate_one(const Elf64_Rela& reloc, bool defer_ifuncs = true) {
     const uint32_t r_type = ELF64_R_TYPE(reloc.r_info);
 
     if (r_type == 0) {
@@ -1102,6 +2467,31 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     void* const rel_target =
         reinterpret_cast<void*>(reloc.r_offset + load_bias_);
 
+    if (r_type == R_X86_64_IRELATIVE || r_type == R_AARCH64_IRELATIVE) {
+      if (defer_ifuncs) {
+        defer_ifunc_relocation(reloc);
+        return;
+      }
+      *static_cast<Elf64_Addr*>(rel_target) =
+          call_ifunc_resolver(load_bias_ + reloc.r_addend);
+      return;
+    }
+
+    // which image the value is resolved against, for the template
+    int32_t* image = nullptr;
+    if (!relocation_images_.empty()) {
+      image = &relocation_images_[relocation_index(reloc)];
+    }
+
+    if (r_type == R_X86_64_JUMP_SLOT && binds_lazily()) {
+      // the entry points back into its PLT stub, which calls the trampoline
+      *static_cast<Elf64_Addr*>(rel_target) += load_bias_;
+      if (image) {
+        *image = 0;
+      }
+      return;
+    }
+
     // TLS relocations need to lookup symbols differently so we can get the
     // module_id
     if (r_type == R_X86_64_DTPMOD64 || r_type == R_X86_64_DTPOFF64) {
@@ -1121,10 +2511,22 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
       return;
     }
 
-    auto sym_addr = lookup_symbol(reloc.r_info);
+    bool is_ifunc = false;
+    // the result of an ifunc can point anywhere
+    auto sym_addr = lookup_symbol(
+        reloc.r_info,
+        defer_ifuncs ? &is_ifunc : nullptr,
+        defer_ifuncs ? image : nullptr);
     if (!sym_addr) {
       return; // skip weak relocation that wasn't found
     }
+    if (is_ifunc) {
+      if (image) {
+        *image = kUnknownImage;
+      }
+      defer_ifunc_relocation(reloc);
+      return;
+    }
 
     switch (r_type) {
       case R_AARCH64_GLOB_DAT:
@@ -1144,6 +2546,9 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
         // isn't found), even though it isn't used.
         const Elf64_Addr result = load_bias_ + reloc.r_addend;
         *static_cast<Elf64_Addr*>(rel_target) = result;
+        if (image) {
+          *image = 0;
+        }
       } break;
       case R_X86_64_32: {
         const Elf32_Addr result = *sym_addr + reloc.r_addend;
@@ -1171,13 +2576,308 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     }
   }
 
+  bool binds_lazily() const {
+#ifdef __x86_64__
+    return lazy_binding_ && !dyninfo_.bind_now_ && dyninfo_.plt_got_ &&
+        header_->e_machine == EM_X86_64;
+#else
+    return false;
+#endif
+  }
+
+  // binds the PLT entry of dyninfo_.plt_rela_[index] on its first call
+  Elf64_Addr bind_lazily(size_t index) {
+    const Elf64_Rela& reloc = dyninfo_.plt_rela_[index];
+    auto sym_addr = lookup_symbol(reloc.r_info);
+    if (!sym_addr) {
+      auto sym_st = dyninfo_.symtab_[ELF64_R_SYM(reloc.r_info)];
+      DEPLOY_ERROR(
+          "{}: called weak symbol '{}' which is not defined",
+          name_.c_str(),
+          dyninfo_.get_string(sym_st.st_name));
+    }
+    Elf64_Addr result = *sym_addr + reloc.r_addend;
+    __atomic_store_n(
+        reinterpret_cast<Elf64_Addr*>(reloc.r_offset + load_bias_),
+        result,
+        __ATOMIC_RELAXED);
+    return result;
+  }
+
+  // DT_RELR packs relative relocations as a list of addresses, each followed
+  // by bitmaps of which of the next words need to be relocated as well
+  // calls fn(where) for each word DT_RELR relocates
+  template <typename F>
+  void for_each_relr_word(F fn) const {
+    Elf64_Addr* where = nullptr;
+    for (const auto i : c10::irange(dyninfo_.n_relr_)) {
+      Elf64_Addr entry = dyninfo_.relr_[i];
+      if ((entry & 1) == 0) {
+        where = reinterpret_cast<Elf64_Addr*>(entry + load_bias_);
+        fn(where++);
+        continue;
+      }
+      DEPLOY_CHECK(where, "{}: DT_RELR starts with a bitmap", name_.c_str());
+      // bit 0 marks the bitmap, bit n the n-1th word after `where`
+      for (size_t bit = 1; entry >>= 1; ++bit) {
+        if (entry & 1) {
+          fn(where + bit - 1);
+        }
+      }
+      where += 8 * sizeof(Elf64_Addr) - 1;
+    }
+  }
+
+  void relocate_relr() {
+    for_each_relr_word([&](Elf64_Addr* where) { *where += load_bias_; });
+  }
+
+  void defer_ifunc_relocation(const Elf64_Rela& reloc) {
+    std::lock_guard<std::mutex> guard(deferred_ifunc_mutex_);
+    deferred_ifunc_relocations_.push_back(&reloc);
+  }
+
+  void prepare_lazy_binding() {
+#ifdef __x86_64__
+    if (binds_lazily()) {
+      static bool xsave = init_lazy_bind_save_area();
+      (void)xsave;
+      dyninfo_.plt_got_[1] = reinterpret_cast<Elf64_Addr>(this);
+      dyninfo_.plt_got_[2] =
+          reinterpret_cast<Elf64_Addr>(&deploy_lazy_bind_trampoline);
+    }
+#endif
+  }
+
   void relocate() {
-    for (const auto i : c10::irange(dyninfo_.n_rela_)) {
-      relocate_one(dyninfo_.rela_[i]);
+    relocate_relr();
+    prepare_lazy_binding();
+    // every relocation writes to its own address, so they can be applied in
+    // any order and from several threads
+    constexpr size_t kRelocationsPerChunk = 4096;
+    DlGeneration generation = current_dl_generation();
+    size_t n_relocations = dyninfo_.n_rela_ + dyninfo_.n_plt_rela_;
+    size_t n_chunks =
+        (n_relocations + kRelocationsPerChunk - 1) / kRelocationsPerChunk;
+    std::atomic<size_t> next_chunk{0};
+    auto relocate_chunks = [&]() {
+      RelocationGenerationGuard guard(generation);
+      for (size_t chunk = next_chunk++; chunk < n_chunks;
+           chunk = next_chunk++) {
+        size_t end =
+            std::min(n_relocations, (chunk + 1) * kRelocationsPerChunk);
+        for (size_t i = chunk * kRelocationsPerChunk; i < end; ++i) {
+          relocate_one(
+              i < dyninfo_.n_rela_ ? dyninfo_.rela_[i]
+                                   : dyninfo_.plt_rela_[i - dyninfo_.n_rela_]);
+        }
+      }
+    };
+    run_with_helpers(n_chunks > 1 ? n_chunks - 1 : 0, relocate_chunks);
+
+    // everything else is relocated now, so the resolvers can run
+    RelocationGenerationGuard guard(generation);
+    for (const Elf64_Rela* reloc : deferred_ifunc_relocations_) {
+      relocate_one(*reloc, /*defer_ifuncs=*/false);
+    }
+    deferred_ifunc_relocations_.clear();
+  }
+
+  LoadedImage own_image() const {
+    LoadedImage image;
+    image.base = load_bias_;
+    image.begin = reinterpret_cast<Elf64_Addr>(mapped_library_);
+    image.end = image.begin + mapped_size_;
+    image.tls_module_id = module_id();
+    image.signature =
+        image_signature(program_headers_, n_program_headers_, load_bias_);
+    return image;
+  }
+
+  // the images relocated words can point into: this library, the loader and
+  // the search path, or nullopt if a provider is not a library we know
+  std::optional<std::vector<LoadedImage>> template_images() const {
+    if (!loader_image()) {
+      return std::nullopt;
+    }
+    std::vector<LoadedImage> images{own_image(), *loader_image()};
+    for (const auto& provider : symbol_search_path_) {
+      std::optional<LoadedImage> image;
+      if (auto custom =
+              dynamic_cast<const CustomLibraryImpl*>(provider.get())) {
+        image = custom->own_image();
+      } else if (
+          auto system =
+              dynamic_cast<const SystemLibraryImpl*>(provider.get())) {
+        image = system->image();
+      }
+      if (!image) {
+        return std::nullopt;
+      }
+      images.emplace_back(std::move(*image));
+    }
+    return images;
+  }
+
+  std::string template_key(const LoadedImage& own) const {
+    return fmt::format(
+        "{}:{}:{}:{}:{}",
+        name_,
+        contents_.offset(),
+        contents_.size(),
+        binds_lazily(),
+        own.signature);
+  }
+
+  // calls fn(where, r_type, image) for each word relocate() writes, where
+  // `image` is what relocation_images_ recorded for it
+  template <typename F>
+  void for_each_relocated_word(F fn) const {
+    uint32_t relative = header_->e_machine == EM_AARCH64 ? R_AARCH64_RELATIVE
+                                                         : R_X86_64_RELATIVE;
+    for_each_relr_word([&](Elf64_Addr* where) { fn(where, relative, 0); });
+    size_t n_relocations = dyninfo_.n_rela_ + dyninfo_.n_plt_rela_;
+    for (const auto i : c10::irange(n_relocations)) {
+      const Elf64_Rela& reloc = i < dyninfo_.n_rela_
+          ? dyninfo_.rela_[i]
+          : dyninfo_.plt_rela_[i - dyninfo_.n_rela_];
+      uint32_t r_type = ELF64_R_TYPE(reloc.r_info);
+      if (r_type != R_X86_64_NONE) {
+        fn(reinterpret_cast<Elf64_Addr*>(reloc.r_offset + load_bias_),
+           r_type,
+           i < relocation_images_.size() ? relocation_images_[i]
+                                         : kUnknownImage);
+      }
+    }
+  }
+
+  // must run right after relocate(), before any code of the library did
+  void record_relocation_template(unsigned long long subs) {
+    auto images = template_images();
+    if (!images) {
+      return;
+    }
+    auto relocation_template = std::make_unique<RelocationTemplate>();
+    relocation_template->subs = subs;
+    for (const auto& image : *images) {
+      relocation_template->image_signatures.push_back(image.signature);
+    }
+    auto& patches = relocation_template->patches;
+    patches.reserve(dyninfo_.n_rela_ + dyninfo_.n_plt_rela_);
+    bool complete = true;
+    size_t page_size = get_page_size();
+    for_each_relocated_word([&](Elf64_Addr* where,
+                                uint32_t r_type,
+                                int32_t resolved_image) {
+      if (r_type == R_X86_64_32 || r_type == R_X86_64_PC32) {
+        // 32 bit words cannot tell which image they point into
+        complete = false;
+        return;
+      }
+      RelocationPatch patch{
+          reinterpret_cast<Elf64_Addr>(where) - load_bias_,
+          *where,
+          PatchKind::Absolute,
+          0};
+      if (r_type == R_X86_64_DTPMOD64 || r_type == R_AARCH64_TLS_DTPMOD) {
+        for (const auto i : c10::irange(images->size())) {
+          const LoadedImage& image = (*images)[i];
+          if (image.tls_module_id && patch.value == image.tls_module_id) {
+            patch = {patch.offset, 0, PatchKind::ModuleId, uint32_t(i)};
+            break;
+          }
+        }
+      } else if (resolved_image != kUnknownImage) {
+        // resolved against this image, wherever the value points, e.g. one
+        // past its end
+        const LoadedImage& image = (*images)[resolved_image];
+        patch = {
+            patch.offset,
+            patch.value - image.base,
+            PatchKind::Address,
+            uint32_t(resolved_image)};
+      } else {
+        // e.g. a symbol dlsym found in a system library or its dependencies,
+        // or the result of an ifunc, so guess from where it points. A value
+        // at or next to the edge of an image, like the end of an array, may
+        // belong to the neighbouring one, so don't record a template then.
+        for (const auto i : c10::irange(images->size())) {
+          const LoadedImage& image = (*images)[i];
+          if (image.begin == image.end) {
+            continue;
+          }
+          if (image.begin <= patch.value && patch.value < image.end &&
+              patch.kind == PatchKind::Absolute) {
+            patch = {
+                patch.offset,
+                patch.value - image.base,
+                PatchKind::Address,
+                uint32_t(i)};
+          }
+          if ((patch.value < image.begin &&
+               image.begin - patch.value <= page_size) ||
+              (patch.value >= image.end &&
+               patch.value - image.end < page_size)) {
+            complete = false;
+          }
+        }
+      }
+      patches.push_back(patch);
+    });
+    if (complete) {
+      store_relocation_template(
+          template_key(images->front()), std::move(relocation_template));
+    }
+  }
+
+  // relocates the library by replaying the template recorded when the same
+  // file was loaded before, returns false if there is no usable one
+  bool relocate_from_template() {
+    auto images = template_images();
+    if (!images) {
+      return false;
     }
-    for (const auto i : c10::irange(dyninfo_.n_plt_rela_)) {
-      relocate_one(dyninfo_.plt_rela_[i]);
+    auto relocation_template =
+        find_relocation_template(template_key(images->front()));
+    if (!relocation_template ||
+        relocation_template->subs != current_dl_generation().subs ||
+        relocation_template->image_signatures.size() != images->size()) {
+      return false;
+    }
+    for (const auto i : c10::irange(images->size())) {
+      if (relocation_template->image_signatures[i] != (*images)[i].signature) {
+        return false;
+      }
     }
+    prepare_lazy_binding();
+    constexpr size_t kPatchesPerChunk = 65536;
+    const auto& patches = relocation_template->patches;
+    size_t n_chunks =
+        (patches.size() + kPatchesPerChunk - 1) / kPatchesPerChunk;
+    std::atomic<size_t> next_chunk{0};
+    auto apply_chunks = [&]() {
+      for (size_t chunk = next_chunk++; chunk < n_chunks;
+           chunk = next_chunk++) {
+        size_t end = std::min(patches.size(), (chunk + 1) * kPatchesPerChunk);
+        for (size_t i = chunk * kPatchesPerChunk; i < end; ++i) {
+          const RelocationPatch& patch = patches[i];
+          Elf64_Addr value = patch.value;
+          switch (patch.kind) {
+            case PatchKind::Absolute:
+              break;
+            case PatchKind::Address:
+              value += (*images)[patch.image].base;
+              break;
+            case PatchKind::ModuleId:
+              value = (*images)[patch.image].tls_module_id;
+              break;
+          }
+          *reinterpret_cast<Elf64_Addr*>(patch.offset + load_bias_) = value;
+        }
+      }
+    };
+    run_with_helpers(n_chunks > 1 ? n_chunks - 1 : 0, apply_chunks);
+    return true;
   }
 
   void initialize() {
@@ -1209,6 +2909,220 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     __deploy_register_code();
   }
 
+  // lists the functions of the library in the perf map, from its full symbol
+  // table if it was not stripped
+  void register_perf_map() {
+    static auto enabled =
+        host_function("deploy_perf_map_enabled", &deploy_perf_map_enabled);
+    static auto write_perf_map =
+        host_function("deploy_write_perf_map", &deploy_write_perf_map);
+    if (!enabled() || header_->e_shoff == 0 ||
+        header_->e_shoff + header_->e_shnum * sizeof(Elf64_Shdr) >
+            contents_.size()) {
+      return;
+    }
+    auto sections =
+        reinterpret_cast<const Elf64_Shdr*>(data_ + header_->e_shoff);
+    const Elf64_Shdr* symtab = nullptr;
+    for (const auto i : c10::irange(header_->e_shnum)) {
+      if (sections[i].sh_type == SHT_SYMTAB ||
+          (sections[i].sh_type == SHT_DYNSYM && !symtab)) {
+        symtab = &sections[i];
+      }
+    }
+    if (!symtab || symtab->sh_link >= header_->e_shnum) {
+      return;
+    }
+    const Elf64_Shdr& strtab = sections[symtab->sh_link];
+    auto in_file = [&](const Elf64_Shdr& section) {
+      return section.sh_offset <= contents_.size() &&
+          section.sh_size <= contents_.size() - section.sh_offset;
+    };
+    if (!in_file(*symtab) || !in_file(strtab)) {
+      return;
+    }
+    auto syms = reinterpret_cast<const Elf64_Sym*>(data_ + symtab->sh_offset);
+    size_t n_syms = symtab->sh_size / sizeof(Elf64_Sym);
+    std::string map;
+    for (const auto i : c10::irange(n_syms)) {
+      const Elf64_Sym& sym = syms[i];
+      if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC ||
+          sym.st_shndx == SHN_UNDEF || sym.st_size == 0 ||
+          sym.st_name >= strtab.sh_size) {
+        continue;
+      }
+      // the name may not be terminated within the string table
+      const char* name = data_ + strtab.sh_offset + sym.st_name;
+      size_t name_size = strnlen(name, strtab.sh_size - sym.st_name);
+      map += fmt::format(
+          "{:x} {:x} {}\n",
+          load_bias_ + sym.st_value,
+          sym.st_size,
+          fmt::string_view(name, name_size));
+    }
+    write_perf_map(map.data(), map.size());
+  }
+
+  // where the pages of this library that were mapped in an earlier run are
+  // listed, empty if there is no page list directory
+  std::string page_list_path() const {
+    static auto page_list_dir =
+        host_function("deploy_page_list_dir", &deploy_page_list_dir);
+    std::string dir;
+    page_list_dir(&dir);
+    if (dir.empty()) {
+      return dir;
+    }
+    // the list is read by other builds of this binary, so the key must not
+    // depend on the standard library like std::hash does
+    std::string signature =
+        image_signature(program_headers_, n_program_headers_, load_bias_);
+    std::string key;
+    if (signature.compare(0, 9, "build-id:") == 0) {
+      for (const auto i : c10::irange(9, signature.size())) {
+        key += fmt::format("{:02x}", static_cast<uint8_t>(signature[i]));
+      }
+    } else {
+      // FNV-1a of the layout of the segments
+      uint64_t hash = 0xcbf29ce484222325;
+      for (char c : signature) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+      }
+      key = fmt::format("layout-{:016x}", hash);
+    }
+    return fmt::format(
+        "{}/{}-{}-{}.pages",
+        dir,
+        name_.substr(name_.rfind('/') + 1),
+        contents_.offset(),
+        key);
+  }
+
+  // writes the runs of pages of the library that are mapped right now, as
+  // "first_page n_pages" lines relative to its start
+  void save_page_list() const {
+    std::string path = page_list_path();
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (path.empty() || pagemap == -1) {
+      if (pagemap != -1) {
+        close(pagemap);
+      }
+      return;
+    }
+    size_t n_pages = mapped_size_ / get_page_size();
+    std::vector<uint64_t> entries(n_pages);
+    ssize_t n_read = pread(
+        pagemap,
+        entries.data(),
+        n_pages * sizeof(uint64_t),
+        reinterpret_cast<Elf64_Addr>(mapped_library_) / get_page_size() *
+            sizeof(uint64_t));
+    close(pagemap);
+    if (n_read != static_cast<ssize_t>(n_pages * sizeof(uint64_t))) {
+      return;
+    }
+    auto present = [&](size_t page) { return (entries[page] >> 63) != 0; };
+    std::string runs;
+    for (size_t page = 0; page < n_pages;) {
+      if (!present(page)) {
+        ++page;
+        continue;
+      }
+      size_t first = page;
+      while (page < n_pages && present(page)) {
+        ++page;
+      }
+      runs += fmt::format("{} {}\n", first, page - first);
+    }
+    // replace the list at once, another process may be reading it
+    std::string tmp_path = fmt::format("{}.{}", path, getpid());
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (!file) {
+      return;
+    }
+    bool written = fwrite(runs.data(), 1, runs.size(), file) == runs.size();
+    if (fclose(file) == 0 && written) {
+      rename(tmp_path.c_str(), path.c_str());
+    } else {
+      unlink(tmp_path.c_str());
+    }
+  }
+
+  static void save_page_list_of(void* library) {
+    static_cast<CustomLibraryImpl*>(library)->save_page_list();
+  }
+
+  void track_page_list(bool track) {
+    static auto fn =
+        host_function("deploy_track_page_list", &deploy_track_page_list);
+    fn(this, track ? &save_page_list_of : nullptr);
+    page_list_tracked_ = track;
+  }
+
+  // maps the pages listed by an earlier run, if there was one
+  void replay_page_list() {
+    std::string path = page_list_path();
+    FILE* file = path.empty() ? nullptr : fopen(path.c_str(), "r");
+    if (!file) {
+      return;
+    }
+    std::vector<std::pair<size_t, size_t>> runs; // [first, end) pages
+    unsigned long long first = 0;
+    unsigned long long count = 0;
+    while (fscanf(file, "%llu %llu", &first, &count) == 2) {
+      runs.emplace_back(first, first + count);
+    }
+    fclose(file);
+
+    // the readable pages of the segments, merged into [first, end) ranges.
+    // The gaps between segments are PROT_NONE, so touching them would crash
+    std::vector<std::pair<size_t, size_t>> readable;
+    auto mapped = reinterpret_cast<Elf64_Addr>(mapped_library_);
+    for (const auto i : c10::irange(n_program_headers_)) {
+      const Elf64_Phdr& phdr = program_headers_[i];
+      if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_R) == 0) {
+        continue;
+      }
+      Elf64_Addr seg_start = load_bias_ + phdr.p_vaddr;
+      size_t begin = (get_page_start(seg_start) - mapped) / get_page_size();
+      size_t end =
+          (get_page_end(seg_start + phdr.p_memsz) - mapped) / get_page_size();
+      readable.emplace_back(begin, end);
+    }
+    std::sort(readable.begin(), readable.end());
+    std::vector<std::pair<size_t, size_t>> merged;
+    for (const auto& range : readable) {
+      if (!merged.empty() && range.first <= merged.back().second) {
+        merged.back().second = std::max(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    // a list that does not fit the segments is stale, don't use any of it
+    for (const auto& run : runs) {
+      bool fits = run.first < run.second &&
+          std::any_of(merged.begin(), merged.end(), [&](const auto& range) {
+                    return range.first <= run.first &&
+                        run.second <= range.second;
+                  });
+      if (!fits) {
+        return;
+      }
+    }
+
+    for (const auto& run : runs) {
+      char* begin =
+          static_cast<char*>(mapped_library_) + run.first * get_page_size();
+      size_t length = (run.second - run.first) * get_page_size();
+      if (madvise(begin, length, MADV_POPULATE_READ) != 0) {
+        // kernels before 5.14, fault them in ourselves
+        for (size_t offset = 0; offset < length; offset += get_page_size()) {
+          *static_cast<volatile char*>(begin + offset);
+        }
+      }
+    }
+  }
+
   // remove the extra write flags from read-only sections
   void protect() {
     for (const auto& fixup : fixup_prot_) {
@@ -1217,20 +3131,60 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
   }
 
   void load() override {
+    auto begin = std::chrono::steady_clock::now();
+    // sets `seconds` to the time since the last lap
+    auto lap = [&](double& seconds) {
+      auto now = std::chrono::steady_clock::now();
+      seconds = std::chrono::duration<double>(now - begin).count();
+      begin = now;
+    };
     check_library_format();
     reserve_address_space();
     load_segments();
+    if (prefetch_policy_ == PrefetchPolicy::Replay) {
+      replay_page_list();
+      track_page_list(true);
+    }
+    lap(stats_.load_segments_seconds);
     read_dynamic_section();
-    relocate();
+    lap(stats_.dependencies_seconds);
+    stats_.relocated_from_template = relocate_from_template();
+    if (!stats_.relocated_from_template) {
+      unsigned long long subs = current_dl_generation().subs;
+      relocation_images_.assign(
+          dyninfo_.n_rela_ + dyninfo_.n_plt_rela_, kUnknownImage);
+      relocate();
+      record_relocation_template(subs);
+      relocation_images_ = {};
+    }
+    lap(stats_.relocate_seconds);
     protect();
+    lap(stats_.protect_seconds);
     __register_frame(eh_frame_);
     eh_frame_registered_ = true;
     register_debug_info();
+    register_perf_map();
     initialize();
+    lap(stats_.initialize_seconds);
+  }
+
+  LoaderStats stats() const override {
+    LoaderStats stats = stats_;
+    for_each_relocated_word([&](Elf64_Addr*, uint32_t r_type, int32_t) {
+      ++stats.relocations[r_type];
+    });
+    stats.local_hits = local_hits_.load(std::memory_order_relaxed);
+    stats.search_path_hits = search_path_hits_.load(std::memory_order_relaxed);
+    stats.weak_misses = weak_misses_.load(std::memory_order_relaxed);
+    stats.mapped_size = mapped_size_;
+    return stats;
   }
 
   ~CustomLibraryImpl() override {
     // std::cout << "LINKER IS UNLOADING: " << name_ << "\n";
+    if (page_list_tracked_) {
+      track_page_list(false);
+    }
     if (initialized_) {
       finalize();
     }
@@ -1244,7 +3198,6 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
       munmap(mapped_library_, mapped_size_);
     }
 #endif
-    pthread_key_delete(tls_key_);
   }
   void call_function(linker_dtor_function_t f) {
     if (f == nullptr || (int64_t)f == -1) {
@@ -1259,13 +3212,21 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     f(argc_, argv_, environ);
   }
 
-  std::optional<Elf64_Addr> sym(const char* name, const char* version = nullptr)
-      const override {
+  std::optional<Elf64_Addr> sym(
+      const char* name,
+      const char* /*version*/ = nullptr) const override {
     // We ignore version since this is looking up symbols in this file and there
     // should only be one.
     return dyninfo_.sym(name);
   }
 
+  std::optional<Elf64_Addr> hashed_sym(
+      const char* name,
+      const char* /*version*/,
+      const GnuHash& hash) const override {
+    return dyninfo_.sym(name, &hash);
+  }
+
   std::optional<TLSIndex> tls_sym(const char* name) const override {
     auto r = dyninfo_.sym(name);
     if (r) {
@@ -1274,23 +3235,6 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
     return std::nullopt;
   }
 
-  void* tls_addr(size_t offset) {
-    // this was a TLS entry for one of our modules, so we use pthreads to
-    // emulate thread local state.
-    void* start = pthread_getspecific(tls_key_);
-    if (!start) {
-      start = malloc(tls_mem_size_);
-      __cxxabiv1::__cxa_thread_atexit(free, start, &__dso_handle);
-      memcpy(start, tls_initalization_image_, tls_file_size_);
-      memset(
-          (void*)((const char*)start + tls_file_size_),
-          0,
-          tls_mem_size_ - tls_file_size_);
-      pthread_setspecific(tls_key_, start);
-    }
-    return (void*)((const char*)start + offset);
-  }
-
  private:
   MemFile contents_;
   const char* data_ = nullptr;
@@ -1309,28 +3253,146 @@ struct __attribute__((visibility("hidden"))) CustomLibraryImpl
   const char** argv_ = nullptr;
   bool initialized_ = false;
   bool eh_frame_registered_ = false;
+  bool lazy_binding_ = false;
+  bool huge_page_text_ = false;
+  PrefetchPolicy prefetch_policy_ = PrefetchPolicy::None;
+  bool page_list_tracked_ = false;
+
+  size_t tls_module_ = 0;
+
+  LoaderStats stats_;
+  std::atomic<uint64_t> local_hits_{0};
+  std::atomic<uint64_t> search_path_hits_{0};
+  std::atomic<uint64_t> weak_misses_{0};
 
-  pthread_key_t tls_key_ = 0;
-  void* tls_initalization_image_ = nullptr;
-  size_t tls_file_size_ = 0;
-  size_t tls_mem_size_ = 0;
+  std::mutex deferred_ifunc_mutex_;
+  std::vector<const Elf64_Rela*> deferred_ifunc_relocations_;
+
+  // while relocate() runs for a template, the index in template_images() of
+  // the image each relocation was resolved against, or kUnknownImage
+  static constexpr int32_t kUnknownImage = -1;
+  std::vector<int32_t> relocation_images_;
 
   std::vector<std::shared_ptr<SymbolProvider>> symbol_search_path_;
   std::vector<std::function<void(void)>> fixup_prot_;
 };
 
+std::vector<std::shared_ptr<SystemLibrary>> preload_libraries(
+    const std::vector<std::string>& paths,
+    int flags,
+    bool required) {
+  // reading DT_NEEDED also starts reading each file into the page cache,
+  // which the dlopen below then finds there
+  std::vector<std::vector<std::string>> needed(paths.size());
+  // not a bool vector, since the helpers write to it concurrently
+  std::vector<char> is_elf(paths.size());
+  std::atomic<size_t> next{0};
+  run_with_helpers(paths.empty() ? 0 : paths.size() - 1, [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      MemFile image(paths[i].c_str());
+      image.prefetch();
+      if (image.size() >= SELFMAG &&
+          memcmp(image.data(), ELFMAG, SELFMAG) == 0) {
+        is_elf[i] = true;
+        auto search = load_needed_from_elf_file(paths[i].c_str(), image.data());
+        needed[i].assign(search.second.begin(), search.second.end());
+      }
+    }
+  });
+
+  // DT_NEEDED names libraries by file name
+  std::unordered_map<std::string, size_t> by_name;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (is_elf[i]) {
+      by_name.emplace(paths[i].substr(paths[i].rfind('/') + 1), i);
+    }
+  }
+  std::vector<size_t> n_pending(paths.size());
+  std::vector<std::vector<size_t>> dependents(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    for (const auto& name : needed[i]) {
+      auto it = by_name.find(name);
+      if (it != by_name.end() && it->second != i) {
+        ++n_pending[i];
+        dependents[it->second].push_back(i);
+      }
+    }
+  }
+
+  // every library after the ones it needs, otherwise in the order given.
+  // dlopen holds a process wide lock while it loads a library, so loading
+  // independent libraries on several threads would not make it any faster.
+  std::vector<std::shared_ptr<SystemLibrary>> libraries;
+  std::vector<bool> queued(paths.size());
+  std::vector<size_t> ready;
+  auto enqueue = [&](size_t i) {
+    queued[i] = true;
+    ready.push_back(i);
+  };
+  // anything else, e.g. a linker script, is left to the linker
+  size_t n_libraries = std::count(is_elf.begin(), is_elf.end(), true);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!is_elf[i]) {
+      queued[i] = true;
+    } else if (n_pending[i] == 0) {
+      enqueue(i);
+    }
+  }
+  size_t head = 0;
+  while (head < n_libraries) {
+    if (head == ready.size()) {
+      // only libraries in cycles are left, the dynamic linker copes with those
+      enqueue(std::find(queued.begin(), queued.end(), false) - queued.begin());
+    }
+    size_t i = ready[head++];
+    // unless it is required, a library that does not load only matters if
+    // something uses it, which then fails to load itself
+    void* handle = dlopen(paths[i].c_str(), flags);
+    if (handle) {
+      libraries.push_back(SystemLibrary::create(handle, /*steal=*/true));
+    } else {
+      const char* error = dlerror();
+      DEPLOY_CHECK(!required, "failed to preload {}: {}", paths[i], error);
+      std::cerr << fmt::format(
+          "warning, failed to preload {}: {}\n", paths[i], error);
+    }
+    for (size_t dependent : dependents[i]) {
+      if (--n_pending[dependent] == 0 && !queued[dependent]) {
+        enqueue(dependent);
+      }
+    }
+  }
+  return libraries;
+}
+
 std::shared_ptr<CustomLibrary>
 CustomLibrary::create(const char* filename, int argc, const char** argv) {
-  return std::make_shared<CustomLibraryImpl>(filename, argc, argv);
+  return std::make_shared<CustomLibraryImpl>(filename, 0, 0, argc, argv);
 }
 
-static void* local__tls_get_addr(TLSIndex* idx) {
-  if ((idx->module_id & TLS_LOCAL_FLAG) != 0) {
-    return ((CustomLibraryImpl*)(idx->module_id & ~TLS_LOCAL_FLAG))
-        ->tls_addr(idx->offset);
+std::shared_ptr<CustomLibrary> CustomLibrary::create(
+    const char* filename,
+    size_t offset,
+    size_t size,
+    int argc,
+    const char** argv) {
+  return std::make_shared<CustomLibraryImpl>(
+      filename, offset, size, argc, argv);
+}
+
+#ifdef __x86_64__
+extern "C" __attribute__((visibility("hidden"))) Elf64_Addr deploy_lazy_bind(
+    CustomLibraryImpl* lib,
+    size_t index) {
+  try {
+    return lib->bind_lazily(index);
+  } catch (const std::exception& e) {
+    // there is no way to unwind through the PLT back to the caller
+    std::cerr << e.what() << std::endl;
+    abort();
   }
-  return __tls_get_addr(idx);
 }
+#endif
 
 } // namespace deploy
 } // namespace torch
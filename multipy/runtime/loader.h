@@ -7,9 +7,14 @@
 #pragma once
 #include <dlfcn.h>
 #include <elf.h>
+#include <pthread.h>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <optional>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace torch {
 namespace deploy {
@@ -24,11 +29,37 @@ struct TLSIndex {
   size_t offset;
 };
 
+// holds a pre-computed hash for a string that is used in a GNU-style hash
+// tables and also keeps track of the string length.
+struct GnuHash {
+  explicit GnuHash(const char* name) {
+    uint32_t h = 5381;
+    const uint8_t* name_bytes = reinterpret_cast<const uint8_t*>(name);
+#pragma unroll 8
+    while (*name_bytes != 0) {
+      h += (h << 5) +
+          *name_bytes++; // h*33 + c = h + h * 32 + c = h + h << 5 + c
+    }
+    hash = h;
+    name_len = reinterpret_cast<const char*>(name_bytes) - name;
+  }
+  uint32_t hash;
+  uint32_t name_len;
+};
+
 struct SymbolProvider {
   SymbolProvider() = default;
   virtual std::optional<Elf64_Addr> sym(
       const char* name,
       const char* version = nullptr) const = 0;
+  // same as sym, for a name whose hash was already computed, so that it is
+  // only hashed once no matter how many providers are searched for it.
+  virtual std::optional<Elf64_Addr> hashed_sym(
+      const char* name,
+      const char* version,
+      const GnuHash& /*hash*/) const {
+    return sym(name, version);
+  }
   virtual std::optional<TLSIndex> tls_sym(const char* name) const = 0;
   SymbolProvider(const SymbolProvider&) = delete;
   SymbolProvider& operator=(const SymbolProvider&) = delete;
@@ -45,13 +76,152 @@ struct SystemLibrary : public SymbolProvider {
   static std::shared_ptr<SystemLibrary> create(const char* path, int flags);
 };
 
+// How the pages of a library are brought in when it is loaded, rather than
+// faulted in one at a time by the first calls into it.
+enum class PrefetchPolicy {
+  None, // fault pages in as they are used
+  Populate, // map all pages of the file while loading (MAP_POPULATE)
+  WillNeed, // start reading the file in the background (MADV_WILLNEED)
+  Replay, // map the pages an earlier run used, see save_page_lists
+};
+
+// what the loader did to load a CustomLibrary
+struct LoaderStats {
+  // relocations of the library by ELF relocation type. The packed DT_RELR
+  // ones count as R_X86_64_RELATIVE or R_AARCH64_RELATIVE.
+  std::map<uint32_t, size_t> relocations;
+  // whether the relocations were replayed from an earlier load of the same
+  // file instead of resolved, in which case no symbols were looked up
+  bool relocated_from_template = false;
+  // symbols found in the library itself, on its search path, and weak
+  // symbols that were found nowhere
+  uint64_t local_hits = 0;
+  uint64_t search_path_hits = 0;
+  uint64_t weak_misses = 0;
+
+  double load_segments_seconds = 0;
+  // reading the dynamic section and loading the libraries it needs
+  double dependencies_seconds = 0;
+  double relocate_seconds = 0;
+  double protect_seconds = 0;
+  double initialize_seconds = 0;
+
+  size_t mapped_size = 0;
+  size_t tls_size = 0;
+};
+
 struct CustomLibrary : public SymbolProvider {
   static std::shared_ptr<CustomLibrary>
   create(const char* filename, int argc = 0, const char** argv = nullptr);
+  // load a library stored in the `size` bytes of `filename` starting at
+  // `offset`, e.g. one embedded in a section of the executable. Its segments
+  // are mapped straight from that file, so `offset` must be page aligned.
+  static std::shared_ptr<CustomLibrary> create(
+      const char* filename,
+      size_t offset,
+      size_t size,
+      int argc = 0,
+      const char** argv = nullptr);
   virtual void add_search_library(std::shared_ptr<SymbolProvider> lib) = 0;
+  // bind PLT entries on their first call rather than while loading, like
+  // RTLD_LAZY does. Ignored for libraries linked with -z now and on
+  // architectures other than x86_64. Must be called before load().
+  virtual void set_lazy_binding(bool lazy) = 0;
+  // copy the executable segments to 2MB aligned anonymous memory that the
+  // kernel can back with transparent huge pages, to reduce iTLB misses when
+  // running the code. Each copy of the library then has its own copy of the
+  // code rather than sharing the page cache. Must be called before load().
+  virtual void set_huge_page_text(bool huge_pages) = 0;
+  // Must be called before load().
+  virtual void set_prefetch_policy(PrefetchPolicy policy) = 0;
   virtual void load() = 0;
+  // lookups made by lazily bound PLT entries are included once they are
+  // called
+  virtual LoaderStats stats() const = 0;
+};
+
+// Sets whether libraries created from now on bind lazily by default. Called
+// in the host process it also applies to the libraries loaded by all
+// interpreters.
+void set_default_lazy_binding(bool lazy);
+
+// Sets whether libraries created from now on put their code on huge pages by
+// default, see CustomLibrary::set_huge_page_text. Like the lazy binding
+// default, the setting of the host applies to all interpreters.
+void set_default_huge_page_text(bool huge_pages);
+
+// Sets the prefetch policy of libraries created from now on. Like the
+// defaults above, the settings of the host apply to all interpreters.
+void set_default_prefetch_policy(PrefetchPolicy policy);
+
+// Directory the page lists of PrefetchPolicy::Replay are kept in.
+void set_page_list_dir(std::string dir);
+
+// Records which pages of each library loaded with PrefetchPolicy::Replay are
+// mapped now, in every interpreter. Call it once the process is warmed up,
+// and the next run that loads the same libraries maps those pages while
+// loading them instead of on its first requests.
+void save_page_lists();
+
+// Loads the shared libraries at `paths` with dlopen and `flags`, each one after
+// the others among them it needs, e.g. to make the symbols of libraries that
+// ship with an app global before the libraries loaded by the custom loader
+// look for them. The files are read and their dependencies parsed on the
+// loader's helper threads. Libraries dlopen fails to load are skipped with a
+// warning, unless they are `required`, in which case it throws. Returns the
+// libraries in the order they were loaded, which are closed again once they
+// are destroyed.
+std::vector<std::shared_ptr<SystemLibrary>> preload_libraries(
+    const std::vector<std::string>& paths,
+    int flags,
+    bool required = false);
+
+// Sets whether the functions of libraries loaded from now on are written to
+// /tmp/perf-<pid>.map, so that perf and other profilers can symbolize them.
+// Defaults to whether MULTIPY_PERF_MAP is set in the environment. Like
+// set_default_lazy_binding, the setting of the host applies to all
+// interpreters. Entries are never removed, so the addresses of a library
+// that was unloaded can be symbolized with its functions even after another
+// one is loaded there.
+void set_perf_map(bool enabled);
+
+// Symbols resolved through dlsym are cached for the whole process, and shared
+// by every interpreter, since they all resolve the same symbols against the
+// same system libraries.
+struct SymbolCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  // time spent in dlsym on misses
+  double lookup_seconds;
+
+  // estimate of the time the hits saved, assuming they would have cost as
+  // much as an average miss
+  double saved_seconds() const {
+    return misses ? lookup_seconds * hits / misses : 0;
+  }
+};
+
+SymbolCacheStats symbol_cache_stats();
+
+// The files the DT_NEEDED entries of the libraries we load resolve to are
+// cached for the whole process too, as long as they do not change.
+struct DependencyCacheStats {
+  uint64_t hits;
+  uint64_t misses;
 };
 
+DependencyCacheStats dependency_cache_stats();
+
+// Replacements for pthread_key_create and friends, used by the libraries we
+// load and by the python inside each interpreter. A process only has
+// PTHREAD_KEYS_MAX real keys, which would otherwise limit how many
+// interpreters it can run. These keys live in thread local arrays of the
+// loader instead and behave like pthread keys, including their destructors.
+int tls_key_create(pthread_key_t* key, void (*destructor)(void*));
+int tls_key_delete(pthread_key_t key);
+void* tls_getspecific(pthread_key_t key);
+int tls_setspecific(pthread_key_t key, const void* value);
+
 using SystemLibraryPtr = std::shared_ptr<SystemLibrary>;
 using CustomLibraryPtr = std::shared_ptr<CustomLibrary>;
 
@@ -15,6 +15,7 @@
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <string>
 
 namespace torch {
 namespace deploy {
@@ -26,8 +27,17 @@ namespace deploy {
 ///
 /// 2. Used in unity to load the elf file.
 struct MemFile {
-  explicit MemFile(const char* filename_)
-      : fd_(0), mem_(nullptr), n_bytes_(0), name_(filename_) {
+  explicit MemFile(const char* filename_) : MemFile(filename_, 0, 0) {}
+
+  /// Maps only the `length` bytes of the file starting at `offset`, e.g. a
+  /// library embedded in a section of another ELF file. `offset` must be page
+  /// aligned. A `length` of 0 maps everything from `offset` to the end.
+  MemFile(const char* filename_, size_t offset, size_t length)
+      : fd_(0),
+        mem_(nullptr),
+        n_bytes_(length),
+        offset_(offset),
+        name_(filename_) {
     fd_ = open(filename_, O_RDONLY);
     MULTIPY_CHECK(
         fd_ != -1, "failed to open {}: {}" + filename_ + strerror(errno));
@@ -38,8 +48,15 @@ struct MemFile {
       MULTIPY_CHECK(
           false, "failed to stat {}: {}" + filename_ + strerror(errno));
     }
-    n_bytes_ = s.st_size;
-    mem_ = mmap(nullptr, n_bytes_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (offset_ >= (size_t)s.st_size ||
+        offset_ + n_bytes_ > (size_t)s.st_size) {
+      close(fd_);
+      MULTIPY_CHECK(false, "range out of bounds of " + name_);
+    }
+    if (n_bytes_ == 0) {
+      n_bytes_ = s.st_size - offset_;
+    }
+    mem_ = mmap(nullptr, n_bytes_, PROT_READ, MAP_SHARED, fd_, offset_);
     if (MAP_FAILED == mem_) {
       close(fd_);
       MULTIPY_CHECK(
@@ -66,18 +83,35 @@ struct MemFile {
     }
   }
 
+  /// Asks the kernel to start reading the whole mapping in the background, so
+  /// that later accesses to the file, through this or another mapping, do
+  /// not have to wait for the disk.
+  void prefetch() const {
+    madvise(mem_, n_bytes_, MADV_WILLNEED);
+  }
+
   /// Returns the size of the underlying file defined by the `MemFile`
-  size_t size() {
+  [[nodiscard]] size_t size() const {
     return n_bytes_;
   }
   [[nodiscard]] int fd() const {
     return fd_;
   }
 
+  /// Returns the offset in the underlying file at which `data()` starts.
+  [[nodiscard]] size_t offset() const {
+    return offset_;
+  }
+
+  [[nodiscard]] const std::string& name() const {
+    return name_;
+  }
+
  private:
   int fd_;
   void* mem_;
   size_t n_bytes_;
+  size_t offset_;
   std::string name_;
 };
 
@@ -5,17 +5,32 @@
 // LICENSE file in the root directory of this source tree.
 
 #include <ATen/Parallel.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 #include <cstring>
 
 #include <c10/util/irange.h>
 #include <multipy/runtime/deploy.h>
+#include <multipy/runtime/embedded_zip.h>
+#include <multipy/runtime/loader.h>
 #include <torch/script.h>
 #include <torch/torch.h>
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <future>
 #include <iostream>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 void compare_torchpy_jit(const char* model_filename, const char* jit_filename) {
   // Test
@@ -82,6 +97,733 @@ TEST(TorchpyTest, DifferentInterps) {
   ASSERT_NE(id0, id1);
 }
 
+TEST(TorchpyTest, ParallelInitInterpIds) {
+  // interpreters are created concurrently but must keep their position
+  constexpr size_t nInterp = 8;
+  torch::deploy::InterpreterManager m(nInterp);
+  ASSERT_EQ(m.allInstances().size(), nInterp);
+  for (const auto i : c10::irange(nInterp)) {
+    auto I = m.allInstances()[i].acquireSession();
+    ASSERT_EQ(I.global("torch", "version").attr("interp").toIValue().toInt(), i);
+  }
+}
+
+TEST(TorchpyTest, AsyncStartup) {
+  constexpr size_t nInterp = 4;
+  torch::deploy::InterpreterManager m(
+      nInterp, std::make_shared<torch::deploy::NoopEnvironment>(), 1);
+  ASSERT_GE(m.allInstances().size(), 1);
+  {
+    // usable before the rest of the pool is up
+    auto I = m.acquireOne();
+    ASSERT_EQ(I.global("operator", "add")({2, 3}).toIValue().toInt(), 5);
+  }
+  m.allReady().get();
+  ASSERT_EQ(m.allInstances().size(), nInterp);
+  for (const auto i : c10::irange(nInterp)) {
+    auto I = m.allInstances()[i].acquireSession();
+    ASSERT_EQ(I.global("torch", "version").attr("interp").toIValue().toInt(), i);
+  }
+}
+
+TEST(TorchpyTest, FastExit) {
+  torch::deploy::ReplicatedObj obj;
+  {
+    torch::deploy::InterpreterManager m(2);
+    m.setFastExit(true);
+    auto I = m.acquireOne();
+    obj = m.createMovable(I.global("torch", "ones")({2}), &I);
+  }
+  // the object outlived its manager and must not touch it when destroyed
+  obj = torch::deploy::ReplicatedObj();
+
+  torch::deploy::InterpreterManager m(2);
+  auto I = m.acquireOne();
+  ASSERT_TRUE(I.global("torch", "ones")({2}).toIValue().toTensor().equal(
+      torch::ones(2)));
+}
+
+TEST(TorchpyTest, FastExitOnlyOnDestruction) {
+  torch::deploy::InterpreterManager m(1);
+  m.setFastExit(true);
+  auto countObjects = [&]() {
+    auto I = m.acquireOne();
+    return I.global("multipy.utils._deploy", "_deploy_objects")
+        .attr("__len__")(at::ArrayRef<at::IValue>{})
+        .toIValue()
+        .toInt();
+  };
+  int64_t before = countObjects();
+  {
+    torch::deploy::ReplicatedObj obj;
+    {
+      auto I = m.acquireOne();
+      obj = m.createMovable(I.global("torch", "ones")({2}), &I);
+      I.fromMovable(obj);
+    }
+    ASSERT_EQ(countObjects(), before + 1);
+  }
+  // objects destroyed before their manager still unload themselves
+  ASSERT_EQ(countObjects(), before);
+}
+
+TEST(TorchpyTest, Resize) {
+  torch::deploy::InterpreterManager m(
+      1, std::make_shared<torch::deploy::NoopEnvironment>(), 0, 3);
+  ASSERT_EQ(m.maxInterpreters(), 3);
+  m.resize(3);
+  ASSERT_EQ(m.allInstances().size(), 3);
+  for (const auto i : c10::irange(3)) {
+    auto I = m.allInstances()[i].acquireSession();
+    ASSERT_EQ(I.global("torch", "version").attr("interp").toIValue().toInt(), i);
+  }
+  m.resize(1);
+  ASSERT_EQ(m.allInstances().size(), 1);
+  auto I = m.acquireOne();
+  ASSERT_EQ(I.global("operator", "add")({2, 3}).toIValue().toInt(), 5);
+  ASSERT_THROW(m.resize(4), std::runtime_error);
+}
+
+TEST(TorchpyTest, ElasticPolicy) {
+  torch::deploy::InterpreterManager m(
+      1, std::make_shared<torch::deploy::NoopEnvironment>(), 0, 2);
+  torch::deploy::ElasticPoolPolicy policy;
+  policy.minInterp = 1;
+  policy.maxInterp = 2;
+  policy.period = std::chrono::milliseconds(10);
+  policy.shrinkIdle = std::chrono::milliseconds(10);
+  m.setElasticPolicy(policy);
+
+  auto waitForSize = [&](size_t n) {
+    for (int i = 0; i < 1000 && m.allInstances().size() != n; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return m.allInstances().size();
+  };
+  {
+    // the second session has to share the only interpreter
+    auto I0 = m.acquireOne();
+    auto I1 = m.acquireOne();
+    ASSERT_EQ(waitForSize(2), 2);
+  }
+  ASSERT_EQ(waitForSize(1), 1);
+  m.clearElasticPolicy();
+}
+
+TEST(TorchpyTest, ReplaceInterpreter) {
+  torch::deploy::InterpreterManager m(2);
+  m.registerModuleSource("replace_module", "value = 42\n");
+  torch::deploy::ReplicatedObj obj;
+  {
+    auto I = m.acquireOne();
+    obj = m.createMovable(I.global("torch", "ones")({2}), &I);
+  }
+  int64_t oldId = 0;
+  {
+    auto I = m.allInstances()[0].acquireSession();
+    oldId = I.global("builtins", "id")({I.global("sys", "modules")})
+                .toIValue()
+                .toInt();
+  }
+
+  m.replaceInterpreter(0);
+  ASSERT_EQ(m.allInstances().size(), 2);
+  auto I = m.allInstances()[0].acquireSession();
+  ASSERT_NE(
+      I.global("builtins", "id")({I.global("sys", "modules")})
+          .toIValue()
+          .toInt(),
+      oldId);
+  ASSERT_EQ(I.global("torch", "version").attr("interp").toIValue().toInt(), 0);
+  // warmed up before it was swapped in
+  ASSERT_TRUE(I.global("sys", "modules")
+                  .attr("__contains__")({"replace_module"})
+                  .toIValue()
+                  .toBool());
+  ASSERT_EQ(
+      I.global("multipy.utils._deploy", "_deploy_objects")
+          .attr("__len__")(at::ArrayRef<at::IValue>{})
+          .toIValue()
+          .toInt(),
+      1);
+  ASSERT_TRUE(I.fromMovable(obj).toIValue().toTensor().equal(torch::ones(2)));
+}
+
+TEST(TorchpyTest, SharedSymbolCache) {
+  torch::deploy::InterpreterManager first(1);
+  auto before = torch::deploy::symbol_cache_stats();
+  torch::deploy::InterpreterManager second(1);
+  auto after = torch::deploy::symbol_cache_stats();
+  // the second interpreter resolves the same symbols as the first
+  ASSERT_GT(after.hits, before.hits);
+}
+
+TEST(TorchpyTest, LazyBinding) {
+  torch::deploy::set_default_lazy_binding(true);
+  torch::deploy::InterpreterManager m(1);
+  torch::deploy::set_default_lazy_binding(false);
+  auto I = m.acquireOne();
+  ASSERT_TRUE(I.global("torch", "ones")({2}).toIValue().toTensor().equal(
+      torch::ones(2)));
+}
+
+#ifdef __x86_64__
+TEST(CustomLoaderTest, LazyBindingKeepsVectorArguments) {
+  if (!__builtin_cpu_supports("avx")) {
+    GTEST_SKIP();
+  }
+  auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+  lib->set_lazy_binding(true);
+  lib->add_search_library(torch::deploy::SystemLibrary::create());
+  lib->load();
+  auto sum = reinterpret_cast<float (*)()>(
+      lib->sym("loader_test_call_avx_sum").value());
+  // the first call binds the PLT entry, which must not clobber the upper
+  // half of the __m256 argument
+  ASSERT_EQ(sum(), 36.f);
+  ASSERT_EQ(sum(), 36.f);
+}
+#endif
+
+TEST(CustomLoaderTest, DependencyCache) {
+  auto load = [&]() {
+    auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+    lib->add_search_library(torch::deploy::SystemLibrary::create());
+    lib->load();
+    return lib;
+  };
+  // the first load looks for the library test_loader_lib needs, unless an
+  // earlier test did already, the second one finds it in the cache. Either
+  // one unloads it again, so the second has to look it up too.
+  auto before = torch::deploy::dependency_cache_stats();
+  load().reset();
+  auto first = torch::deploy::dependency_cache_stats();
+  ASSERT_EQ(first.hits + first.misses, before.hits + before.misses + 1);
+  load().reset();
+  auto second = torch::deploy::dependency_cache_stats();
+  ASSERT_EQ(second.hits, first.hits + 1);
+  ASSERT_EQ(second.misses, first.misses);
+
+  // a file that changed since is looked up again
+  std::string lib_path = TEST_LOADER_LIB;
+  std::string dep_path =
+      lib_path.substr(0, lib_path.rfind('/')) + "/libtest_loader_dep.so";
+  struct stat s {};
+  ASSERT_EQ(stat(dep_path.c_str(), &s), 0);
+  struct timespec touched[2] = {s.st_atim, s.st_mtim};
+  touched[1].tv_sec += 1;
+  ASSERT_EQ(utimensat(AT_FDCWD, dep_path.c_str(), touched, 0), 0);
+  load().reset();
+  struct timespec original[2] = {s.st_atim, s.st_mtim};
+  utimensat(AT_FDCWD, dep_path.c_str(), original, 0);
+  auto third = torch::deploy::dependency_cache_stats();
+  ASSERT_EQ(third.hits, second.hits);
+  ASSERT_EQ(third.misses, second.misses + 1);
+}
+
+TEST(CustomLoaderTest, PreloadLibraries) {
+  auto path = [](const char* name) {
+    return std::string(TEST_PRELOAD_DIR) + "/libtest_preload_" + name + ".so";
+  };
+  using Libraries = std::vector<std::shared_ptr<torch::deploy::SystemLibrary>>;
+  auto sym = [](const Libraries& libs, const char* name) -> int (*)() {
+    for (const auto& lib : libs) {
+      if (auto r = lib->sym(name)) {
+        return reinterpret_cast<int (*)()>(*r);
+      }
+    }
+    return nullptr;
+  };
+
+  // test_preload_top cannot find the library it needs, the others still load
+  auto libs = torch::deploy::preload_libraries(
+      {path("top"), path("cycle_a"), path("cycle_b")}, RTLD_LAZY | RTLD_LOCAL);
+  ASSERT_EQ(libs.size(), 2);
+  ASSERT_EQ(sym(libs, "test_preload_top"), nullptr);
+  ASSERT_EQ(sym(libs, "test_preload_cycle")(), 20);
+  libs.clear();
+  // unless they all have to load
+  ASSERT_ANY_THROW(torch::deploy::preload_libraries(
+      {path("top"), path("cycle_a"), path("cycle_b")},
+      RTLD_LAZY | RTLD_LOCAL,
+      /*required=*/true));
+
+  // each library of the chain is given before the one it needs, which the
+  // dynamic linker only finds once it is loaded
+  libs = torch::deploy::preload_libraries(
+      {path("top"),
+       path("cycle_b"),
+       path("mid"),
+       path("cycle_a"),
+       path("base")},
+      RTLD_LAZY | RTLD_LOCAL);
+  ASSERT_EQ(libs.size(), 5);
+  ASSERT_EQ(sym(libs, "test_preload_top")(), 111);
+  ASSERT_EQ(sym(libs, "test_preload_cycle")(), 20);
+}
+
+TEST(CustomLoaderTest, Ifuncs) {
+  auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+  lib->add_search_library(torch::deploy::SystemLibrary::create());
+  lib->load();
+  auto sym = [&](const char* name) {
+    return reinterpret_cast<int (*)()>(lib->sym(name).value());
+  };
+  // looking up the exported one calls its resolver, the calls to and the
+  // pointer to the hidden one are IRELATIVE relocations
+  ASSERT_EQ(sym("loader_test_ifunc")(), 42);
+  ASSERT_EQ(sym("loader_test_call_hidden_ifunc")(), 42);
+  auto pointer = reinterpret_cast<int (**)()>(
+      lib->sym("loader_test_ifunc_pointer").value());
+  ASSERT_EQ((*pointer)(), 42);
+#ifdef __x86_64__
+  ASSERT_GE(lib->stats().relocations[R_X86_64_IRELATIVE], 2);
+#else
+  ASSERT_GE(lib->stats().relocations[R_AARCH64_IRELATIVE], 2);
+#endif
+}
+
+TEST(CustomLoaderTest, PerfMap) {
+  torch::deploy::set_perf_map(true);
+  auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+  lib->add_search_library(torch::deploy::SystemLibrary::create());
+  lib->load();
+  torch::deploy::set_perf_map(false);
+  auto address = reinterpret_cast<uintptr_t>(
+      lib->sym("loader_test_call_hidden_ifunc").value());
+  auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+  std::ifstream map(path);
+  unlink(path.c_str());
+  ASSERT_TRUE(map.is_open());
+  // lines are "<start> <size> <name>" in hex
+  bool found = false;
+  std::string line;
+  while (std::getline(map, line)) {
+    std::istringstream fields(line);
+    uintptr_t start = 0;
+    size_t size = 0;
+    std::string name;
+    fields >> std::hex >> start >> size >> name;
+    if (name == "loader_test_call_hidden_ifunc") {
+      found = found || (start == address && size > 0);
+    }
+  }
+  ASSERT_TRUE(found);
+}
+
+// the pages listed in the page list files of `dir`
+static std::set<size_t> listed_pages(const std::string& dir) {
+  std::set<size_t> pages;
+  DIR* entries = opendir(dir.c_str());
+  while (dirent* entry = entries ? readdir(entries) : nullptr) {
+    std::string name = entry->d_name;
+    if (name.size() < 6 || name.substr(name.size() - 6) != ".pages") {
+      continue;
+    }
+    std::ifstream list(dir + "/" + name);
+    size_t first = 0;
+    size_t count = 0;
+    while (list >> first >> count) {
+      for (const auto page : c10::irange(first, first + count)) {
+        pages.insert(page);
+      }
+    }
+  }
+  if (entries) {
+    closedir(entries);
+  }
+  return pages;
+}
+
+TEST(CustomLoaderTest, PageListRoundTrip) {
+  char dir[] = "/tmp/multipy_page_lists_XXXXXX";
+  ASSERT_NE(mkdtemp(dir), nullptr);
+  torch::deploy::set_page_list_dir(dir);
+  auto load = [&]() {
+    auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+    lib->set_prefetch_policy(torch::deploy::PrefetchPolicy::Replay);
+    lib->add_search_library(torch::deploy::SystemLibrary::create());
+    lib->load();
+    return lib;
+  };
+
+  // reads a page that loading the library does not touch
+  auto first = load();
+  auto read_pages = reinterpret_cast<int (*)()>(
+      first->sym("loader_test_read_pages").value());
+  ASSERT_EQ(read_pages(), 0);
+  torch::deploy::save_page_lists();
+  std::set<size_t> saved = listed_pages(dir);
+  ASSERT_FALSE(saved.empty());
+  first.reset();
+
+  // the next load maps the saved pages again before anything runs, so
+  // saving its list right away finds at least those
+  auto second = load();
+  torch::deploy::save_page_lists();
+  std::set<size_t> replayed = listed_pages(dir);
+  second.reset();
+  for (const auto page : saved) {
+    EXPECT_EQ(replayed.count(page), 1) << "page " << page;
+  }
+
+  // lists of another version of the library are ignored, not touched
+  std::vector<std::string> lists;
+  DIR* entries = opendir(dir);
+  while (dirent* entry = entries ? readdir(entries) : nullptr) {
+    if (entry->d_name[0] != '.') {
+      lists.push_back(std::string(dir) + "/" + entry->d_name);
+    }
+  }
+  if (entries) {
+    closedir(entries);
+  }
+  ASSERT_FALSE(lists.empty());
+  for (const auto& list : lists) {
+    std::ofstream(list) << "0 1\n" << (1 << 30) << " 16\n";
+  }
+  auto third = load();
+  read_pages = reinterpret_cast<int (*)()>(
+      third->sym("loader_test_read_pages").value());
+  EXPECT_EQ(read_pages(), 0);
+  third.reset();
+  torch::deploy::set_page_list_dir("");
+
+  for (const auto& list : lists) {
+    unlink(list.c_str());
+  }
+  rmdir(dir);
+}
+
+#if defined(TEST_LOADER_RELR_LIB) && defined(__x86_64__)
+TEST(CustomLoaderTest, PackedRelativeRelocations) {
+  auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_RELR_LIB);
+  lib->add_search_library(torch::deploy::SystemLibrary::create());
+  lib->load();
+  auto table =
+      reinterpret_cast<int**>(lib->sym("loader_test_relr_table").value());
+  auto values = reinterpret_cast<int* (*)()>(
+      lib->sym("loader_test_relr_values").value())();
+  size_t n_relative = 0;
+  for (const auto i : c10::irange(200)) {
+    if (i % 3 == 2) {
+      ASSERT_EQ(table[i], nullptr);
+    } else {
+      ASSERT_EQ(table[i], values + i);
+      ++n_relative;
+    }
+  }
+  // all of them are in DT_RELR, which the stats count as RELATIVE
+  auto stats = lib->stats();
+  ASSERT_GE(stats.relocations[R_X86_64_RELATIVE], n_relative);
+}
+#endif
+
+TEST(CustomLoaderTest, RelocationTemplates) {
+  auto load = [&]() {
+    auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+    lib->add_search_library(torch::deploy::SystemLibrary::create());
+    lib->load();
+    // the values of its IRELATIVE relocations come from the template too
+    auto fn = reinterpret_cast<int (*)()>(
+        lib->sym("loader_test_call_hidden_ifunc").value());
+    EXPECT_EQ(fn(), 42);
+    return lib;
+  };
+  // earlier tests may have loaded it already, so the first load may replay
+  // too, but all later ones must
+  std::vector<std::shared_ptr<torch::deploy::CustomLibrary>> libs;
+  libs.emplace_back(load());
+  for (const auto i : c10::irange(2)) {
+    libs.emplace_back(load());
+    ASSERT_TRUE(libs.back()->stats().relocated_from_template) << i;
+  }
+
+  // unloading a library could have freed addresses the template points to,
+  // so the next load resolves the relocations again and records a new one
+  void* handle = dlopen(TEST_LOADER_LIB, RTLD_NOW | RTLD_LOCAL);
+  ASSERT_NE(handle, nullptr) << dlerror();
+  ASSERT_EQ(dlclose(handle), 0);
+  libs.emplace_back(load());
+  ASSERT_FALSE(libs.back()->stats().relocated_from_template);
+  libs.emplace_back(load());
+  ASSERT_TRUE(libs.back()->stats().relocated_from_template);
+}
+
+TEST(CustomLoaderTest, RelocationTemplatesFollowProviders) {
+  // every load gets its own copy of the library it resolves symbols in, like
+  // the libraries of different interpreters
+  std::vector<std::shared_ptr<torch::deploy::CustomLibrary>> libs;
+  for (const auto i : c10::irange(3)) {
+    auto dep = torch::deploy::CustomLibrary::create(TEST_LOADER_DEP_LIB);
+    dep->add_search_library(torch::deploy::SystemLibrary::create());
+    dep->load();
+    auto lib = torch::deploy::CustomLibrary::create(TEST_LOADER_LIB);
+    lib->add_search_library(dep);
+    lib->add_search_library(torch::deploy::SystemLibrary::create());
+    lib->load();
+    if (i > 0) {
+      ASSERT_TRUE(lib->stats().relocated_from_template) << i;
+    }
+    // far outside of the copy of the library, but still relative to it
+    auto values = reinterpret_cast<int*>(
+        dep->sym("loader_test_dep_values").value());
+    auto past = *reinterpret_cast<int**>(
+        lib->sym("loader_test_past_dep_values").value());
+    EXPECT_EQ(past, values + 0x100000) << i;
+    libs.push_back(dep);
+    libs.push_back(lib);
+  }
+}
+
+struct ZipMember {
+  std::string name;
+  std::string contents;
+  bool deflated;
+};
+
+template <typename T>
+static void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// a zip archive of `members`, followed by `comment`
+static std::string zip_archive(
+    const std::vector<ZipMember>& members,
+    const std::string& comment = "") {
+  std::string out;
+  std::string directory;
+  for (const auto& member : members) {
+    std::string data = member.contents;
+    if (member.deflated) {
+      z_stream stream{};
+      EXPECT_EQ(
+          deflateInit2(
+              &stream,
+              Z_BEST_COMPRESSION,
+              Z_DEFLATED,
+              -MAX_WBITS,
+              8,
+              Z_DEFAULT_STRATEGY),
+          Z_OK);
+      data.resize(deflateBound(&stream, member.contents.size()));
+      stream.next_in = reinterpret_cast<Bytef*>(
+          const_cast<char*>(member.contents.data()));
+      stream.avail_in = member.contents.size();
+      stream.next_out = reinterpret_cast<Bytef*>(&data[0]);
+      stream.avail_out = data.size();
+      EXPECT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+      data.resize(stream.total_out);
+      deflateEnd(&stream);
+    }
+    uint16_t method = member.deflated ? Z_DEFLATED : 0;
+    auto crc = static_cast<uint32_t>(crc32(
+        0,
+        reinterpret_cast<const Bytef*>(member.contents.data()),
+        member.contents.size()));
+    auto offset = static_cast<uint32_t>(out.size());
+
+    put<uint32_t>(out, 0x04034b50);
+    put<uint16_t>(out, 20); // version needed
+    put<uint16_t>(out, 0); // flags
+    put<uint16_t>(out, method);
+    put<uint32_t>(out, 0); // time and date
+    put<uint32_t>(out, crc);
+    put<uint32_t>(out, data.size());
+    put<uint32_t>(out, member.contents.size());
+    put<uint16_t>(out, member.name.size());
+    put<uint16_t>(out, 0); // extra field
+    out += member.name + data;
+
+    put<uint32_t>(directory, 0x02014b50);
+    put<uint16_t>(directory, 20); // version made by
+    put<uint16_t>(directory, 20); // version needed
+    put<uint16_t>(directory, 0); // flags
+    put<uint16_t>(directory, method);
+    put<uint32_t>(directory, 0); // time and date
+    put<uint32_t>(directory, crc);
+    put<uint32_t>(directory, data.size());
+    put<uint32_t>(directory, member.contents.size());
+    put<uint16_t>(directory, member.name.size());
+    put<uint16_t>(directory, 0); // extra field
+    put<uint16_t>(directory, 0); // comment
+    put<uint16_t>(directory, 0); // disk
+    put<uint16_t>(directory, 0); // internal attributes
+    put<uint32_t>(directory, 0); // external attributes
+    put<uint32_t>(directory, offset);
+    directory += member.name;
+  }
+  auto directoryOffset = static_cast<uint32_t>(out.size());
+  out += directory;
+  put<uint32_t>(out, 0x06054b50);
+  put<uint16_t>(out, 0); // disk
+  put<uint16_t>(out, 0); // disk of the central directory
+  put<uint16_t>(out, members.size());
+  put<uint16_t>(out, members.size());
+  put<uint32_t>(out, directory.size());
+  put<uint32_t>(out, directoryOffset);
+  put<uint16_t>(out, comment.size());
+  return out + comment;
+}
+
+static torch::deploy::Section zip_section(const std::string& zip) {
+  return torch::deploy::Section(nullptr, "test_zip", zip.data(), zip.size());
+}
+
+TEST(EmbeddedZipArchiveTest, StoredAndDeflated) {
+  std::string big;
+  for (const auto i : c10::irange(10000)) {
+    big += std::to_string(i * 7919 % 100003) + "\n";
+  }
+  auto zip = zip_archive({
+      {"pkg/", "", false},
+      {"pkg/__init__.py", "", true},
+      {"pkg/stored.py", "x = 1\n", false},
+      {"pkg/deflated.txt", big, true},
+      {"pkg/sub/empty.txt", "", false},
+  });
+  torch::deploy::EmbeddedZipArchive archive(zip_section(zip));
+
+  EXPECT_EQ(archive.find("pkg/stored.py")->method, 0);
+  EXPECT_EQ(archive.find("pkg/deflated.txt")->method, Z_DEFLATED);
+  EXPECT_EQ(archive.read("pkg/stored.py"), "x = 1\n");
+  EXPECT_EQ(archive.read("pkg/deflated.txt"), big);
+  // deflate still writes an empty final block for no contents at all
+  EXPECT_EQ(archive.find("pkg/__init__.py")->method, Z_DEFLATED);
+  EXPECT_EQ(archive.read("pkg/__init__.py"), "");
+  EXPECT_EQ(archive.read("pkg/sub/empty.txt"), "");
+  EXPECT_EQ(archive.read("pkg/missing.py"), std::nullopt);
+  // directory entries are not members
+  EXPECT_EQ(archive.read("pkg/"), std::nullopt);
+  EXPECT_EQ(archive.read("pkg"), std::nullopt);
+
+  EXPECT_TRUE(archive.isDirectory("pkg"));
+  EXPECT_TRUE(archive.isDirectory("pkg/sub"));
+  EXPECT_FALSE(archive.isDirectory("pkg/stored.py"));
+  EXPECT_EQ(archive.list(""), std::vector<std::string>({"pkg"}));
+  EXPECT_EQ(
+      archive.list("pkg"),
+      std::vector<std::string>(
+          {"__init__.py", "deflated.txt", "stored.py", "sub"}));
+}
+
+TEST(EmbeddedZipArchiveTest, Comment) {
+  // the end of central directory record is searched for backwards from the
+  // end, past the comment
+  for (const size_t size : {1, 1000, 0xffff}) {
+    auto zip =
+        zip_archive({{"mod.py", "y = 2\n", true}}, std::string(size, '#'));
+    torch::deploy::EmbeddedZipArchive archive(zip_section(zip));
+    EXPECT_EQ(archive.read("mod.py"), "y = 2\n") << size;
+  }
+}
+
+TEST(EmbeddedZipArchiveTest, RejectsZip64) {
+  auto zip = zip_archive({{"mod.py", "y = 2\n", false}});
+  // Zip64 archives move the count and offset of the central directory to
+  // their own record, and set these to all ones
+  auto eocd = zip.size() - 22;
+  memset(&zip[eocd + 8], 0xff, 4);
+  memset(&zip[eocd + 16], 0xff, 4);
+  try {
+    torch::deploy::EmbeddedZipArchive archive(zip_section(zip));
+    FAIL() << "Zip64 archive was accepted";
+  } catch (const std::runtime_error& e) {
+    EXPECT_NE(strstr(e.what(), "Zip64"), nullptr) << e.what();
+  }
+
+  std::string garbage(100, 'x');
+  EXPECT_THROW(
+      torch::deploy::EmbeddedZipArchive(zip_section(garbage)),
+      std::runtime_error);
+}
+
+TEST(EmbeddedZipArchiveTest, PythonPath) {
+  std::string subdir;
+  auto zip = zip_archive({{"pkg/mod.py", "y = 2\n", false}});
+  std::string path;
+  {
+    torch::deploy::EmbeddedZipArchive archive(zip_section(zip));
+    path = archive.pythonPath();
+    EXPECT_EQ(
+        torch::deploy::EmbeddedArchive::fromPythonPath(path, &subdir),
+        &archive);
+    EXPECT_EQ(subdir, "");
+    EXPECT_EQ(
+        torch::deploy::EmbeddedArchive::fromPythonPath(
+            path + "/pkg/mod.py", &subdir),
+        &archive);
+    EXPECT_EQ(subdir, "pkg/mod.py");
+  }
+  // ids are not reused once their archive is gone
+  torch::deploy::EmbeddedZipArchive other(zip_section(zip));
+  EXPECT_NE(other.pythonPath(), path);
+  for (const auto& unknown :
+       {path,
+        std::string("embedded_archive:123456789:test_zip"),
+        std::string("embedded_archive::test_zip"),
+        std::string("embedded_archive:1"),
+        std::string("/usr/lib/python3")}) {
+    EXPECT_EQ(
+        torch::deploy::EmbeddedArchive::fromPythonPath(unknown, &subdir),
+        nullptr)
+        << unknown;
+  }
+}
+
+TEST(TorchpyTest, RelocationTemplates) {
+  // the later interpreters replay the relocations of the first one
+  torch::deploy::InterpreterManager m(3);
+  for (auto& instance : m.allInstances()) {
+    auto I = instance.acquireSession();
+    ASSERT_TRUE(I.global("torch", "ones")({2}).toIValue().toTensor().equal(
+        torch::ones(2)));
+  }
+}
+
+TEST(TorchpyTest, ManyInterpreters) {
+  // needs tens of gigabytes of memory, so only run when asked for
+  if (!getenv("MULTIPY_STRESS_TESTS")) {
+    GTEST_SKIP();
+  }
+  torch::deploy::InterpreterManager m(256);
+  ASSERT_EQ(m.allInstances().size(), 256);
+  std::vector<std::thread> threads;
+  std::atomic<size_t> failed{0};
+  for (size_t t = 0; t < 16; ++t) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = t; i < 256; i += 16) {
+        auto I = m.allInstances()[i].acquireSession();
+        if (!I.global("torch", "ones")({2}).toIValue().toTensor().equal(
+                torch::ones(2))) {
+          ++failed;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(failed, 0);
+}
+
+TEST(TorchpyTest, StartupStats) {
+  torch::deploy::InterpreterManager m(2);
+  auto stats = m.startupStats();
+  ASSERT_EQ(stats.size(), 2);
+  for (const auto& s : stats) {
+    EXPECT_GT(s.loadLibrary, 0);
+    EXPECT_GT(s.relocations, 0);
+    EXPECT_GT(s.initializePython, 0);
+    EXPECT_GT(s.startScript, 0);
+    EXPECT_GE(
+        s.total,
+        s.loadLibrary + s.initializePython + s.postInitialization +
+            s.startScript);
+  }
+  m.logStartupStats();
+}
+
 TEST(TorchpyTest, SimpleModel) {
   compare_torchpy_jit(path("SIMPLE", simple), path("SIMPLE_JIT", simple_jit));
 }
@@ -0,0 +1,30 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Dependency of test_loader_lib, whose calls into it go through the PLT.
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+// the whole ymm register has to arrive intact, also when the call binds the
+// PLT entry lazily
+extern "C" __attribute__((target("avx"), noinline)) float
+loader_test_avx_sum(__m256 values) {
+  alignas(32) float lanes[8];
+  _mm256_store_ps(lanes, values);
+  float sum = 0;
+  for (float lane : lanes) {
+    sum += lane;
+  }
+  return sum;
+}
+#endif
+
+// test_loader_lib points past its end, so that the pointer only relocates
+// correctly when its value is taken relative to this library
+extern "C" {
+int loader_test_dep_values[16] = {};
+}
@@ -0,0 +1,60 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Library custom loaded by the loader tests in test_deploy.cpp.
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+extern "C" float loader_test_avx_sum(__m256 values);
+
+// 1 + 2 + ... + 8 = 36 unless the upper half of the argument is lost
+extern "C" __attribute__((target("avx"))) float loader_test_call_avx_sum() {
+  return loader_test_avx_sum(
+      _mm256_setr_ps(1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f, 8.f));
+}
+#endif
+
+static int ifunc_implementation() {
+  return 42;
+}
+
+extern "C" {
+// the resolver reads a pointer that needs a relocation, so it only works if
+// the ifuncs are resolved after the other relocations
+int (*loader_test_ifunc_implementation)() = ifunc_implementation;
+
+static int (*resolve_loader_test_ifunc())() {
+  return loader_test_ifunc_implementation;
+}
+
+// exported, so looking it up has to call the resolver
+int loader_test_ifunc() __attribute__((ifunc("resolve_loader_test_ifunc")));
+
+// hidden, so the calls and the pointer to it need IRELATIVE relocations
+__attribute__((visibility("hidden"))) int loader_test_hidden_ifunc()
+    __attribute__((ifunc("resolve_loader_test_ifunc")));
+int (*loader_test_ifunc_pointer)() = loader_test_hidden_ifunc;
+
+int loader_test_call_hidden_ifunc() {
+  return loader_test_hidden_ifunc();
+}
+}
+
+// pages nothing but loader_test_read_pages touches, for the page list tests.
+// It reads from the middle, far enough from the rest of the library that the
+// kernel does not map that page along with others when they fault in.
+alignas(4096) static const char untouched_pages[64 * 4096] = {1};
+
+extern "C" int loader_test_read_pages() {
+  return *static_cast<const volatile char*>(&untouched_pages[32 * 4096]);
+}
+
+// relocated against a symbol of test_loader_dep, but far outside of it
+extern "C" {
+extern int loader_test_dep_values[];
+int* loader_test_past_dep_values = loader_test_dep_values + 0x100000;
+}
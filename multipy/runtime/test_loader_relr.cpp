@@ -0,0 +1,34 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Library the loader tests custom load after linking it with
+// -z pack-relative-relocs, so that its relative relocations are in DT_RELR.
+
+#include <array>
+#include <cstddef>
+#include <utility>
+
+constexpr size_t kTableSize = 200;
+
+namespace {
+// hidden, so the addresses taken of it need relative relocations
+int values[kTableSize];
+
+// every third entry is null, which leaves holes in the RELR bitmaps
+template <size_t... I>
+constexpr std::array<int*, kTableSize> make_table(std::index_sequence<I...>) {
+  return {{(I % 3 == 2 ? nullptr : &values[I])...}};
+}
+} // namespace
+
+extern "C" {
+std::array<int*, kTableSize> loader_test_relr_table =
+    make_table(std::make_index_sequence<kTableSize>());
+
+int* loader_test_relr_values() {
+  return values;
+}
+}
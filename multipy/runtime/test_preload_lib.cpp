@@ -0,0 +1,40 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+// Libraries preload_libraries loads in the loader tests in test_deploy.cpp,
+// each built from this file with one of the macros below defined: a chain
+// base <- mid <- top, and two libraries which need each other.
+
+extern "C" {
+#if defined(TEST_PRELOAD_BASE)
+int test_preload_base() {
+  return 1;
+}
+#elif defined(TEST_PRELOAD_MID)
+int test_preload_base();
+int test_preload_mid() {
+  return test_preload_base() + 10;
+}
+#elif defined(TEST_PRELOAD_TOP)
+int test_preload_mid();
+int test_preload_top() {
+  return test_preload_mid() + 100;
+}
+#elif defined(TEST_PRELOAD_CYCLE_A)
+int test_preload_cycle_b();
+int test_preload_cycle_a() {
+  return 2;
+}
+int test_preload_cycle() {
+  return test_preload_cycle_b();
+}
+#elif defined(TEST_PRELOAD_CYCLE_B)
+int test_preload_cycle_a();
+int test_preload_cycle_b() {
+  return test_preload_cycle_a() * 10;
+}
+#endif
+}
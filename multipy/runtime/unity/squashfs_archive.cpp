@@ -0,0 +1,606 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <multipy/runtime/unity/squashfs_archive.h>
+
+#include <fcntl.h>
+#include <lzma.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+namespace torch {
+namespace deploy {
+
+namespace {
+
+// see https://dr-emann.github.io/squashfs/ for the layout of the image
+constexpr uint32_t kMagic = 0x73717368;
+constexpr size_t kSuperblockSize = 96;
+constexpr uint16_t kGzip = 1;
+constexpr uint16_t kXz = 4;
+constexpr uint16_t kZstd = 6;
+
+constexpr uint16_t kBasicDirectory = 1;
+constexpr uint16_t kBasicFile = 2;
+constexpr uint16_t kBasicSymlink = 3;
+constexpr uint16_t kExtendedDirectory = 8;
+constexpr uint16_t kExtendedFile = 9;
+constexpr uint16_t kExtendedSymlink = 10;
+
+constexpr uint32_t kNoFragment = 0xffffffff;
+constexpr uint32_t kUncompressedBlock = 1 << 24;
+constexpr uint16_t kUncompressedMetadata = 1 << 15;
+constexpr size_t kMetadataBlockSize = 8192;
+constexpr size_t kFragmentEntrySize = 16;
+constexpr int kMaxSymlinks = 40;
+
+// squashfs is little endian, and so are all the platforms deploy runs on
+template <typename T>
+T load(const char* p) {
+  T value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+std::vector<std::string_view> splitPath(std::string_view path) {
+  std::vector<std::string_view> parts;
+  while (!path.empty()) {
+    auto slash = path.find('/');
+    auto part = path.substr(0, slash);
+    if (!part.empty() && part != ".") {
+      parts.push_back(part);
+    }
+    if (slash == std::string_view::npos) {
+      break;
+    }
+    path.remove_prefix(slash + 1);
+  }
+  return parts;
+}
+
+void makeDirectories(const std::string& path) {
+  for (auto slash = path.find('/', 1); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    auto dir = path.substr(0, slash);
+    MULTIPY_CHECK(
+        mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST,
+        "Failed to create directory " + dir + ": " + strerror(errno));
+  }
+}
+
+// The directories of the image the system loader searches for the libraries
+// the ELF file at `path` in the image needs, in order, see ld.so(8): DT_RPATH
+// unless there is a DT_RUNPATH, LD_LIBRARY_PATH, which has the root of the
+// image, then DT_RUNPATH. Only the directories relative to $ORIGIN are in the
+// image. An empty directory is the root.
+std::vector<std::string> librarySearchPath(
+    const ElfFile& elfFile,
+    const std::string& path) {
+  auto slash = path.rfind('/');
+  std::string origin = slash == std::string::npos ? "" : path.substr(0, slash);
+  std::vector<std::string> dirs;
+  auto add = [&](std::string_view list) {
+    while (!list.empty()) {
+      auto colon = list.find(':');
+      auto dir = list.substr(0, colon);
+      list.remove_prefix(colon == std::string_view::npos ? list.size()
+                                                         : colon + 1);
+      for (std::string_view token : {"$ORIGIN", "${ORIGIN}"}) {
+        if (dir.compare(0, token.size(), token) != 0) {
+          continue;
+        }
+        auto rest = dir.substr(token.size());
+        // neither a longer name nor another token, like $LIB
+        if ((rest.empty() || rest[0] == '/') &&
+            rest.find('$') == std::string_view::npos) {
+          dirs.push_back(origin + std::string(rest));
+        }
+      }
+    }
+  };
+  auto runpath = elfFile.dynamicStrings(DT_RUNPATH);
+  if (runpath.empty()) {
+    for (const auto& list : elfFile.dynamicStrings(DT_RPATH)) {
+      add(list);
+    }
+  }
+  dirs.emplace_back();
+  for (const auto& list : runpath) {
+    add(list);
+  }
+  return dirs;
+}
+
+} // namespace
+
+bool SquashFsArchive::Inode::isDirectory() const {
+  return type == kBasicDirectory || type == kExtendedDirectory;
+}
+
+bool SquashFsArchive::Inode::isFile() const {
+  return type == kBasicFile || type == kExtendedFile;
+}
+
+bool SquashFsArchive::Inode::isSymlink() const {
+  return type == kBasicSymlink || type == kExtendedSymlink;
+}
+
+/// Reads a run of bytes that may span several consecutive metadata blocks.
+class SquashFsArchive::MetadataReader {
+ public:
+  MetadataReader(const SquashFsArchive& archive, uint64_t pos, size_t offset)
+      : archive_(archive),
+        block_(archive.readMetadataBlock(pos)),
+        offset_(offset) {}
+
+  std::string read(size_t size) {
+    std::string result;
+    while (result.size() < size) {
+      if (offset_ == block_->data.size()) {
+        block_ = archive_.readMetadataBlock(block_->next);
+        offset_ = 0;
+      }
+      auto n = std::min(size - result.size(), block_->data.size() - offset_);
+      result.append(block_->data, offset_, n);
+      offset_ += n;
+    }
+    return result;
+  }
+
+  template <typename T>
+  T get() {
+    return load<T>(read(sizeof(T)).data());
+  }
+
+ private:
+  const SquashFsArchive& archive_;
+  std::shared_ptr<const MetadataBlock> block_;
+  size_t offset_;
+};
+
+bool SquashFsArchive::isSupported(const char* image, size_t size) {
+  if (size < kSuperblockSize || load<uint32_t>(image) != kMagic ||
+      load<uint16_t>(image + 28) != 4) {
+    return false;
+  }
+  auto compressor = load<uint16_t>(image + 20);
+  return compressor == kGzip || compressor == kXz || compressor == kZstd;
+}
+
+SquashFsArchive::SquashFsArchive(
+    Section section,
+    size_t offset,
+    std::string materializeDir)
+    : EmbeddedArchive(section.name),
+      section_(std::move(section)),
+      image_(section_.start + offset),
+      size_(section_.len - offset),
+      materializeDir_(std::move(materializeDir)) {
+  MULTIPY_CHECK(
+      offset < section_.len && isSupported(image_, size_),
+      "Unsupported squashfs image in " + std::string(section_.name));
+  blockSize_ = load<uint32_t>(image_ + 12);
+  compressor_ = load<uint16_t>(image_ + 20);
+  rootInode_ = load<uint64_t>(image_ + 32);
+  inodeTable_ = load<uint64_t>(image_ + 64);
+  directoryTable_ = load<uint64_t>(image_ + 72);
+  fragmentTable_ = load<uint64_t>(image_ + 80);
+}
+
+std::optional<std::string> SquashFsArchive::read(std::string_view path) const {
+  auto inode = lookup(path);
+  if (!inode || !inode->isFile()) {
+    return std::nullopt;
+  }
+  return readFile(*inode);
+}
+
+bool SquashFsArchive::isDirectory(std::string_view path) const {
+  auto inode = lookup(path);
+  return inode && inode->isDirectory();
+}
+
+std::vector<std::string> SquashFsArchive::list(std::string_view path) const {
+  std::vector<std::string> names;
+  uint64_t ref = 0;
+  auto inode = lookup(path, &ref);
+  if (inode && inode->isDirectory()) {
+    for (const auto& entry : *readDirectory(ref)) {
+      names.push_back(entry.first);
+    }
+  }
+  return names;
+}
+
+std::optional<std::string> SquashFsArchive::materialize(
+    std::string_view path) const {
+  // written at the path the file has in the image, which keeps ".." from
+  // leaving materializeDir_ and a file found through symlinks from being
+  // written twice
+  std::string resolved;
+  auto inode = lookup(path, nullptr, &resolved);
+  if (!inode || !inode->isFile()) {
+    return std::nullopt;
+  }
+  std::string target = materializeDir_ + "/" + resolved;
+  std::lock_guard<std::recursive_mutex> guard(materializeMutex_);
+  if (materialized_.count(target) == 0) {
+    // files only ever appear complete, so one of the right size was written
+    // by an earlier run for the same image
+    struct stat s;
+    if (stat(target.c_str(), &s) != 0 ||
+        static_cast<uint64_t>(s.st_size) != inode->fileSize) {
+      materializeFile(target, *inode);
+    }
+    // marked before its libraries, which may need it in turn
+    materialized_.insert(target);
+    try {
+      // the libraries it links against may come from the image as well, and
+      // the system loader can only find them on disk
+      if (isElfFile(target.c_str())) {
+        ElfFile elfFile(target.c_str());
+        auto dirs = librarySearchPath(elfFile, resolved);
+        for (const auto& needed : elfFile.dynamicStrings(DT_NEEDED)) {
+          if (auto library = findLibrary(needed, dirs)) {
+            materialize(*library);
+          }
+        }
+      }
+    } catch (...) {
+      materialized_.erase(target);
+      throw;
+    }
+  }
+  return target;
+}
+
+std::optional<SquashFsArchive::Inode> SquashFsArchive::lookup(
+    std::string_view path,
+    uint64_t* foundRef,
+    std::string* resolved) const {
+  // the directories leading to the current one, for "..", and their names
+  std::vector<uint64_t> parents;
+  std::vector<std::string_view> names;
+  uint64_t ref = rootInode_;
+  Inode inode = readInode(ref);
+  auto parts = splitPath(path);
+  std::deque<std::string> targets; // keeps the parts of symlinks alive
+  int symlinks = 0;
+  for (size_t i = 0; i < parts.size(); ++i) {
+    if (!inode.isDirectory()) {
+      return std::nullopt;
+    }
+    if (parts[i] == "..") {
+      if (!parents.empty()) {
+        ref = parents.back();
+        parents.pop_back();
+        names.pop_back();
+        inode = readInode(ref);
+      }
+      continue;
+    }
+    auto directory = readDirectory(ref);
+    auto it = directory->find(std::string(parts[i]));
+    if (it == directory->end()) {
+      return std::nullopt;
+    }
+    auto child = readInode(it->second);
+    if (child.isSymlink()) {
+      if (++symlinks > kMaxSymlinks) {
+        return std::nullopt;
+      }
+      // continue with the target in place of this part
+      targets.push_back(std::move(child.target));
+      auto target = splitPath(targets.back());
+      if (!targets.back().empty() && targets.back()[0] == '/') {
+        ref = rootInode_;
+        inode = readInode(ref);
+        parents.clear();
+        names.clear();
+      }
+      parts.erase(parts.begin() + i);
+      parts.insert(parts.begin() + i, target.begin(), target.end());
+      --i;
+      continue;
+    }
+    parents.push_back(ref);
+    names.push_back(parts[i]);
+    ref = it->second;
+    inode = std::move(child);
+  }
+  if (foundRef) {
+    *foundRef = ref;
+  }
+  if (resolved) {
+    resolved->clear();
+    for (auto name : names) {
+      resolved->append(resolved->empty() ? "" : "/").append(name);
+    }
+  }
+  return inode;
+}
+
+SquashFsArchive::Inode SquashFsArchive::readInode(uint64_t ref) const {
+  MetadataReader reader(*this, inodeTable_ + (ref >> 16), ref & 0xffff);
+  auto header = reader.read(16);
+  Inode inode;
+  inode.type = load<uint16_t>(header.data());
+  inode.mode = load<uint16_t>(header.data() + 2);
+  switch (inode.type) {
+    case kBasicDirectory: {
+      auto fields = reader.read(16);
+      inode.directoryBlock = load<uint32_t>(fields.data());
+      inode.directorySize = load<uint16_t>(fields.data() + 8);
+      inode.directoryOffset = load<uint16_t>(fields.data() + 10);
+      break;
+    }
+    case kExtendedDirectory: {
+      auto fields = reader.read(24);
+      inode.directorySize = load<uint32_t>(fields.data() + 4);
+      inode.directoryBlock = load<uint32_t>(fields.data() + 8);
+      inode.directoryOffset = load<uint16_t>(fields.data() + 18);
+      break;
+    }
+    case kBasicFile:
+    case kExtendedFile: {
+      if (inode.type == kBasicFile) {
+        auto fields = reader.read(16);
+        inode.blocksStart = load<uint32_t>(fields.data());
+        inode.fragment = load<uint32_t>(fields.data() + 4);
+        inode.fragmentOffset = load<uint32_t>(fields.data() + 8);
+        inode.fileSize = load<uint32_t>(fields.data() + 12);
+      } else {
+        auto fields = reader.read(40);
+        inode.blocksStart = load<uint64_t>(fields.data());
+        inode.fileSize = load<uint64_t>(fields.data() + 8);
+        inode.fragment = load<uint32_t>(fields.data() + 28);
+        inode.fragmentOffset = load<uint32_t>(fields.data() + 32);
+      }
+      auto blocks = inode.fileSize / blockSize_;
+      if (inode.fragment == kNoFragment && inode.fileSize % blockSize_ != 0) {
+        ++blocks;
+      }
+      auto sizes = reader.read(blocks * sizeof(uint32_t));
+      inode.blockSizes.resize(blocks);
+      memcpy(inode.blockSizes.data(), sizes.data(), sizes.size());
+      break;
+    }
+    case kBasicSymlink:
+    case kExtendedSymlink: {
+      auto fields = reader.read(8);
+      inode.target = reader.read(load<uint32_t>(fields.data() + 4));
+      break;
+    }
+    default:
+      // devices, fifos and sockets have nothing to read
+      break;
+  }
+  return inode;
+}
+
+std::shared_ptr<const SquashFsArchive::Directory>
+SquashFsArchive::readDirectory(uint64_t ref) const {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = directories_.find(ref);
+    if (it != directories_.end()) {
+      return it->second;
+    }
+  }
+  auto inode = readInode(ref);
+  auto directory = std::make_shared<Directory>();
+  // the size includes the "." and ".." entries, which are not stored
+  if (inode.directorySize > 3) {
+    MetadataReader reader(
+        *this,
+        directoryTable_ + inode.directoryBlock,
+        inode.directoryOffset);
+    int64_t remaining = inode.directorySize - 3;
+    while (remaining > 0) {
+      auto header = reader.read(12);
+      auto count = load<uint32_t>(header.data()) + 1;
+      uint64_t start = load<uint32_t>(header.data() + 4);
+      remaining -= 12;
+      for (uint32_t i = 0; i < count; ++i) {
+        auto entry = reader.read(8);
+        auto nameSize = load<uint16_t>(entry.data() + 6) + 1;
+        auto name = reader.read(nameSize);
+        (*directory)[std::move(name)] =
+            (start << 16) | load<uint16_t>(entry.data());
+        remaining -= 8 + nameSize;
+      }
+    }
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  return directories_.emplace(ref, std::move(directory)).first->second;
+}
+
+std::shared_ptr<const SquashFsArchive::MetadataBlock>
+SquashFsArchive::readMetadataBlock(uint64_t pos) const {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = metadataBlocks_.find(pos);
+    if (it != metadataBlocks_.end()) {
+      return it->second;
+    }
+  }
+  MULTIPY_CHECK(pos + 2 <= size_, "Metadata block out of range");
+  auto header = load<uint16_t>(image_ + pos);
+  size_t size = header & ~kUncompressedMetadata;
+  MULTIPY_CHECK(pos + 2 + size <= size_, "Metadata block out of range");
+  auto block = std::make_shared<MetadataBlock>();
+  block->data = header & kUncompressedMetadata
+      ? std::string(image_ + pos + 2, size)
+      : decompress(image_ + pos + 2, size, kMetadataBlockSize);
+  block->next = pos + 2 + size;
+  std::lock_guard<std::mutex> guard(mutex_);
+  return metadataBlocks_.emplace(pos, std::move(block)).first->second;
+}
+
+std::shared_ptr<const std::string> SquashFsArchive::readFragment(
+    uint32_t index) const {
+  auto blockPos = load<uint64_t>(
+      image_ + fragmentTable_ +
+      index / (kMetadataBlockSize / kFragmentEntrySize) * sizeof(uint64_t));
+  MetadataReader reader(
+      *this,
+      blockPos,
+      index % (kMetadataBlockSize / kFragmentEntrySize) * kFragmentEntrySize);
+  auto start = reader.get<uint64_t>();
+  auto size = reader.get<uint32_t>();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (fragment_ && fragmentPos_ == start) {
+      return fragment_;
+    }
+  }
+  auto onDiskSize = size & ~kUncompressedBlock;
+  MULTIPY_CHECK(start + onDiskSize <= size_, "Fragment out of range");
+  auto fragment = std::make_shared<const std::string>(
+      size & kUncompressedBlock
+          ? std::string(image_ + start, onDiskSize)
+          : decompress(image_ + start, onDiskSize, blockSize_));
+  std::lock_guard<std::mutex> guard(mutex_);
+  fragmentPos_ = start;
+  fragment_ = fragment;
+  return fragment;
+}
+
+std::string SquashFsArchive::readFile(const Inode& inode) const {
+  std::string contents;
+  contents.reserve(inode.fileSize);
+  uint64_t pos = inode.blocksStart;
+  for (auto blockSize : inode.blockSizes) {
+    size_t expected = std::min<uint64_t>(
+        blockSize_, inode.fileSize - contents.size());
+    auto onDiskSize = blockSize & ~kUncompressedBlock;
+    if (onDiskSize == 0) {
+      // sparse block
+      contents.append(expected, '\0');
+      continue;
+    }
+    MULTIPY_CHECK(pos + onDiskSize <= size_, "Data block out of range");
+    if (blockSize & kUncompressedBlock) {
+      contents.append(image_ + pos, onDiskSize);
+    } else {
+      contents += decompress(image_ + pos, onDiskSize, blockSize_);
+    }
+    pos += onDiskSize;
+  }
+  if (inode.fragment != kNoFragment) {
+    auto fragment = readFragment(inode.fragment);
+    size_t tail = inode.fileSize - contents.size();
+    MULTIPY_CHECK(
+        inode.fragmentOffset + tail <= fragment->size(),
+        "Fragment out of range");
+    contents.append(*fragment, inode.fragmentOffset, tail);
+  }
+  MULTIPY_CHECK(contents.size() == inode.fileSize, "Corrupted file");
+  return contents;
+}
+
+std::string SquashFsArchive::decompress(
+    const char* data,
+    size_t size,
+    size_t maxSize) const {
+  std::string result(maxSize, '\0');
+  size_t resultSize = maxSize;
+  bool ok = false;
+  if (compressor_ == kGzip) {
+    uLongf n = maxSize;
+    ok = uncompress(
+             reinterpret_cast<Bytef*>(&result[0]),
+             &n,
+             reinterpret_cast<const Bytef*>(data),
+             size) == Z_OK;
+    resultSize = n;
+  } else if (compressor_ == kXz) {
+    uint64_t memlimit = UINT64_MAX;
+    size_t inPos = 0;
+    size_t outPos = 0;
+    ok = lzma_stream_buffer_decode(
+             &memlimit,
+             0,
+             nullptr,
+             reinterpret_cast<const uint8_t*>(data),
+             &inPos,
+             size,
+             reinterpret_cast<uint8_t*>(&result[0]),
+             &outPos,
+             maxSize) == LZMA_OK;
+    resultSize = outPos;
+  } else if (compressor_ == kZstd) {
+    resultSize = ZSTD_decompress(&result[0], maxSize, data, size);
+    ok = !ZSTD_isError(resultSize);
+  }
+  MULTIPY_CHECK(
+      ok, "Failed to decompress a block of " + std::string(section_.name));
+  result.resize(resultSize);
+  return result;
+}
+
+void SquashFsArchive::materializeFile(
+    const std::string& path,
+    const Inode& inode) const {
+  makeDirectories(path);
+  auto contents = readFile(inode);
+  // written under a temporary name first, so that other processes sharing
+  // the directory never see a partial file
+  auto tmp = path + ".tmp" + std::to_string(getpid());
+  int fd = open(
+      tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, inode.mode & 0777);
+  MULTIPY_CHECK(fd >= 0, "Failed to create " + tmp + ": " + strerror(errno));
+  try {
+    size_t written = 0;
+    while (written < contents.size()) {
+      auto n = write(fd, contents.data() + written, contents.size() - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      MULTIPY_CHECK(n > 0, "Failed to write " + tmp + ": " + strerror(errno));
+      written += n;
+    }
+    int r = close(fd);
+    fd = -1;
+    MULTIPY_CHECK(r == 0, "Failed to write " + tmp + ": " + strerror(errno));
+    MULTIPY_CHECK(
+        rename(tmp.c_str(), path.c_str()) == 0,
+        "Failed to rename " + tmp + ": " + strerror(errno));
+  } catch (...) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(tmp.c_str());
+    throw;
+  }
+}
+
+std::optional<std::string> SquashFsArchive::findLibrary(
+    const std::string& name,
+    const std::vector<std::string>& dirs) const {
+  // names with a slash are paths, which are not searched for
+  if (name.find('/') != std::string::npos) {
+    return std::nullopt;
+  }
+  for (const auto& dir : dirs) {
+    auto path = dir.empty() ? name : dir + "/" + name;
+    auto inode = lookup(path);
+    if (inode && inode->isFile()) {
+      return path;
+    }
+  }
+  return std::nullopt;
+}
+
+} // namespace deploy
+} // namespace torch
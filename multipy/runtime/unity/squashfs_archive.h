@@ -0,0 +1,128 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#pragma once
+
+#include <multipy/runtime/elf_file.h>
+#include <multipy/runtime/embedded_archive.h>
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace torch {
+namespace deploy {
+
+/// An EmbeddedArchive reading a squashfs image in place, e.g. the python app
+/// of a XAR embedded in the binary.
+///
+/// Nothing is decompressed up front: directories are listed and files are
+/// decompressed when they are first looked up, so the cost of starting an app
+/// is proportional to what it imports rather than to the size of the image.
+/// Only files that native code needs are written to disk by `materialize`,
+/// together with the shared libraries in the image they depend on. Those are
+/// looked up where the system loader looks for them: in the directories of
+/// the image their DT_RPATH or DT_RUNPATH name relative to $ORIGIN, and at
+/// the root of the image, which is expected on LD_LIBRARY_PATH.
+///
+/// Supports images compressed with gzip, xz or zstd.
+class SquashFsArchive : public EmbeddedArchive {
+ public:
+  /// Whether `image` is a squashfs image this reader understands.
+  static bool isSupported(const char* image, size_t size);
+
+  /// Reads the image `offset` bytes into `section`, which is kept mapped for
+  /// the lifetime of the archive. `materializeDir` is where files are written
+  /// to, at their path in the image. It must be specific to the image, files
+  /// already in it are reused.
+  SquashFsArchive(
+      Section section,
+      size_t offset,
+      std::string materializeDir);
+
+  std::optional<std::string> read(std::string_view path) const override;
+  bool isDirectory(std::string_view path) const override;
+  std::optional<std::string> materialize(std::string_view path) const override;
+
+  std::vector<std::string> list(std::string_view path) const override;
+
+ private:
+  struct Inode {
+    uint16_t type{0};
+    uint16_t mode{0};
+    // directories
+    uint32_t directoryBlock{0};
+    uint16_t directoryOffset{0};
+    uint32_t directorySize{0};
+    // regular files
+    uint64_t blocksStart{0};
+    uint64_t fileSize{0};
+    uint32_t fragment{0};
+    uint32_t fragmentOffset{0};
+    std::vector<uint32_t> blockSizes;
+    // symlinks
+    std::string target;
+
+    bool isDirectory() const;
+    bool isFile() const;
+    bool isSymlink() const;
+  };
+  using Directory = std::unordered_map<std::string, uint64_t>;
+  struct MetadataBlock {
+    std::string data;
+    uint64_t next; // position of the block following this one
+  };
+  class MetadataReader;
+
+  // `ref` is set to the reference of the inode that was found, and
+  // `resolved` to its path without symlinks and ".."
+  std::optional<Inode> lookup(
+      std::string_view path,
+      uint64_t* ref = nullptr,
+      std::string* resolved = nullptr) const;
+  Inode readInode(uint64_t ref) const;
+  std::shared_ptr<const Directory> readDirectory(uint64_t ref) const;
+  std::shared_ptr<const MetadataBlock> readMetadataBlock(uint64_t pos) const;
+  std::shared_ptr<const std::string> readFragment(uint32_t index) const;
+  std::string readFile(const Inode& inode) const;
+  std::string decompress(const char* data, size_t size, size_t maxSize) const;
+  void materializeFile(const std::string& path, const Inode& inode) const;
+  std::optional<std::string> findLibrary(
+      const std::string& name,
+      const std::vector<std::string>& dirs) const;
+
+  Section section_;
+  const char* image_;
+  size_t size_;
+  std::string materializeDir_;
+
+  uint16_t compressor_;
+  uint32_t blockSize_;
+  uint64_t rootInode_;
+  uint64_t inodeTable_;
+  uint64_t directoryTable_;
+  uint64_t fragmentTable_;
+
+  mutable std::mutex mutex_;
+  mutable std::unordered_map<uint64_t, std::shared_ptr<const MetadataBlock>>
+      metadataBlocks_;
+  mutable std::unordered_map<uint64_t, std::shared_ptr<const Directory>>
+      directories_;
+  // small files are packed into shared fragment blocks, keep the last one
+  mutable uint64_t fragmentPos_{0};
+  mutable std::shared_ptr<const std::string> fragment_;
+
+  mutable std::recursive_mutex materializeMutex_;
+  mutable std::unordered_set<std::string> materialized_;
+};
+
+} // namespace deploy
+} // namespace torch
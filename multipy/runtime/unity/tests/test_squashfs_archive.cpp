@@ -0,0 +1,231 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+
+#include <elf.h>
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+#include <multipy/runtime/unity/squashfs_archive.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace torch {
+namespace deploy {
+namespace {
+
+std::string readFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(
+      std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& contents) {
+  std::ofstream(path, std::ios::binary) << contents;
+}
+
+std::string makeTempDir() {
+  char dir[] = "/tmp/torch_deploy_squashfs_unittest_XXXXXX";
+  EXPECT_NE(mkdtemp(dir), nullptr);
+  return dir;
+}
+
+// Larger than a block, so that it is stored in blocks and a fragment.
+std::string bigContents() {
+  std::string contents;
+  for (int i = 0; contents.size() < 300000; ++i) {
+    contents += fmt::format("line {}\n", i * 7919 % 100003);
+  }
+  return contents;
+}
+
+// An ELF file with just enough of a shared library to be read for the
+// libraries it needs and its DT_RUNPATH.
+std::string fakeLibrary(
+    const std::vector<std::string>& needed,
+    const std::string& runpath) {
+  std::string dynstr(1, '\0');
+  std::vector<Elf64_Dyn> dynamic;
+  auto add = [&](Elf64_Sxword tag, const std::string& value) {
+    Elf64_Dyn dyn{};
+    dyn.d_tag = tag;
+    dyn.d_un.d_val = dynstr.size();
+    dynamic.push_back(dyn);
+    dynstr += value + '\0';
+  };
+  for (const auto& name : needed) {
+    add(DT_NEEDED, name);
+  }
+  add(DT_RUNPATH, runpath);
+  dynamic.push_back(Elf64_Dyn{});
+  const std::string shstrtab("\0.dynamic\0.dynstr\0.shstrtab\0", 28);
+
+  // the header, the sections, then their headers
+  std::string contents(sizeof(Elf64_Ehdr), '\0');
+  std::vector<Elf64_Shdr> shdrs(1);
+  auto append = [&](uint32_t name, uint32_t type, const char* data, size_t n) {
+    contents.resize((contents.size() + 7) & ~7);
+    Elf64_Shdr shdr{};
+    shdr.sh_name = name;
+    shdr.sh_type = type;
+    shdr.sh_offset = contents.size();
+    shdr.sh_size = n;
+    shdrs.push_back(shdr);
+    contents.append(data, n);
+  };
+  append(
+      1,
+      SHT_DYNAMIC,
+      reinterpret_cast<const char*>(dynamic.data()),
+      dynamic.size() * sizeof(Elf64_Dyn));
+  append(10, SHT_STRTAB, dynstr.data(), dynstr.size());
+  append(18, SHT_STRTAB, shstrtab.data(), shstrtab.size());
+  contents.resize((contents.size() + 7) & ~7);
+
+  Elf64_Ehdr ehdr{};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_DYN;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shoff = contents.size();
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = shdrs.size();
+  ehdr.e_shstrndx = shdrs.size() - 1;
+  memcpy(&contents[0], &ehdr, sizeof(ehdr));
+  contents.append(
+      reinterpret_cast<const char*>(shdrs.data()),
+      shdrs.size() * sizeof(Elf64_Shdr));
+  return contents;
+}
+
+class SquashFsArchiveTest : public ::testing::TestWithParam<const char*> {
+ protected:
+  void SetUp() override {
+    root_ = makeTempDir();
+    auto tree = root_ + "/tree";
+    mkdir(tree.c_str(), 0755);
+    mkdir((tree + "/pkg").c_str(), 0755);
+    mkdir((tree + "/pkg/sub").c_str(), 0755);
+    mkdir((tree + "/ext").c_str(), 0755);
+    mkdir((tree + "/libs").c_str(), 0755);
+    mkdir((tree + "/other").c_str(), 0755);
+    writeFile(tree + "/pkg/__init__.py", "x = 1\n");
+    writeFile(tree + "/pkg/mod.py", "y = 2\n");
+    writeFile(tree + "/pkg/empty.txt", "");
+    writeFile(tree + "/pkg/big.bin", bigContents());
+    symlink("mod.py", (tree + "/pkg/link.py").c_str());
+    symlink("../mod.py", (tree + "/pkg/sub/up.py").c_str());
+    symlink("/pkg", (tree + "/abs").c_str());
+    // libraries needing others in the directories of their DT_RUNPATH, at
+    // the root, or nowhere the system loader would look
+    writeFile(
+        tree + "/ext/ext.so",
+        fakeLibrary(
+            {"libdep.so", "libroot.so", "libnowhere.so"},
+            "$ORIGIN/../libs:/usr/lib"));
+    writeFile(
+        tree + "/libs/libdep.so", fakeLibrary({"libc.so.6"}, "${ORIGIN}"));
+    writeFile(tree + "/libs/libc.so.6", "not really libc");
+    writeFile(tree + "/libroot.so", "root");
+    writeFile(tree + "/other/libnowhere.so", "nowhere");
+
+    image_ = root_ + "/image.squashfs";
+    auto command = fmt::format(
+        "mksquashfs {} {} -comp {} -noappend -quiet > /dev/null 2>&1",
+        tree,
+        image_,
+        GetParam());
+    if (system(command.c_str()) != 0) {
+      GTEST_SKIP() << "mksquashfs cannot create " << GetParam() << " images";
+    }
+    auto file = std::make_shared<MemFile>(image_.c_str());
+    ASSERT_TRUE(SquashFsArchive::isSupported(file->data(), file->size()));
+    materializeDir_ = root_ + "/materialized";
+    archive_ = std::make_unique<SquashFsArchive>(
+        Section(file, "image", file->data(), file->size()),
+        0,
+        materializeDir_);
+  }
+
+  void TearDown() override {
+    archive_.reset();
+    auto command = fmt::format("rm -rf {}", root_);
+    EXPECT_EQ(system(command.c_str()), 0);
+  }
+
+  std::string root_;
+  std::string image_;
+  std::string materializeDir_;
+  std::unique_ptr<SquashFsArchive> archive_;
+};
+
+TEST_P(SquashFsArchiveTest, ReadsFiles) {
+  // small files are stored in fragments
+  EXPECT_EQ(archive_->read("pkg/__init__.py"), "x = 1\n");
+  EXPECT_EQ(archive_->read("pkg/mod.py"), "y = 2\n");
+  EXPECT_EQ(archive_->read("pkg/empty.txt"), "");
+  EXPECT_EQ(archive_->read("pkg/big.bin"), bigContents());
+  EXPECT_EQ(archive_->read("pkg/missing.py"), std::nullopt);
+  EXPECT_EQ(archive_->read("pkg"), std::nullopt);
+}
+
+TEST_P(SquashFsArchiveTest, ResolvesPaths) {
+  EXPECT_EQ(archive_->read("pkg/link.py"), "y = 2\n");
+  EXPECT_EQ(archive_->read("pkg/sub/up.py"), "y = 2\n");
+  EXPECT_EQ(archive_->read("abs/mod.py"), "y = 2\n");
+  EXPECT_EQ(archive_->read("pkg/sub/../mod.py"), "y = 2\n");
+  // ".." stops at the root of the image
+  EXPECT_EQ(archive_->read("../../pkg/mod.py"), "y = 2\n");
+  EXPECT_TRUE(archive_->isDirectory("pkg/sub"));
+  EXPECT_TRUE(archive_->isDirectory("abs"));
+  EXPECT_FALSE(archive_->isDirectory("pkg/mod.py"));
+
+  auto names = archive_->list("pkg");
+  std::sort(names.begin(), names.end());
+  EXPECT_EQ(
+      names,
+      std::vector<std::string>(
+          {"__init__.py", "big.bin", "empty.txt", "link.py", "mod.py", "sub"}));
+}
+
+TEST_P(SquashFsArchiveTest, MaterializesLibrariesWithTheirDependencies) {
+  // written at its path in the image, whichever way it is looked up
+  auto path = archive_->materialize("../pkg/../ext/ext.so");
+  ASSERT_EQ(path, materializeDir_ + "/ext/ext.so");
+  EXPECT_EQ(readFile(*path), readFile(root_ + "/tree/ext/ext.so"));
+  EXPECT_EQ(
+      readFile(materializeDir_ + "/libs/libdep.so"),
+      readFile(root_ + "/tree/libs/libdep.so"));
+  EXPECT_EQ(readFile(materializeDir_ + "/libs/libc.so.6"), "not really libc");
+  EXPECT_EQ(readFile(materializeDir_ + "/libroot.so"), "root");
+  auto nowhere = materializeDir_ + "/other/libnowhere.so";
+  EXPECT_NE(access(nowhere.c_str(), F_OK), 0);
+  EXPECT_EQ(archive_->materialize("ext/ext.so"), path);
+
+  EXPECT_EQ(
+      archive_->materialize("abs/link.py"), materializeDir_ + "/pkg/mod.py");
+  EXPECT_EQ(archive_->materialize("pkg/missing.so"), std::nullopt);
+  EXPECT_EQ(archive_->materialize("pkg/sub"), std::nullopt);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Compressors,
+    SquashFsArchiveTest,
+    ::testing::Values("gzip", "xz", "zstd"));
+
+} // namespace
+} // namespace deploy
+} // namespace torch
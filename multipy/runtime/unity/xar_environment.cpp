@@ -9,8 +9,14 @@
 #include <fmt/format.h>
 #include <multipy/runtime/Exception.h>
 #include <multipy/runtime/elf_file.h>
+#include <multipy/runtime/unity/squashfs_archive.h>
 #include <multipy/runtime/unity/xar_environment.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <array>
+#include <climits>
+#include <optional>
+#include <unordered_set>
 
 namespace torch {
 namespace deploy {
@@ -25,18 +31,15 @@ XarEnvironment::XarEnvironment(std::string exePath, std::string pythonAppDir)
 
 // NOLINTNEXTLINE(modernize-use-equals-default)
 XarEnvironment::~XarEnvironment() {
-  // We should delete the pythonAppDir_ here. However if we did that, the
-  // next time we run the executable, we will get issue to load shared
-  // libraries since the path we add to LD_LIBRARY_PATH does not exist yet.
-  // Also the pythonAppDir_ will anyway be re-created the next time we run the
-  // executable.
-  //
-  // Keep the teardown step a noop for now.
+  // The pythonAppDir_ is deliberately kept. The next run of the same binary
+  // reuses it, and the path we add to LD_LIBRARY_PATH has to exist before the
+  // executable starts to be able to load shared libraries from it.
 }
 
 void XarEnvironment::configureInterpreter(Interpreter* interp) {
   auto I = interp->acquireSession();
-  I.global("sys", "path").attr("append")({pythonAppRoot_});
+  I.global("sys", "path").attr("append")(
+      {archive_ ? archive_->pythonPath() : pythonAppKeyedRoot_});
 }
 
 /*
@@ -109,54 +112,179 @@ void XarEnvironment::setupPythonApp() {
       << "the note in the code for more details";
 
   /*
-   * NOTE: we remove the pythonAppDir_ below. Anything under it will be gone.
-   * Normally the directory just contains potential stuff left over from the
-   * past runs. It should be pretty safe to discard them.
+   * The python app is kept under a directory keyed by the payload, so that a
+   * restart of the same binary reuses what an earlier run wrote. Nothing is
+   * ever written into a keyed directory that other processes could see half
+   * done: extractions are renamed into place as a whole, and materialized
+   * files one by one. pythonAppRoot_ is a symlink to the directory of the
+   * binary that ran last, for LD_LIBRARY_PATH.
+   *
+   * Binaries with different payloads that share pythonAppDir_ point the link
+   * at their own directory when they start. A process that started earlier
+   * then finds the libraries of the other binary through LD_LIBRARY_PATH,
+   * for those it had not loaded yet. The libraries that are preloaded come
+   * from the keyed directory, so it only affects the others. Give such
+   * binaries their own python app directories.
    */
-  std::string rmCmd = fmt::format("rm -rf {}", pythonAppDir_);
-  MULTIPY_CHECK(system(rmCmd.c_str()) == 0, "Fail to remove the directory.");
-
-  // recreate the directory
   auto r = mkdir(pythonAppDir_.c_str(), 0777);
-  MULTIPY_CHECK(r == 0, "Failed to create directory: " + strerror(errno));
-
-  std::string pythonAppArchive = std::string(pythonAppDir_) + "/python_app.xar";
-  auto fp = fopen(pythonAppArchive.c_str(), "wb");
-  MULTIPY_CHECK(fp != nullptr, "Fail to create file: " + strerror(errno));
-  auto written = fwrite(pythonAppPkgStart, 1, pythonAppPkgSize, fp);
-  MULTIPY_CHECK(written == pythonAppPkgSize, "Expected written == size");
-  fclose(fp);
-
-  std::string extractCommand = fmt::format(
-      "unsquashfs -o 4096 -d {} {}", pythonAppRoot_, pythonAppArchive);
-  r = system(extractCommand.c_str());
   MULTIPY_CHECK(
-      r == 0,
-      "Fail to extract the python package" + std::to_string(r) +
-          extractCommand.c_str());
+      r == 0 || errno == EEXIST,
+      "Failed to create directory: " + strerror(errno));
+  const auto& exe = *payloadSection->memfile;
+  std::string key = findBuildId(exe.data(), exe.size());
+  if (key.empty()) {
+    key = "h" + hashContents(pythonAppPkgStart, pythonAppPkgSize);
+  }
+  key = "python_app_" + key + "_" + std::to_string(pythonAppPkgSize);
+  pythonAppKeyedRoot_ = pythonAppDir_ + "/" + key;
+
+  // the squashfs image follows the header of the xar
+  constexpr size_t XAR_HEADER_SIZE = 4096;
+  if (pythonAppPkgSize > XAR_HEADER_SIZE &&
+      SquashFsArchive::isSupported(
+          pythonAppPkgStart + XAR_HEADER_SIZE,
+          pythonAppPkgSize - XAR_HEADER_SIZE)) {
+    // Python modules are read straight out of the section. Only the files
+    // native code needs are written to the python app root, on demand.
+    r = mkdir(pythonAppKeyedRoot_.c_str(), 0777);
+    MULTIPY_CHECK(
+        r == 0 || errno == EEXIST,
+        "Failed to create directory: " + strerror(errno));
+    archive_ = std::make_unique<SquashFsArchive>(
+        *payloadSection, XAR_HEADER_SIZE, pythonAppKeyedRoot_);
+  } else if (!_dirExists(pythonAppKeyedRoot_)) {
+    extractPythonApp(pythonAppPkgStart, pythonAppPkgSize, XAR_HEADER_SIZE);
+  }
+  linkPythonAppRoot(key);
 
   alreadySetupPythonApp_ = true;
 }
 
+void XarEnvironment::extractPythonApp(
+    const char* pkgStart,
+    size_t pkgSize,
+    size_t headerSize) {
+  std::string tmpDir = pythonAppKeyedRoot_ + ".XXXXXX";
+  MULTIPY_CHECK(
+      mkdtemp(tmpDir.data()) != nullptr,
+      "Failed to create directory: " + strerror(errno));
+  std::string rmCmd = fmt::format("rm -rf {}", tmpDir);
+
+  try {
+    std::string pythonAppArchive = tmpDir + "/python_app.xar";
+    auto fp = fopen(pythonAppArchive.c_str(), "wb");
+    MULTIPY_CHECK(fp != nullptr, "Fail to create file: " + strerror(errno));
+    auto written = fwrite(pkgStart, 1, pkgSize, fp);
+    MULTIPY_CHECK(
+        fclose(fp) == 0 && written == pkgSize,
+        "Failed to write " + pythonAppArchive + ": " + strerror(errno));
+
+    std::string extracted = tmpDir + "/python_app_root";
+    std::string extractCommand = fmt::format(
+        "unsquashfs -o {} -d {} {}", headerSize, extracted, pythonAppArchive);
+    auto r = system(extractCommand.c_str());
+    MULTIPY_CHECK(
+        r == 0,
+        "Fail to extract the python package" + std::to_string(r) +
+            extractCommand.c_str());
+
+    // a concurrent launch of the same binary may have won the race, in which
+    // case its extraction is just as good as ours
+    r = rename(extracted.c_str(), pythonAppKeyedRoot_.c_str());
+    MULTIPY_CHECK(
+        r == 0 || errno == EEXIST || errno == ENOTEMPTY,
+        "Failed to rename " + extracted + ": " + strerror(errno));
+  } catch (...) {
+    LOG_IF(WARNING, system(rmCmd.c_str()) != 0)
+        << "Failed to remove the directory " << tmpDir;
+    throw;
+  }
+  MULTIPY_CHECK(system(rmCmd.c_str()) == 0, "Fail to remove the directory.");
+}
+
+void XarEnvironment::linkPythonAppRoot(const std::string& key) {
+  std::array<char, PATH_MAX> target{};
+  auto n = readlink(pythonAppRoot_.c_str(), target.data(), target.size());
+  if (n >= 0 && std::string(target.data(), n) == key) {
+    return;
+  }
+  // replaced atomically, so that concurrent launches always find a link
+  std::string tmpLink = pythonAppRoot_ + ".tmp" + std::to_string(getpid());
+  unlink(tmpLink.c_str());
+  MULTIPY_CHECK(
+      symlink(key.c_str(), tmpLink.c_str()) == 0,
+      "Failed to create symlink " + tmpLink + ": " + strerror(errno));
+  if (rename(tmpLink.c_str(), pythonAppRoot_.c_str()) != 0) {
+    // a directory extracted by an older version. A process of that version
+    // may still be using it, so it is moved aside rather than removed.
+    MULTIPY_CHECK(
+        errno == EISDIR || errno == ENOTEMPTY || errno == EEXIST,
+        "Failed to rename " + tmpLink + ": " + strerror(errno));
+    std::string oldDir = pythonAppRoot_ + ".old" + std::to_string(getpid());
+    if (rename(pythonAppRoot_.c_str(), oldDir.c_str()) == 0) {
+      LOG(WARNING) << "Moved the python app root of an older version to "
+                   << oldDir << ", remove it once that version stopped";
+    }
+    MULTIPY_CHECK(
+        rename(tmpLink.c_str(), pythonAppRoot_.c_str()) == 0,
+        "Failed to rename " + tmpLink + ": " + strerror(errno));
+  }
+}
+
 void XarEnvironment::preloadSharedLibraries() {
-  // preload the following libraries since the CustomLoader has some limitations
+  // preload the following libraries, and the ones of the python app they
+  // need, since the CustomLoader has some limitations
   // 1. CustomLoader can not find the correct order to loader them
   // 2. CustomLoader use RTLD_LOCAL so the symbol defined in one lib can not be
   // used by another
-  std::array<const char*, 3> preloadList = {
-      "libmkl_core.so", "libmkl_intel_thread.so", nullptr};
-  for (int i = 0; preloadList[i]; ++i) {
-    // only preload the library if it exists in pythonAppRoot_
-    auto path = pythonAppRoot_ + "/" + preloadList[i];
-    if (!_fileExists(path)) {
-      LOG(INFO) << "The preload library " << preloadList[i]
+  std::array<const char*, 2> preloadList = {
+      "libmkl_core.so", "libmkl_intel_thread.so"};
+  // the libraries of the python app are at its root, which is on
+  // LD_LIBRARY_PATH. The system loader finds everything else by itself.
+  auto find = [this](const std::string& name) -> std::optional<std::string> {
+    if (archive_) {
+      return archive_->materialize(name);
+    }
+    auto path = pythonAppKeyedRoot_ + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      return path;
+    }
+    return std::nullopt;
+  };
+
+  std::vector<std::string> paths;
+  std::unordered_set<std::string> seen;
+  for (const char* name : preloadList) {
+    auto path = find(name);
+    if (!path) {
+      LOG(INFO) << "The preload library " << name
                 << " does not exist in the python app root, skip loading it";
       continue;
     }
-    MULTIPY_CHECK(
-        dlopen(preloadList[i], RTLD_GLOBAL | RTLD_LAZY) != nullptr,
-        "Fail to open the shared library " + preloadList[i] + ": " + dlerror());
+    seen.insert(name);
+    paths.push_back(std::move(*path));
+  }
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!isElfFile(paths[i].c_str())) {
+      continue;
+    }
+    ElfFile elfFile(paths[i].c_str());
+    for (const auto& needed : elfFile.dynamicStrings(DT_NEEDED)) {
+      // names with a slash are paths, which are not looked up
+      if (needed.find('/') != std::string::npos ||
+          !seen.insert(needed).second) {
+        continue;
+      }
+      if (auto path = find(needed)) {
+        paths.push_back(std::move(*path));
+      }
+    }
   }
+  LOG(INFO) << "Preloading " << paths.size()
+            << " shared libraries from the python app";
+  preloadedLibraries_ =
+      preload_libraries(paths, RTLD_GLOBAL | RTLD_LAZY, /*required=*/true);
 }
 
 } // namespace deploy
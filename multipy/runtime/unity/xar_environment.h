@@ -8,7 +8,11 @@
 
 #include <multipy/runtime/deploy.h>
 #include <multipy/runtime/environment.h>
+#include <multipy/runtime/loader.h>
+#include <multipy/runtime/unity/squashfs_archive.h>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace torch {
 namespace deploy {
@@ -27,12 +31,20 @@ class XarEnvironment : public Environment {
 
  private:
   void setupPythonApp();
+  void extractPythonApp(const char* pkgStart, size_t pkgSize, size_t headerSize);
+  void linkPythonAppRoot(const std::string& key);
   void preloadSharedLibraries();
 
   std::string exePath_;
   std::string pythonAppDir_;
   std::string pythonAppRoot_;
+  // where the python app of this binary is, pythonAppRoot_ links to it
+  std::string pythonAppKeyedRoot_;
   bool alreadySetupPythonApp_ = false;
+  // null if the python app had to be extracted with unsquashfs
+  std::unique_ptr<SquashFsArchive> archive_;
+  // the shared libraries of the python app, kept open for the interpreters
+  std::vector<std::shared_ptr<SystemLibrary>> preloadedLibraries_;
 };
 
 } // namespace deploy